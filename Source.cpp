@@ -1,5 +1,38 @@
 #include <iostream>         // cout, cerr
 #include <cstdlib>          // EXIT_FAILURE
+#include <cstring>          // memcpy
+#include <cstdio>           // snprintf, remove, rename
+#include <cmath>            // ceil
+#include <vector>           // vector
+#include <unordered_map>    // unordered_map
+#include <string>           // string
+#include <fstream>          // ofstream, fstream
+#include <algorithm>        // sort
+#include <chrono>           // steady_clock
+#include <random>           // mt19937
+#include <cstddef>          // offsetof
+#include <cstdint>          // uint64_t
+#include <thread>           // thread
+#include <mutex>            // mutex
+#include <condition_variable>   // condition_variable
+#include <atomic>           // atomic
+#include <deque>            // deque
+#include <functional>       // cref, ref
+#include <sstream>          // ostringstream
+#include <sys/stat.h>       // stat
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>        // CreateFileMapping, MapViewOfFile
+#else
+#include <sys/mman.h>       // mmap
+#include <fcntl.h>          // open
+#include <unistd.h>         // close
+#endif
 #include <GL/glew.h>        // GLEW library
 #include <GLFW/glfw3.h>     // GLFW library
 #define STB_IMAGE_IMPLEMENTATION
@@ -12,13 +45,23 @@
 
 #include <learnOpengl/camera.h> // Camera class
 
+// SSE2 is always available on x64; 32-bit builds fall back to scalar code unless /arch:SSE2 is set
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define USE_SSE2 1
+#include <emmintrin.h>      // SSE2 intrinsics
+#endif
+
+// AVX2 needs /arch:AVX2 (or -mavx2); without it the SSE2 paths are used
+#if defined(__AVX2__)
+#define USE_AVX2 1
+#include <immintrin.h>      // AVX2 intrinsics
+#endif
+
 static const float PI = 3.14159265358979323846f;
 using namespace std; // Standard namespace
 
-/*Shader program Macro*/
-#ifndef GLSL
-#define GLSL(Version, Source) "#version " #Version " core \n" #Source
-#endif
+/*Shader version line, prepended to every shader variant*/
+#define GLSL_VERSION "#version 440 core\n"
 
 // Unnamed namespace
 namespace
@@ -29,15 +72,145 @@ namespace
     const int WINDOW_WIDTH = 800;
     const int WINDOW_HEIGHT = 600;
 
+    // Size of the framebuffer currently rendered to (window or offscreen target)
+    int gViewportWidth = WINDOW_WIDTH;
+    int gViewportHeight = WINDOW_HEIGHT;
+
+    // Options parsed from the command line
+    struct RunOptions
+    {
+        bool headless = false;          // Render offscreen without showing a window
+        int frameCount = 60;            // Frames rendered in headless mode
+        int width = WINDOW_WIDTH;       // Offscreen resolution
+        int height = WINDOW_HEIGHT;
+        float fixedDeltaTime = 1.0f / 60.0f;    // Simulated time step in headless mode
+        std::string capturePrefix = "frame";    // Captures are written to <prefix>_<frame>.ppm
+        int captureEvery = 0;           // Capture every Nth frame (0: only the last frame)
+        bool benchmark = false;         // Fly the scripted camera path and report frame times
+        bool fragmentBenchmark = false; // Benchmark from a fixed close-up where lit surfaces fill the viewport
+        bool lightBenchmark = false;    // Repeat the close-up benchmark for 2 to MAX_POINT_LIGHTS point lights
+        int lightCount = 1;             // Point lights in the scene, the orbiting lamp included
+        bool deferred = false;          // Start with the deferred renderer (F and G switch at runtime)
+        bool depthPrepass = false;      // Lay down the opaque depth with a depth-only program before shading
+        bool shadows = true;            // Shadow maps for the lamp and the key light
+        int shadowResolution = 512;     // Size of each cube face of the shadow maps
+        int shadowTaps = 9;             // Percentage-closer filtering taps per shadow lookup (1 to SHADOW_MAX_TAPS)
+        int warmupFrames = 10;          // Benchmark frames rendered before measuring
+        std::string benchOutput;        // JSON report file (empty: standard output)
+        int propCount = 0;              // Boxes and spheres scattered on the table
+        bool frustumCulling = true;     // Skip entities outside the view frustum
+        bool useBvh = true;             // Cull through the bounding volume hierarchy instead of testing every entity
+        bool occlusionCulling = false;  // Skip entities whose bounding box the previous frames' occlusion queries found hidden
+        bool textureCache = true;       // Load textures from pre-baked .texcache files next to the images
+        bool programCache = true;       // Load linked programs from <programCachePrefix><key>.progbin files
+        std::string programCachePrefix = "shader_";
+        bool flipBenchmark = false;     // Time the image flip variants on the scene textures and exit
+        int flipRepetitions = 50;       // Flips timed per image and variant
+        std::string assetDirectory = "../../3D Scene Interactivity/image/";
+    };
+    RunOptions gOptions;
+
+    // Offscreen framebuffer used by the headless mode
+    struct GLRenderTarget
+    {
+        GLuint fbo;
+        GLuint colorRbo;
+        GLuint depthRbo;
+        int width;
+        int height;
+    };
+
     // variable to handle ortho change
     bool perspective = false;
 
+    // Named parts of the scene mesh
+    enum MeshPart
+    {
+        PART_CUBE,          // Unit cube used by the lamps, both blue cubes and the box props
+        PART_TABLE,
+        PART_TUBE_BODY,
+        PART_TUBE_CAP,
+        PART_OCTAGON,
+        PART_SPHERE,        // Pink "sphere", modelled as a short capped cylinder
+        PART_UV_SPHERE,     // Unit-diameter UV sphere for sphere props
+        MESH_PART_COUNT
+    };
+    const char* const MESH_PART_NAMES[MESH_PART_COUNT] = {
+        "cube", "table", "tube body", "tube cap", "octagon", "sphere", "uv sphere"
+    };
+
+    // Procedural parts are generated at several tessellations, finest first
+    const int MAX_LOD_LEVELS = 3;
+    const int LOD_SEGMENTS[MAX_LOD_LEVELS] = { 32, 16, 8 };
+
+    // Range of the index buffer holding one mesh part
+    struct GLSubMesh
+    {
+        GLuint firstIndex;
+        GLuint nIndices;
+    };
+
+    // Projected bounding-sphere radius (pixels) below which each level hands over to the next coarser one
+    const float LOD_PIXEL_THRESHOLDS[MAX_LOD_LEVELS - 1] = { 100.0f, 35.0f };
+    // Fraction a threshold must be crossed by before the level changes, so objects near it do not flicker
+    const float LOD_HYSTERESIS = 0.15f;
+
+    // Index ranges of every level of detail of a mesh part
+    struct GLMeshPart
+    {
+        GLSubMesh lods[MAX_LOD_LEVELS];
+        int nLods;
+        glm::vec3 boundsMin;    // Object-space bounding box of the finest level
+        glm::vec3 boundsMax;
+    };
+
     // Stores the GL data relative to a given mesh
     struct GLMesh
     {
         GLuint vao;         // Handle for the vertex array object
         GLuint vbo;         // Handle for the vertex buffer object
-        GLuint nVertices;    // Number of indices of the mesh
+        GLuint ebo;         // Handle for the element (index) buffer object
+        GLuint nVertices;   // Number of unique vertices of the mesh
+        GLuint nIndices;    // Number of indices of the mesh
+        GLenum indexType;   // GL_UNSIGNED_SHORT when the vertices fit, GL_UNSIGNED_INT otherwise
+        GLMeshPart parts[MESH_PART_COUNT];
+    };
+
+    // Interleaved vertex layout: position, normal, texture coordinates
+    const GLuint FLOATS_PER_VERTEX = 8;
+
+    // Bitwise copy of one interleaved vertex, used to find identical vertices
+    struct VertexKey
+    {
+        GLuint bits[FLOATS_PER_VERTEX];
+
+        bool operator==(const VertexKey& other) const
+        {
+            return memcmp(bits, other.bits, sizeof(bits)) == 0;
+        }
+    };
+
+    struct VertexKeyHash
+    {
+        size_t operator()(const VertexKey& key) const
+        {
+            // FNV-1a over the vertex bits
+            size_t hash = 2166136261u;
+            for (GLuint i = 0; i < FLOATS_PER_VERTEX; ++i)
+                hash = (hash ^ key.bits[i]) * 16777619u;
+            return hash;
+        }
+    };
+
+    // Collects triangle lists, welds identical vertices and records the index range of each part
+    struct MeshBuilder
+    {
+        std::vector<GLfloat> vertices;  // Unique interleaved vertices
+        std::vector<GLuint> indices;
+        std::unordered_map<VertexKey, GLuint, VertexKeyHash> lookup;
+        GLuint nInputVertices = 0;      // Vertices submitted before welding
+        GLMeshPart parts[MESH_PART_COUNT] = {};
+        MeshPart currentPart = PART_CUBE;   // Part receiving the indices between Begin/EndLod
     };
 
     // Main GLFW window
@@ -45,19 +218,369 @@ namespace
     // Triangle mesh data
     GLMesh gMesh;
 
-    // Texture
-    GLuint gTextureId1;
-    GLuint gTextureId2;
-    GLuint gTextureId3;
-    GLuint gTextureId4;
-    GLuint gTextureId5;
-    GLuint gTextureId6;
+    // Texture: every scene texture is one layer of a single array, bound once per frame
+    GLuint gSceneTextures;
     glm::vec2 gUVScale(1.0f, 1.0f);
     GLint gTexWrapMode = GL_REPEAT;
+    const GLenum SCENE_TEXTURE_UNIT = GL_TEXTURE0;
+
+    // Layers of the scene texture array
+    enum SceneTextureLayer
+    {
+        LAYER_TUBE_BODY,
+        LAYER_CARDBOARD,
+        LAYER_TUBE_CAP,
+        LAYER_OCTAGON,
+        LAYER_BLUE_BOX,
+        LAYER_PINK,
+        SCENE_TEXTURE_COUNT
+    };
+
+    // Image of each layer, relative to the asset directory; all must have the same size
+    const char* const SCENE_TEXTURE_FILES[SCENE_TEXTURE_COUNT] = {
+        "tubebody1.png",
+        "cardboard2.jpg",
+        "tubecap1.png",
+        "octagon.png",
+        "bluebox.png",
+        "pink1.png",
+    };
+
+    // RGBA8 pixels decoded from an image file, bottom row first
+    struct DecodedImage
+    {
+        unsigned char* pixels;      // Owned; released with stbi_image_free
+        int width;
+        int height;
+        int channels;               // Channels stored in the file
+    };
+
+    // Texture cache file (<image>.texcache): header, one TextureCacheLevel per mip level, then the texel payload.
+    // Texels are already flipped and mip-chained, either BC1/BC3 blocks or raw RGBA8, ready for upload as-is.
+    const char TEXTURE_CACHE_MAGIC[4] = { 'T', 'X', 'C', '1' };
+    const uint32_t TEXTURE_CACHE_VERSION = 2;
+
+    struct TextureCacheHeader
+    {
+        char magic[4];
+        uint32_t version;
+        uint64_t pathHash;          // Source image path, so a renamed image is not matched by accident
+        int64_t sourceTime;         // Source modification time and size; the content hash is checked when they differ
+        uint64_t sourceSize;
+        uint64_t contentHash;
+        uint32_t format;            // GL_RGBA8 or a GL_COMPRESSED_* S3TC format
+        uint32_t width;
+        uint32_t height;
+        uint32_t levelCount;
+        uint32_t keepAlpha;         // 0 when baked for opaque use: BC1 even if the image has alpha
+    };
+
+    struct TextureCacheLevel
+    {
+        uint32_t width;
+        uint32_t height;
+        uint64_t offset;            // From the start of the file
+        uint64_t size;
+    };
+
+    // A texture cache file in memory: mapped from disk on a hit, built in memory on a miss
+    struct TextureBlob
+    {
+        const unsigned char* data;
+        size_t size;
+        bool isMapped;
+        std::vector<unsigned char> owned;   // Storage when not mapped
+        bool fromCache;
+        double prepareMs;                   // Decode and bake, or map and validate
+    };
+
+    // Time since startup, used to report how long each startup phase takes
+    std::chrono::steady_clock::time_point gStartupPhaseStart = std::chrono::steady_clock::now();
+
+    // Uniform locations of a linked shader program, looked up once right after linking
+    // (camera and light data live in the uniform blocks below, model data in the instance buffer)
+    struct GLProgramUniforms
+    {
+        GLint uvScale;
+        GLint sceneTextures;
+        GLint shadowMaps;
+        GLint lightViewProjection;  // Shadow caster program only
+        GLint shadowLight;
+    };
 
-    // Shader program
-    GLuint gProgramId;
-    GLuint gLampProgramId;
+    // Uniform block binding points shared by every shader program (must match the layout qualifiers in the shaders)
+    const GLuint CAMERA_BLOCK_BINDING = 0;
+    const GLuint LIGHT_BLOCK_BINDING = 1;
+    const GLuint MATERIAL_BLOCK_BINDING = 2;
+
+    // Shader storage buffer binding points of the clustered light lists
+    const GLuint POINT_LIGHT_BUFFER_BINDING = 3;
+    const GLuint CLUSTER_BUFFER_BINDING = 4;
+    const GLuint CLUSTER_LIGHT_INDEX_BUFFER_BINDING = 5;
+
+    // Entities of the hand-placed scene that other code refers to by name
+    enum SceneObject
+    {
+        OBJECT_TABLE,
+        OBJECT_LAMP,
+        OBJECT_KEY_LIGHT,
+        OBJECT_TUBE,
+        OBJECT_TUBE_CAP,
+        OBJECT_OCTAGON,
+        OBJECT_CUBE2,
+        OBJECT_CUBE1,
+        OBJECT_SPHERE,
+        SCENE_OBJECT_COUNT
+    };
+
+    // std140 mirror of the Camera block
+    struct CameraBlock
+    {
+        glm::mat4 view;
+        glm::mat4 projection;
+        glm::vec4 viewPosition;     // xyz used, vec3 members are padded to 16 bytes in std140
+    };
+
+    // std430 mirror of one entry of the PointLights storage buffer
+    struct PointLight
+    {
+        glm::vec4 position;     // w: range, beyond which the light adds nothing
+        glm::vec4 color;
+    };
+    const int MAX_POINT_LIGHTS = 1024;
+
+    // std140 mirror of the Lights block
+    struct LightBlock
+    {
+        glm::vec4 keyLightColor;            // Constant fill, scaled by the material's key light strength
+        GLint clusterGrid[4];               // Tiles across, tiles down, depth slices, point light count
+        glm::vec4 clusterSlicing;           // Depth slice scale and bias (applied to the log of view depth), tile size in pixels
+        glm::vec4 shadowLights[2];          // Position and range of each shadow-casting light (ShadowLight order)
+        GLint shadowSettings[4];            // Filter taps, shadows enabled
+        glm::vec4 shadowFilter;             // Texel size at unit distance, normal offset and filter radius in texels
+    };
+
+    // Light assignment grid: the view frustum is cut into screen tiles and exponentially spaced depth slices, and
+    // each fragment only loops over the lights binned into its cluster
+    const int CLUSTER_TILES_X = 16;
+    const int CLUSTER_TILES_Y = 9;
+    const int CLUSTER_SLICES = 24;
+    const int CLUSTER_COUNT = CLUSTER_TILES_X * CLUSTER_TILES_Y * CLUSTER_SLICES;
+    const size_t CLUSTER_PARALLEL_LIGHTS = 64;  // Fewer lights are binned on the render thread alone
+
+    // Clip planes of both projections; the depth slices span the same range
+    const float CAMERA_NEAR = 0.1f;
+    const float CAMERA_FAR = 100.0f;
+
+    // std430 mirror of one entry of the Clusters storage buffer: the cluster's run in the light index list
+    struct ClusterRecord
+    {
+        GLuint offset;
+        GLuint count;
+    };
+
+    // Clusters a light's range overlaps, bounds included
+    struct LightClusterBounds
+    {
+        int min[3];
+        int max[3];
+        bool isVisible;
+    };
+
+    struct ClusterGrid
+    {
+        std::vector<ClusterRecord> clusters;
+        std::vector<GLuint> lightIndices;               // One run of light indices per cluster
+        std::vector<LightClusterBounds> bounds;         // Per light, rebuilt every frame
+        std::vector<std::vector<GLuint> > workerIndices;    // Runs binned by each worker, concatenated in slice order
+        std::vector<GLuint> reachedEntities;            // Entities within the range of the light being binned
+        float sliceScale;
+        float sliceBias;
+        GLuint lightBuffer;     // Storage buffers read by the lit shader variants
+        GLuint clusterBuffer;
+        GLuint indexBuffer;
+
+        // Binning workers, started by the first frame with enough lights to split and kept until the grid is
+        // destroyed. Each frame bumps the generation to wake them; the render thread waits for pendingWorkers to drop to 0.
+        std::vector<std::thread> workers;
+        std::mutex workMutex;
+        std::condition_variable workCondition;
+        std::condition_variable doneCondition;
+        uint64_t generation;
+        int pendingWorkers;
+        bool isStopping;
+    };
+    ClusterGrid gClusterGrid;
+
+    // One entry of the Materials block array (std140), uploaded once when the materials are created
+    struct MaterialRecord
+    {
+        glm::vec4 shading;  // Ambient strength, key light strength, specular intensity, highlight size
+        GLint layer;        // Layer of the scene texture array
+        GLint padding[3];
+    };
+    const int MAX_MATERIAL_RECORDS = 8;     // Size of the Materials block array; UBuildShaderSource() passes it to the shaders
+
+    // One uniform buffer holding both blocks, re-specified (orphaned) once per frame
+    struct GLFrameUniformBuffer
+    {
+        GLuint ubo;
+        GLintptr cameraOffset;
+        GLintptr lightOffset;
+        std::vector<unsigned char> staging;   // CPU copy of the whole buffer
+    };
+
+    // Per-instance vertex attributes (divisor 1); the model matrix takes four consecutive locations
+    struct InstanceData
+    {
+        glm::mat4 model;
+        glm::vec4 tint;     // Multiplies the lit texture color
+        GLuint lights;      // LIGHT_MASK_* bits of the lights reaching the instance
+        GLint material;     // Index into the Materials block
+        glm::mat3 normalMatrix;
+    };
+    const GLuint INSTANCE_MODEL_LOCATION = 3;
+    const GLuint INSTANCE_TINT_LOCATION = 7;
+    const GLuint INSTANCE_LIGHTS_LOCATION = 8;
+    const GLuint INSTANCE_MATERIAL_LOCATION = 9;
+    const GLuint INSTANCE_NORMAL_MATRIX_LOCATION = 10;
+
+    // Instances of every draw of the frame, streamed to one vertex buffer attached to the mesh VAO
+    struct GLInstanceBuffer
+    {
+        GLuint vbo;
+        size_t capacity;    // Instances the buffer storage can hold
+        std::vector<InstanceData> instances;
+    };
+
+    // Counters for a single frame, reset at the start of every URender() call
+    struct FrameStats
+    {
+        GLuint uniformLookups;  // glGetUniformLocation calls issued during the frame
+        GLuint uniformUpdates;  // glUniform* calls and uniform buffer uploads issued during the frame
+        GLuint triangles;       // Triangles submitted during the frame
+        GLuint lodTriangles[MAX_LOD_LEVELS];    // Triangles of multi-level parts, per selected level
+        GLuint drawCalls;       // glDraw* calls issued during the frame
+        GLuint instances;       // Instances submitted by those draw calls
+        GLuint programBinds;    // glUseProgram calls
+        GLuint textureBinds;    // glBindTexture calls
+        GLuint vertexArrayBinds;    // glBindVertexArray calls
+        GLuint redundantStateChanges;   // Binds skipped because the state was already set
+        GLuint culledEntities;  // Entities outside the view frustum
+        GLuint bvhNodesVisited; // Hierarchy nodes tested by the culling query
+        GLuint visibleLights;   // Point lights reaching into the view frustum and onto at least one entity
+        GLuint clusterLightIndices; // Light references across all clusters, the length of the index list
+        double lightBinningMs;  // CPU time spent assigning the lights to clusters
+        GLuint shadowDrawCalls; // Draw calls into the shadow maps (also counted in drawCalls)
+        GLuint shadowInstances; // Instances submitted by those draw calls
+        GLuint shadowStaticRebuilds;    // Shadow maps whose static casters were re-rendered
+        GLuint shadowCacheHits; // Shadow maps restored from their static cache instead of drawing the static casters again
+        double shadowBuildMs;   // CPU time spent collecting and batching the shadow casters
+        GLuint occludedEntities;    // Entities in the view frustum skipped because their last occlusion query found them hidden
+        GLuint occlusionQueries;    // Bounding box queries issued during the frame
+    };
+
+    // Last state set through UUseProgram/UBindTexture/UBindVertexArray; reset every frame because
+    // setup code outside the render loop binds objects directly
+    const int MAX_CACHED_TEXTURE_UNITS = 16;
+    struct GLStateCache
+    {
+        GLuint programId;
+        GLuint vao;
+        GLenum activeUnit;
+        GLuint textures[MAX_CACHED_TEXTURE_UNITS];  // Texture last bound to each unit, whatever its target
+    };
+
+    // Sections of a frame timed separately on the GPU
+    enum RenderPass
+    {
+        PASS_CLEAR,
+        PASS_OPAQUE,
+        PASS_LAMPS,
+        PASS_LIGHTING,      // Fullscreen lighting of the G-buffer (deferred renderer only)
+        PASS_DEPTH_PREPASS, // Depth of the opaque entities, front to back (with --depth-prepass only)
+        PASS_SHADOWS,       // Shadow casters, into the shadow maps of the lamp and the key light
+        PASS_OCCLUSION,     // Bounding boxes tested by occlusion queries (with --occlusion-culling only)
+        RENDER_PASS_COUNT
+    };
+    const char* const RENDER_PASS_NAMES[RENDER_PASS_COUNT] = { "clear", "opaque", "lamps", "lighting", "depthPrepass", "shadows", "occlusionQueries" };
+
+    // GL_TIME_ELAPSED queries for every pass, in a ring of frames so results are read without stalling, and a
+    // GL_SAMPLES_PASSED query counting the fragments the shaded opaque pass lets through
+    const int GPU_TIMER_FRAMES = 4;
+    struct GLPassTimers
+    {
+        bool enabled;
+        GLuint queries[GPU_TIMER_FRAMES][RENDER_PASS_COUNT];
+        bool issued[GPU_TIMER_FRAMES][RENDER_PASS_COUNT];
+        GLuint sampleQueries[GPU_TIMER_FRAMES];
+        bool samplesIssued[GPU_TIMER_FRAMES];
+        int slot;       // Ring entry written by the current frame
+    };
+
+    // Measurements of one benchmark frame
+    struct BenchSample
+    {
+        double frameMs;         // Wall time of the whole frame
+        double cpuInputMs;      // Time spent in UProcessInput()
+        double cpuRenderMs;     // Time spent in URender()
+        double gpuMs[RENDER_PASS_COUNT];
+        double shadedSamples;   // Samples passing the depth test in the shaded opaque pass
+        FrameStats stats;
+    };
+
+    // Features a shader variant is compiled with, one #define each; a material's mask selects its program
+    enum ShaderFeature
+    {
+        SHADER_TEXTURED = 1 << 0,   // Multiply by the material's layer of the scene texture array
+        SHADER_LIGHTING = 1 << 1,   // Ambient, key and diffuse lighting; without it the tint is output as is
+        SHADER_SPECULAR = 1 << 2,   // Specular highlights (needs SHADER_LIGHTING)
+        SHADER_GBUFFER = 1 << 3,    // Write position, normal and color to the G-buffer instead of lighting (needs SHADER_LIGHTING)
+    };
+
+    // A variant of the scene shader. Variants compiled from source are submitted first and finished once the
+    // driver reports them complete; until then their materials draw with a fallback variant.
+    struct ShaderVariant
+    {
+        GLuint programId;
+        GLProgramUniforms uniforms;
+        bool isReady;               // Linked, uniforms cached: materials may draw with it
+        bool isCompiling;           // Submitted from source and not finished yet
+        bool hasFailed;             // Failed to compile or link; its materials keep their fallback
+        GLuint vertexShaderId;      // Shaders of a pending compile, deleted once it finishes
+        GLuint fragmentShaderId;
+        uint64_t cacheKey;          // Where the finished binary is stored; empty filename when not cached
+        std::string cacheFilename;
+        std::chrono::steady_clock::time_point submitTime;
+    };
+    std::unordered_map<GLuint, ShaderVariant> gShaderVariants;  // Requested on first use, keyed by feature mask
+    int gPendingShaderVariants = 0;                             // Submitted variants the driver is still compiling
+    std::chrono::steady_clock::time_point gShaderSubmitTime;    // When UCreateMaterials submitted the variants
+
+    // Program binary cache file: header, then the driver's binary. The key hashes both shader sources and
+    // gDriverIdentity, so an edited shader or a driver update simply misses.
+    const char PROGRAM_CACHE_MAGIC[4] = { 'P', 'R', 'G', '1' };
+
+    struct ProgramCacheHeader
+    {
+        char magic[4];
+        GLenum binaryFormat;
+        uint64_t key;
+        uint64_t binarySize;
+    };
+
+    // Vendor, renderer and version strings of the context, read once at startup
+    std::string gDriverIdentity;
+    GLFrameUniformBuffer gFrameUniforms;
+    GLInstanceBuffer gInstances;
+
+    // Renderer statistics
+    FrameStats gFrameStats;
+    GLuint gTotalUniformLookups = 0;    // glGetUniformLocation calls since startup
+    GLuint gTotalShadowCacheHits = 0;   // FrameStats::shadowCacheHits since startup
+    const double STATS_REPORT_INTERVAL = 5.0; // seconds between statistics reports
+    GLPassTimers gPassTimers = {};
+    GLStateCache gStateCache;
 
     // camera
     Camera gCamera(glm::vec3(0.0f, -1.0f, 20.0f));
@@ -69,50 +592,243 @@ namespace
     float gDeltaTime = 0.0f; // time between current frame and last frame
     float gLastFrame = 0.0f;
 
-    // Subject position and scale
-    glm::vec3 gCubePosition(1.0f, -2.0f, 0.0f);
-    glm::vec3 gCubeScale(1.0f);
-
-    // Cube and light color
-    glm::vec3 gObjectColor(1.0f, 0.2f, 0.0f);
+    // Light color
     glm::vec3 gLightColor(0.25f, 0.25f, 0.25f);
 
-    // Light position and scale
+    // Light position (the lamp entity follows it)
     glm::vec3 gLightPosition(10.0f, -4.0f, 3.0f);
-    glm::vec3 gLightScale(0.5f);
 
-    // Light color, position and scale
+    // Every point light of the scene; the first one is the lamp
+    std::vector<PointLight> gPointLights;
+    const float LAMP_LIGHT_RANGE = 40.0f;   // Reaches the whole table, so the lamp keeps its unbounded look
+
+    // Key light color and position
     glm::vec3 gKeyLightColor(1.0f, 1.0f, 1.0f);
     glm::vec3 gKeyLightPosition(0.5f, 2.0f, -0.5f);
-    glm::vec3 gKeyLightScale(0.2f);
 
-    // Tube
-    glm::vec3 gTubeColor(3.0f, -1.0f, 0.0f);
-    glm::vec3 gTubePosition(5.0f, -5.3f, 0.0f);
-    glm::vec3 gTubeScale(1.5f);
+    // Lamp animation
+    bool gIsLampOrbiting = true;
+
+    // How an entity is drawn
+    enum MaterialId
+    {
+        MATERIAL_TABLE,
+        MATERIAL_TUBE_BODY,
+        MATERIAL_TUBE_CAP,
+        MATERIAL_OCTAGON,
+        MATERIAL_BLUE_BOX,
+        MATERIAL_PINK,
+        MATERIAL_LAMP,
+        MATERIAL_COUNT
+    };
 
-    // Octagon 
-    glm::vec3 gOctColor(1.0f, 0.2f, 0.0f);
-    glm::vec3 gOctPosition(0.0f, -6.1f, -1.0f);
-    glm::vec3 gOctScale(0.8f);
+    struct Material
+    {
+        GLuint textureId;   // Texture array bound to SCENE_TEXTURE_UNIT; 0 for untextured materials
+        GLint textureLayer;
+        glm::vec4 shading;  // Copied to the material's MaterialRecord; all zero for unlit materials
+        RenderPass pass;
+        GLuint features = 0;    // Derived: shader features the look needs
+        GLuint fallbackFeatures = 0;    // Derived: the cheap variant drawn while the one for features compiles
+        GLuint deferredFeatures = 0;    // Derived: the variant drawn by the deferred renderer (G-buffer writer for opaque materials)
+        GLuint programId = 0;   // Derived: the ready variant for features, else the fallback
+        GLuint programKey = 0;  // Rank of the program and texture among all materials, used in sort keys
+        GLuint textureKey = 0;
+    };
+    Material gMaterials[MATERIAL_COUNT];
 
-    // Blue Top Cube1
-    glm::vec3 gCube1Color(1.0f, 0.2f, 0.0f);
-    glm::vec3 gCube1Position(-4.0f, -4.0f, -1.0f);
-    glm::vec3 gCube1Scale(2.5f);
+    // Deferred renderer: the opaque pass writes its surfaces here, then one fullscreen pass lights every pixel once
+    struct GLGBuffer
+    {
+        GLuint fbo;
+        GLuint positionTexture;     // RGBA32F: world position, material index (negative where nothing was drawn)
+        GLuint normalTexture;       // RGBA16F: world normal
+        GLuint colorTexture;        // RGBA8: tinted texture color
+        GLuint depthTexture;        // Written to the frame's depth buffer by the lighting pass, so the lamps are occluded
+        int width;
+        int height;
+    };
+    GLGBuffer gGBuffer;
+    const GLenum GBUFFER_TEXTURE_UNIT = GL_TEXTURE1;    // Position, normal, color and depth on four consecutive units
+    GLuint gDeferredLightingProgramId;
+    GLuint gFullscreenVao;          // No attributes; the fullscreen triangle comes from gl_VertexID
+    bool gDeferredShading = false;  // Which renderer draws the opaque pass
+    GLuint gMaterialBuffer;     // Uniform buffer holding a MaterialRecord per material
+
+    // Ambient strength, key light strength, specular intensity and highlight size shared by the scene materials
+    const glm::vec4 PHONG_SHADING(0.05f, 0.8f, 3.0f, 12.0f);
+
+    // Every drawable object, stored as parallel arrays indexed by entity so per-frame passes stream through memory
+    struct EntityStore
+    {
+        // Transform
+        std::vector<glm::vec3> positions;
+        std::vector<glm::vec3> scales;
+        std::vector<glm::mat4> models;      // Derived from position and scale every frame
+        std::vector<glm::mat3> normalMatrices;  // Inverse transpose of the models' upper 3x3, derived alongside them
+        // Mesh range
+        std::vector<MeshPart> parts;
+        std::vector<int> lods;              // Level of detail drawn last frame
+        // Material
+        std::vector<MaterialId> materials;
+        std::vector<glm::vec4> tints;
+        std::vector<GLuint> lightMasks;     // LIGHT_MASK_* bits, assigned every frame from the hierarchy
+        // Object-space bounding sphere: xyz center, w radius
+        std::vector<glm::vec4> localBounds;
+        // World-space bounding sphere, one array per component
+        std::vector<float> boundsX;
+        std::vector<float> boundsY;
+        std::vector<float> boundsZ;
+        std::vector<float> boundsRadius;
+        // Moved at least once: drawn into the shadow maps every frame instead of being cached with the static casters
+        std::vector<bool> isDynamic;
+        GLuint staticVersion = 0;           // Bumped whenever an entity leaves the static set
+    };
+    EntityStore gEntities;
+    GLuint gSceneEntities[SCENE_OBJECT_COUNT];
 
-    // Blue Bottom Cube2
-    glm::vec3 gCube2Color(1.0f, 0.2f, 0.0f);
-    glm::vec3 gCube2Position(-4.0f, -5.5f, -1.0f);
-    glm::vec3 gCube2Scale(2.9f);
+    // Planes of the view frustum (left, right, bottom, top, near, far) as (normal, distance) with
+    // normals pointing inside and normalized, so dot(plane.xyz, p) + plane.w is a signed distance
+    struct Frustum
+    {
+        glm::vec4 planes[6];
+    };
 
-    // Pink Sphere
-    glm::vec3 gSphereColor(1.0f, 0.2f, 0.0f);
-    glm::vec3 gSpherePosition(0.0f, -6.9f, 3.0f);
-    glm::vec3 gSphereScale(1.3f);
+    // Entities inside the view frustum this frame
+    std::vector<GLuint> gVisibleEntities;
 
-    // Lamp animation
-    bool gIsLampOrbiting = true;
+    // Bounding volume hierarchy over the entity bounding spheres. Every node covers a contiguous range of
+    // items (entity indices); leaves have no children.
+    const int BVH_MAX_LEAF_ITEMS = 4;
+    struct BvhNode
+    {
+        glm::vec3 boundsMin;
+        glm::vec3 boundsMax;
+        GLint left;         // Child node indices, -1 for leaves
+        GLint right;
+        GLuint firstItem;
+        GLuint nItems;
+    };
+
+    struct Bvh
+    {
+        std::vector<BvhNode> nodes;     // Root first
+        std::vector<GLuint> items;
+        std::vector<GLint> parents;     // Parent of each node, -1 for the root
+        std::vector<GLint> entityLeaves;    // Leaf holding each entity
+    };
+    Bvh gBvh;
+
+    // Entities moved since the last refit
+    std::vector<GLuint> gMovedEntities;
+
+    // Lights reaching an entity outside the clustered point lights, one bit per light; every frame each light's
+    // range is queried in the hierarchy and only the entities it returns get the bit
+    const GLuint LIGHT_MASK_KEY_LIGHT = 1 << 0;
+    const float KEY_LIGHT_RANGE = 40.0f;    // The key light has no falloff; this covers the table
+
+    // Entities returned by the last light range query
+    std::vector<GLuint> gLitEntities;
+
+    // Occlusion culling with temporal coherence: once a frame is drawn, the bounding boxes of some entities are tested
+    // against its depth, and each result is read back only once available, a frame or more later, so the CPU never
+    // waits on the GPU. Entities found hidden are skipped and queried every frame until they show again; visible ones
+    // are only re-queried every OCCLUSION_VISIBLE_INTERVAL frames, staggered by entity.
+    const GLuint OCCLUSION_VISIBLE_INTERVAL = 4;
+    const float OCCLUSION_NEAR_MARGIN = 0.5f;   // Boxes this close to the near plane are clipped and always drawn
+    struct GLOcclusionQueries
+    {
+        std::vector<GLuint> queries;        // One query object per entity
+        std::vector<bool> isPending;        // Issued, result not read yet
+        std::vector<bool> isOccluded;       // Last result read
+        std::vector<GLuint> lastFrames;     // Frame each entity was last in the view frustum
+        std::vector<GLuint> enterFrames;    // Frame it came back into it; results of queries issued before are stale
+        std::vector<GLuint> queryFrames;    // Frame its last query was issued
+        std::vector<GLuint> pending;        // Entities with a query in flight
+        std::vector<GLuint> issued;         // Entities queried this frame, one box instance each from firstInstance on
+        GLuint firstInstance;
+        GLuint frame;
+    };
+    GLOcclusionQueries gOcclusionQueries;
+
+    // 64-bit draw sort key, most significant field first:
+    // pass (4 bits) | program (8) | texture (12) | mesh part and level of detail (8) | depth (32)
+    const int SORT_KEY_PASS_SHIFT = 60;
+    const int SORT_KEY_PROGRAM_SHIFT = 52;
+    const int SORT_KEY_TEXTURE_SHIFT = 40;
+    const int SORT_KEY_MESH_SHIFT = 32;
+
+    // One entity to draw this frame
+    struct RenderItem
+    {
+        uint64_t key;
+        GLuint entity;
+
+        bool operator<(const RenderItem& other) const
+        {
+            return key < other.key;
+        }
+    };
+    std::vector<RenderItem> gRenderQueue;
+
+    // Consecutive instances drawn with one call
+    struct DrawBatch
+    {
+        RenderPass pass;
+        GLuint programId;
+        GLuint textureId;
+        MeshPart part;
+        int lod;
+        GLuint firstInstance;
+        GLsizei nInstances;
+    };
+    std::vector<DrawBatch> gDrawBatches;
+
+    // Depth pre-pass: the opaque items again, strictly front to back, drawn with gDepthOnlyProgramId
+    std::vector<RenderItem> gDepthQueue;
+    std::vector<DrawBatch> gDepthBatches;
+    GLuint gDepthOnlyProgramId;
+
+    // Lights casting shadows; each has a depth cube, all in one cube map array (layer-face light * 6 + face)
+    enum ShadowLight
+    {
+        SHADOW_LAMP,
+        SHADOW_KEY_LIGHT,
+        SHADOW_LIGHT_COUNT
+    };
+    const int CUBE_FACE_COUNT = 6;
+    const float SHADOW_NEAR = 0.1f;
+    const int SHADOW_MAX_TAPS = 21;                 // Size of the tap table in the lighting shader
+    const float SHADOW_NORMAL_OFFSET_TEXELS = 1.5f; // Lookups move off the surface by this many texels against acne
+    const float SHADOW_FILTER_TEXELS = 1.0f;        // Spread of the filter taps
+    const GLenum SHADOW_TEXTURE_UNIT = GL_TEXTURE5;
+
+    // The maps store the distance to the light over its range. A light that moved draws all its casters straight into
+    // the sampled map. A light that stays put renders its static casters into a cache once (again when the static set
+    // changes); the cache is copied into the sampled map, and only the moving casters are drawn over it every frame.
+    struct GLShadowMaps
+    {
+        GLuint depthTexture;    // Sampled by the lit shaders, with depth comparison
+        GLuint staticTexture;   // Same layout, static casters only
+        GLuint fbo;
+        int resolution;
+        glm::vec4 lights[SHADOW_LIGHT_COUNT];       // Position and range each map was last rendered for
+        GLuint staticVersions[SHADOW_LIGHT_COUNT];  // EntityStore::staticVersion each cache was rendered for
+        bool isCacheValid[SHADOW_LIGHT_COUNT];
+        bool hadDynamicCasters[SHADOW_LIGHT_COUNT]; // The sampled map holds moving casters that must be erased
+        // Rebuilt every frame by UBuildShadowBatches
+        bool drawDirect[SHADOW_LIGHT_COUNT];        // The light moved: every caster goes straight into the sampled map
+        bool rebuildStatic[SHADOW_LIGHT_COUNT];
+        bool copyStatic[SHADOW_LIGHT_COUNT];        // The sampled map differs from the cache this frame
+        std::vector<DrawBatch> staticBatches[SHADOW_LIGHT_COUNT][CUBE_FACE_COUNT];
+        std::vector<DrawBatch> dynamicBatches[SHADOW_LIGHT_COUNT][CUBE_FACE_COUNT];
+    };
+    GLShadowMaps gShadowMaps;
+    GLuint gShadowCasterProgramId;
+    GLProgramUniforms gShadowCasterUniforms;
+
+    // Height of the table top once the table model matrix is applied
+    const float TABLE_TOP_Y = -7.0f;
 
 }
 
@@ -121,6 +837,7 @@ namespace
  * redraw graphics on the window when resized,
  * and render graphics on the screen
  */
+bool UParseCommandLine(int argc, char* argv[], RunOptions& options);
 bool UInitialize(int, char* [], GLFWwindow** window);
 void UResizeWindow(GLFWwindow* window, int width, int height);
 void UProcessInput(GLFWwindow* window);
@@ -129,295 +846,754 @@ void UMouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset);
 void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods);
 void UCreateMesh(GLMesh& mesh);
 void UDestroyMesh(GLMesh& mesh);
-bool UCreateTexture(const char* filename, GLuint& textureId);
+void UMeshBuilderBeginLod(MeshBuilder& builder, MeshPart part);
+void UMeshBuilderEndLod(MeshBuilder& builder);
+GLuint UMeshBuilderAddVertex(MeshBuilder& builder, const GLfloat* vertex);
+GLuint UMeshBuilderAddVertex(MeshBuilder& builder, const glm::vec3& position, const glm::vec3& normal, const glm::vec2& uv);
+void UMeshBuilderAddTriangle(MeshBuilder& builder, GLuint i0, GLuint i1, GLuint i2);
+void UMeshBuilderAddTriangles(MeshBuilder& builder, MeshPart part, const GLfloat* verts, size_t nFloats);
+glm::vec3 UCirclePoint(float angle, float radius, float y);
+void UGenerateDisc(MeshBuilder& builder, int segments, float radius, float y, bool facingUp, float startAngle);
+void UGenerateCylinder(MeshBuilder& builder, int segments, float radius, float yBottom, float yTop, bool bottomCap, bool topCap, float startAngle);
+void UGeneratePrism(MeshBuilder& builder, int sides, float radius, float yBottom, float yTop, float startAngle);
+void UGenerateTubeBody(MeshBuilder& builder, int segments, float radius, float height);
+void UGenerateUVSphere(MeshBuilder& builder, int segments, int rings, float radius);
+void UUploadMesh(const MeshBuilder& builder, GLMesh& mesh);
+void UDrawSubMesh(const GLMesh& mesh, MeshPart part, int lod, GLuint firstInstance, GLsizei instanceCount = 1);
+float UProjectedRadius(const glm::vec3& center, float radius);
+int USelectLod(const GLMeshPart& part, float projectedRadius, int currentLod);
+GLuint UCreateEntity(EntityStore& store, MeshPart part, MaterialId material, const glm::vec3& position, const glm::vec3& scale, const glm::vec4& tint = glm::vec4(1.0f));
+void UCreateScene();
+void UScatterProps(int count);
+bool UCreateMaterials();
+GLuint UMaterialFeatures(const Material& material);
+std::string UBuildShaderSource(GLuint features, const char* source);
+ShaderVariant& URequestShaderVariant(GLuint features);
+bool UFinishShaderVariant(GLuint features, ShaderVariant& variant);
+bool UGetShaderVariant(GLuint features, ShaderVariant& variant);
+void UAssignMaterialPrograms();
+void UPollShaderVariants();
+bool UFinishShaderVariants();
+void UDestroyShaderVariants();
+bool UCreateDeferredRenderer();
+bool USetDeferredShading(bool enabled);
+bool UResizeGBuffer(int width, int height, GLGBuffer& gbuffer);
+void UDestroyGBuffer(GLGBuffer& gbuffer);
+void UDestroyDeferredRenderer();
+void UDrawPass(RenderPass pass, const std::vector<DrawBatch>& batches);
+void UDrawOpaquePass();
+void UDrawDeferredOpaque();
+bool UCreateDepthPrepass();
+bool UCreateShadowMaps(int resolution, GLShadowMaps& maps);
+void UDestroyShadowMaps(GLShadowMaps& maps);
+void UBuildShadowBatches(const EntityStore& store, const glm::vec4* lights, GLShadowMaps& maps, GLInstanceBuffer& instances);
+void URenderShadowMaps(GLShadowMaps& maps);
+glm::mat4 UShadowFaceViewProjection(const glm::vec4& light, int face);
+void UUpdateEntityTransforms(EntityStore& store);
+void UUpdateEntityLods(EntityStore& store);
+uint64_t UMakeSortKey(const Material& material, MeshPart part, int lod, float depth);
+void UExtractFrustum(const glm::mat4& viewProjection, Frustum& frustum);
+void UCullEntities(const EntityStore& store, const Frustum& frustum, std::vector<GLuint>& visible);
+void USetEntityPosition(EntityStore& store, GLuint entity, const glm::vec3& position);
+void UBuildBvh(const EntityStore& store, Bvh& bvh);
+void URefitBvh(const EntityStore& store, Bvh& bvh, std::vector<GLuint>& movedEntities);
+void UCullBvh(const Bvh& bvh, const EntityStore& store, const Frustum& frustum, std::vector<GLuint>& visible);
+GLint UPickEntity(const Bvh& bvh, const EntityStore& store, const glm::vec3& origin, const glm::vec3& direction, float& distance);
+void UQueryBvhSphere(const Bvh& bvh, const EntityStore& store, const glm::vec3& center, float radius, std::vector<GLuint>& entities);
+void UAssignEntityLights(const Bvh& bvh, EntityStore& store, std::vector<GLuint>& litEntities);
+void UCullOccludedEntities(const EntityStore& store, const Frustum& frustum, GLOcclusionQueries& occlusion, std::vector<GLuint>& visible);
+void UAddOcclusionBoxes(const EntityStore& store, GLOcclusionQueries& occlusion, GLInstanceBuffer& instances);
+void UIssueOcclusionQueries(GLOcclusionQueries& occlusion);
+void UDestroyOcclusionQueries(GLOcclusionQueries& occlusion);
+void UBuildRenderQueue(const EntityStore& store, const std::vector<GLuint>& entities, std::vector<RenderItem>& queue);
+void UBuildDrawBatches(const EntityStore& store, const std::vector<RenderItem>& queue, GLInstanceBuffer& instances, std::vector<DrawBatch>& batches);
+void UBuildDepthBatches(const EntityStore& store, const std::vector<RenderItem>& queue, std::vector<RenderItem>& depthQueue, GLInstanceBuffer& instances, std::vector<DrawBatch>& batches);
+bool UDecodeImage(const std::vector<unsigned char>& bytes, DecodedImage& image);
+uint64_t UHashBytes(const void* data, size_t size);
+bool UReadFile(const std::string& filename, std::vector<unsigned char>& bytes);
+bool UPrepareTexture(const std::string& filename, bool keepAlpha, TextureBlob& blob);
+bool UIsTextureCacheValid(const TextureBlob& blob, const TextureCacheHeader& source, bool canCompress);
+bool UBakeTexture(const DecodedImage& image, const TextureCacheHeader& source, std::vector<unsigned char>& file);
+void UCompressBlock(const unsigned char* rgba, int stride, int width, int height, int x, int y, bool hasAlpha, unsigned char* block);
+bool UMapFile(const std::string& filename, TextureBlob& blob);
+void UReleaseTextureBlob(TextureBlob& blob);
+bool UUploadTextureLayer(const TextureBlob& blob, GLuint& textureId, int layer, int layerCount);
+bool ULoadTextureArray(const char* const* filenames, int count, GLuint& textureId);
+void UReportStartupPhase(const char* phase);
 void UDestroyTexture(GLuint textureId);
 void URender();
 bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint& programId);
+bool UCreateCachedShaderProgram(const std::string& vtxShaderSource, const std::string& fragShaderSource, GLuint& programId);
+void USubmitShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint& programId, GLuint& vertexShaderId, GLuint& fragmentShaderId);
+bool UFinishShaderProgram(GLuint programId, GLuint vertexShaderId, GLuint fragmentShaderId);
+bool UIsProgramComplete(GLuint programId);
+bool UProgramCacheKey(const std::string& vtxShaderSource, const std::string& fragShaderSource, uint64_t& key, std::string& filename);
+bool ULoadProgramBinary(const std::string& filename, uint64_t key, GLuint& programId);
+void USaveProgramBinary(const std::string& filename, uint64_t key, GLuint programId);
 void UDestroyShaderProgram(GLuint programId);
-
-
-/* Vertex Shader Source Code*/
-const GLchar* vertexShaderSource = GLSL(440,
-    layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
-layout(location = 1) in vec3 normal; // VAP position 1 for normals
+GLint UGetUniformLocation(GLuint programId, const char* name);
+void UCacheUniformLocations(GLuint programId, GLProgramUniforms& uniforms);
+void USetUniform(GLint location, const glm::mat4& value);
+void USetUniform(GLint location, const glm::vec4& value);
+void USetUniform(GLint location, const glm::vec3& value);
+void USetUniform(GLint location, const glm::vec2& value);
+void USetUniform(GLint location, GLint value);
+void UReportFrameStats();
+bool URunHeadless();
+bool UCreateRenderTarget(int width, int height, GLRenderTarget& target);
+void UDestroyRenderTarget(GLRenderTarget& target);
+bool UWriteFrameCapture(const GLRenderTarget& target, const std::string& filename);
+bool URunBenchmark();
+bool URenderBenchmarkFrames(std::vector<BenchSample>& samples);
+bool URunLightSweep(std::ostream& out);
+void UUpdateBenchCamera(int frame, int frameCount);
+bool URunFlipBenchmark();
+void USwapRows(unsigned char* row1, unsigned char* row2, size_t size);
+void UFlipImageBytewise(unsigned char* image, int width, int height, int channels);
+void UFlipImageMemcpy(unsigned char* image, int width, int height, int channels);
+void UCreatePassTimers(GLPassTimers& timers);
+void UDestroyPassTimers(GLPassTimers& timers);
+void UBeginPassTimer(RenderPass pass);
+void UEndPassTimer();
+void UReadPassTimers(GLPassTimers& timers, int slot, double* passMs);
+void UBeginSampleCounter();
+void UEndSampleCounter();
+double UReadSampleCounter(GLPassTimers& timers, int slot);
+void UWriteBenchReport(std::ostream& out, const std::vector<BenchSample>& samples);
+void UUseProgram(GLuint programId);
+void UBindTexture(GLenum unit, GLenum target, GLuint textureId);
+void UBindVertexArray(GLuint vao);
+void UResetStateCache();
+void UCreateFrameUniformBuffer(GLFrameUniformBuffer& buffer);
+void UUploadFrameUniforms(GLFrameUniformBuffer& buffer, const CameraBlock& camera, const LightBlock& lights);
+void UDestroyFrameUniformBuffer(GLFrameUniformBuffer& buffer);
+void UCreateSceneLights(int count);
+void UCreateClusterGrid(ClusterGrid& grid);
+void UAssignLightsToClusters(const std::vector<PointLight>& lights, const CameraBlock& camera, const Bvh& bvh, const EntityStore& store, ClusterGrid& grid);
+void UBinClusterSlices(const std::vector<LightClusterBounds>& bounds, int firstSlice, int endSlice, ClusterRecord* clusters, std::vector<GLuint>& indices);
+void URunClusterWorker(ClusterGrid& grid, int worker);
+void UUploadClusterGrid(const std::vector<PointLight>& lights, const ClusterGrid& grid);
+void UDestroyClusterGrid(ClusterGrid& grid);
+void UCreateInstanceBuffer(GLInstanceBuffer& buffer, GLuint vao);
+GLuint UAddInstance(GLInstanceBuffer& buffer, const glm::mat4& model, const glm::mat3& normalMatrix, const glm::vec4& tint, GLuint lights, GLint material);
+void UUploadInstances(GLInstanceBuffer& buffer);
+void UDestroyInstanceBuffer(GLInstanceBuffer& buffer);
+
+
+/* Scene Shader Source Code*/
+// Every program is a variant of this one source: UBuildShaderSource() prepends the #version line and a #define per
+// feature bit, so each material gets only the work its look needs. Raw strings rather than the GLSL() macro, because
+// preprocessor directives cannot appear inside a macro argument.
+const char* const sceneVertexShaderSource = R"glsl(
+layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
+layout(location = 3) in mat4 instanceModel; // Per-instance model matrix (locations 3 to 6)
+layout(location = 7) in vec4 instanceTint;
+#if TEXTURED || LIGHTING
+layout(location = 9) in int instanceMaterial; // Index into the Materials block
+#endif
+#if TEXTURED
 layout(location = 2) in vec2 textureCoordinate;
+#endif
+#if LIGHTING
+layout(location = 1) in vec3 normal; // VAP position 1 for normals
+layout(location = 8) in uint instanceLights; // Lights reaching the instance, one bit per light
+layout(location = 10) in mat3 instanceNormalMatrix; // Inverse transpose of the model matrix, computed on the CPU (locations 10 to 12)
+#endif
 
+out vec4 vertexTint;
+#if TEXTURED
+out vec2 vertexTextureCoordinate;
+flat out int vertexLayer;
+#endif
+#if LIGHTING
 out vec3 vertexNormal; // For outgoing normals to fragment shader
 out vec3 vertexFragmentPos; // For outgoing color / pixels to fragment shader
-out vec2 vertexTextureCoordinate;
+flat out uint vertexLights;
+flat out vec4 vertexShading; // The instance's material record, constant across the primitive
+#endif
+#if GBUFFER
+flat out int vertexMaterial;
+#endif
+
+// Uniform block shared by every variant, uploaded once per frame
+layout(std140, binding = 0) uniform Camera
+{
+    mat4 view;
+    mat4 projection;
+    vec3 viewPosition;
+};
+
+// Matches the depth pre-pass exactly
+invariant gl_Position;
 
+#if TEXTURED || LIGHTING
+// One record per material, uploaded once at startup
+struct MaterialRecord
+{
+    vec4 shading; // Ambient strength, key light strength, specular intensity, highlight size
+    int layer;
+};
 
-//Global variables for the transform matrices
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+layout(std140, binding = 2) uniform Materials
+{
+    MaterialRecord materials[MAX_MATERIAL_RECORDS];
+};
+#endif
 
 void main()
 {
-    gl_Position = projection * view * model * vec4(position, 1.0f); // Transforms vertices into clip coordinates
+    vec4 worldPosition = instanceModel * vec4(position, 1.0f);
 
-    vertexFragmentPos = vec3(model * vec4(position, 1.0f)); // Gets fragment / pixel position in world space only (exclude view and projection)
+    gl_Position = projection * view * worldPosition; // Transforms vertices into clip coordinates
+    vertexTint = instanceTint;
 
-    vertexNormal = mat3(transpose(inverse(model))) * normal; // get normal vectors in world space only and exclude normal translation properties
+#if TEXTURED
     vertexTextureCoordinate = textureCoordinate;
+    vertexLayer = materials[instanceMaterial].layer;
+#endif
+#if LIGHTING
+    vertexFragmentPos = vec3(worldPosition); // Gets fragment / pixel position in world space only (exclude view and projection)
+    vertexNormal = instanceNormalMatrix * normal; // get normal vectors in world space only and exclude normal translation properties
+    vertexLights = instanceLights;
+    vertexShading = materials[instanceMaterial].shading;
+#endif
+#if GBUFFER
+    vertexMaterial = instanceMaterial;
+#endif
 }
-);
+)glsl";
 
 
-/* Cube Fragment Shader Source Code*/
-const GLchar* fragmentShaderSource = GLSL(440,
+// Lighting shared by the scene shader and the deferred lighting pass: the key light plus every point light of the
+// fragment's cluster, as a factor for the surface color
+const char* const sceneLightingShaderSource = R"glsl(
+#if LIGHTING && !GBUFFER
+layout(std140, binding = 0) uniform Camera
+{
+    mat4 view;
+    mat4 projection;
+    vec3 viewPosition;
+};
 
-    in vec2 vertexTextureCoordinate;
-in vec3 vertexNormal; // For incoming normals
-in vec3 vertexFragmentPos; // For incoming fragment position
+layout(std140, binding = 1) uniform Lights
+{
+    vec4 keyLightColor;
+    ivec4 clusterGrid; // Tiles across, tiles down, depth slices, point light count
+    vec4 clusterSlicing; // Depth slice scale and bias, tile size in pixels
+    vec4 shadowLights[2]; // Position and range of the lamp and the key light
+    ivec4 shadowSettings; // Filter taps, shadows enabled
+    vec4 shadowFilter; // Texel size at unit distance, normal offset and filter radius in texels
+};
+
+struct PointLight
+{
+    vec4 position; // w: range
+    vec4 color;
+};
+
+// Rebuilt every frame by UAssignLightsToClusters()
+layout(std430, binding = 3) readonly buffer PointLights
+{
+    PointLight pointLights[];
+};
+
+layout(std430, binding = 4) readonly buffer Clusters
+{
+    uvec2 clusters[]; // Offset and length of the cluster's run in clusterLightIndices
+};
+
+layout(std430, binding = 5) readonly buffer ClusterLightIndices
+{
+    uint clusterLightIndices[];
+};
+
+// Distance to each shadow-casting light over its range, rendered by URenderShadowMaps()
+uniform samplerCubeArrayShadow uShadowMaps;
+
+const int SHADOW_LAMP = 0;
+const int SHADOW_KEY_LIGHT = 1;
+
+// Filter taps: the center, then the corners and the edge midpoints of a cube around it
+const vec3 shadowTaps[21] = vec3[](
+    vec3(0.0),
+    vec3(1.0, 1.0, 1.0), vec3(-1.0, -1.0, -1.0), vec3(1.0, -1.0, 1.0), vec3(-1.0, 1.0, -1.0),
+    vec3(-1.0, 1.0, 1.0), vec3(1.0, -1.0, -1.0), vec3(-1.0, -1.0, 1.0), vec3(1.0, 1.0, -1.0),
+    vec3(1.0, 1.0, 0.0), vec3(-1.0, -1.0, 0.0), vec3(1.0, -1.0, 0.0), vec3(-1.0, 1.0, 0.0),
+    vec3(1.0, 0.0, 1.0), vec3(-1.0, 0.0, -1.0), vec3(1.0, 0.0, -1.0), vec3(-1.0, 0.0, 1.0),
+    vec3(0.0, 1.0, 1.0), vec3(0.0, -1.0, -1.0), vec3(0.0, 1.0, -1.0), vec3(0.0, -1.0, 1.0));
+
+// Fraction of a shadow-casting light reaching the fragment, averaged over the filter taps
+float shadowVisibility(int light, vec3 fragmentPos, vec3 norm)
+{
+    if (shadowSettings.y == 0)
+        return 1.0;
+
+    // Offset and filter radius grow with the size of a shadow map texel at the fragment's distance. The offset goes to
+    // the light's side of the surface, since single-sided meshes such as the table plane face away from it.
+    vec3 fromLight = fragmentPos - shadowLights[light].xyz;
+    float texelSize = length(fromLight) * shadowFilter.x;
+    vec3 offsetNormal = dot(norm, fromLight) > 0.0 ? -norm : norm;
+    vec3 toFragment = fromLight + offsetNormal * (texelSize * shadowFilter.y);
+    float reference = min(length(toFragment) / shadowLights[light].w, 1.0);
+
+    float visibility = 0.0;
+    for (int i = 0; i < shadowSettings.x; ++i)
+        visibility += texture(uShadowMaps, vec4(toFragment + (texelSize * shadowFilter.z) * shadowTaps[i], float(light)), reference);
+    return visibility / float(shadowSettings.x);
+}
+
+// shading: ambient strength, key light strength, specular intensity, highlight size
+// keyLightReach: 1 when the key light reaches the fragment's entity, else 0
+vec3 shadeFragment(vec3 fragmentPos, vec3 norm, vec4 shading, float keyLightReach)
+{
+    /*Phong lighting model calculations to generate ambient, diffuse, and specular components*/
+#if SPECULAR
+    vec3 viewDir = normalize(viewPosition - fragmentPos); // Calculate view direction
+#endif
+
+    // Calculate Key Lighting
+    vec3 lighting = keyLightReach * shading.y * shadowVisibility(SHADOW_KEY_LIGHT, fragmentPos, norm) * keyLightColor.xyz;
+
+    // Find the fragment's cluster: screen tile, then depth slice from the log of its view depth
+    float viewDepth = -(view * vec4(fragmentPos, 1.0)).z;
+    ivec3 cell = ivec3(gl_FragCoord.xy / clusterSlicing.zw, log(max(viewDepth, 1e-4)) * clusterSlicing.x + clusterSlicing.y);
+    cell = clamp(cell, ivec3(0), clusterGrid.xyz - 1);
+    uvec2 cluster = clusters[cell.x + clusterGrid.x * (cell.y + clusterGrid.y * cell.z)];
 
-out vec4 fragmentColor; // For outgoing cube color to the GPU
+    for (uint i = 0u; i < cluster.y; ++i)
+    {
+        uint lightIndex = clusterLightIndices[cluster.x + i];
+        PointLight light = pointLights[lightIndex];
+        vec3 toLight = light.position.xyz - fragmentPos;
+
+        // Full strength near the light, fading smoothly to nothing at its range
+        float rangeFraction = length(toLight) / light.position.w;
+        float attenuation = clamp(1.0 - rangeFraction * rangeFraction * rangeFraction * rangeFraction, 0.0, 1.0);
+        vec3 lightColor = attenuation * attenuation * light.color.xyz;
+        vec3 lightDirection = normalize(toLight); // Calculate distance (light direction) between light source and fragments/pixels
+
+        //Calculate Ambient and Diffuse lighting*/
+        lighting += shading.x * lightColor;
+
+        // Only the lamp (the first light) casts shadows; they take its diffuse and specular light away
+        if (lightIndex == 0u)
+            lightColor *= shadowVisibility(SHADOW_LAMP, fragmentPos, norm);
+
+        lighting += max(dot(norm, lightDirection), 0.1) * lightColor; // Diffuse impact never drops below 0.1
+
+#if SPECULAR
+        //Calculate Specular lighting*/
+        vec3 reflectDir = reflect(-lightDirection, norm);// Calculate reflection vector
+        float specularComponent = pow(max(dot(viewDir, reflectDir), 0.0), shading.w);
+        lighting += shading.z * specularComponent * lightColor;
+#endif
+    }
 
-// Uniform / Global variables for object color, light color, light position, and camera/view position
-uniform vec3 objectColor;
-uniform vec3 lightColor;
-uniform vec3 keyLightColor;
-uniform vec3 lightPos;
-uniform vec3 keyLightPos;
-uniform vec3 viewPosition;
+    return lighting;
+}
+#endif
+)glsl";
 
-uniform vec3 octColor;
-uniform vec3 octPos;
 
-uniform vec3 tubeColor;
-uniform vec3 tubePos;
+// Appended to sceneLightingShaderSource
+const char* const sceneFragmentShaderSource = R"glsl(
+in vec4 vertexTint; // Per-instance color multiplier
+#if TEXTURED
+in vec2 vertexTextureCoordinate;
+flat in int vertexLayer; // Layer of the scene texture array
+#endif
+#if LIGHTING
+in vec3 vertexNormal; // For incoming normals
+in vec3 vertexFragmentPos; // For incoming fragment position
+flat in uint vertexLights; // LIGHT_MASK_KEY_LIGHT bit
+flat in vec4 vertexShading; // Ambient strength, key light strength, specular intensity, highlight size
 
-uniform vec3 cube1Color;
-uniform vec3 cube1Pos;
+// Bit of vertexLights, matching LIGHT_MASK_KEY_LIGHT on the CPU
+const uint LIGHT_MASK_KEY_LIGHT = 1u;
+#endif
 
-uniform vec3 cube2Color;
-uniform vec3 cube2Pos;
+#if GBUFFER
+flat in int vertexMaterial;
 
-uniform vec3 sphereColor;
-uniform vec3 sphere2Pos;
+layout(location = 0) out vec4 gbufferPosition; // World position, material index
+layout(location = 1) out vec4 gbufferNormal; // Normal, key light reach
+layout(location = 2) out vec4 gbufferColor;
+#else
+out vec4 fragmentColor; // For outgoing color to the GPU
+#endif
 
-// Useful when working with multiple textures
-uniform sampler2D uTexture; 
-uniform sampler2D uTexture1;
-uniform sampler2D uTexture2;
-uniform sampler2D uTexture3;
-uniform sampler2D uTexture4;
-uniform sampler2D uTexture5;
+#if TEXTURED
+// Every scene texture, one per layer
+uniform sampler2DArray uSceneTextures;
 uniform vec2 uvScale;
-out vec4 textureColor;
+#endif
 
 void main()
 {
+    vec3 color = vertexTint.xyz;
 
-    /*Phong lighting model calculations to generate ambient, diffuse, and specular components*/
+#if TEXTURED
+    // Texture holds the color to be used for all lighting components
+    color *= texture(uSceneTextures, vec3(vertexTextureCoordinate * uvScale, vertexLayer)).xyz;
+#endif
 
-    //Calculate Ambient lighting*/
-    float ambientStrength = 0.05f; // Set ambient or global lighting strength
-    vec3 ambient = ambientStrength * lightColor; // Generate ambient light color
+#if GBUFFER
+    // Lit later, once per pixel, by the deferred lighting pass
+    gbufferPosition = vec4(vertexFragmentPos, float(vertexMaterial));
+    gbufferNormal = vec4(normalize(vertexNormal), (vertexLights & LIGHT_MASK_KEY_LIGHT) != 0u ? 1.0 : 0.0);
+    gbufferColor = vec4(color, 1.0);
+#else
+#if LIGHTING
+    float keyLightReach = (vertexLights & LIGHT_MASK_KEY_LIGHT) != 0u ? 1.0 : 0.0;
+    color *= shadeFragment(vertexFragmentPos, normalize(vertexNormal), vertexShading, keyLightReach); // Normalize vectors to 1 unit
+#endif
 
-    // Calculate Key Lighting
-    float keyLightStrength = 0.8f;
-    vec3 key = keyLightStrength * keyLightColor;
-
-    // Octagon
-    float octStrength = 0.8f;
-    vec3 oct = octStrength * octColor;
-    
-    // Tube
-    float tubeStrength = 1.0f;
-    vec3 tube = tubeStrength * tubeColor;
-
-    // Cube 1 and 2
-    float cube1Strength = 0.0f;
-    vec3 cube1 = cube1Strength * cube1Color;
-    float cube2Strength = 0.0f;
-    vec3 cube2 = cube2Strength * cube2Color;
-
-    // Sphere
-    float sphereStrength = 0.2f;
-    vec3 sphere = sphereStrength * sphereColor;
-
-    //Calculate Diffuse lighting*/
-    vec3 norm = normalize(vertexNormal); // Normalize vectors to 1 unit
-    vec3 lightDirection = normalize(lightPos - vertexFragmentPos); // Calculate distance (light direction) between light source and fragments/pixels on cube
-    float impact = max(dot(norm, lightDirection), 0.1);// Calculate diffuse impact by generating dot product of normal and light
-    vec3 diffuse = impact * lightColor; // Generate diffuse light color
-    vec3 keyLightDirection = normalize(keyLightPos - vertexFragmentPos);
-    float keyLightImpact = max(dot(norm, keyLightDirection), 0.0);
-    vec3 keyLightDiffuse = keyLightImpact * keyLightColor;
-
-    //Calculate Specular lighting*/
-    float specularIntensity = 3.0f; // Set specular light strength
-    float highlightSize = 12.0f; // Set specular highlight size
-    vec3 viewDir = normalize(viewPosition - vertexFragmentPos); // Calculate view direction
-    vec3 reflectDir = reflect(-lightDirection, norm);// Calculate reflection vector
-
-    //Calculate specular component
-    float specularComponent = pow(max(dot(viewDir, reflectDir), 0.0), highlightSize);
-    vec3 specular = specularIntensity * specularComponent * lightColor;
-    vec3 keyLightSpecular = specularIntensity * specularComponent * keyLightColor;
-
-    // Octagon
-    vec3 octSpecular = specularIntensity * specularComponent * octColor;
-
-    // Tube
-    vec3 tubeSpecular = specularIntensity * specularComponent * tubeColor;
-
-    // Cube 1 and 2
-    vec3 cube1Specular = specularIntensity * specularComponent * cube1Color;
-    vec3 cube2Specular = specularIntensity * specularComponent * cube2Color;
-
-    // Sphere
-    vec3 sphereSpecular = specularIntensity * specularComponent * sphereColor;
-
-    // Texture holds the color to be used for all three components
-    vec4 textureColor = texture(uTexture, vertexTextureCoordinate * uvScale);
-    textureColor = texture(uTexture1, vertexTextureCoordinate * uvScale);
-    textureColor = texture(uTexture2, vertexTextureCoordinate * uvScale);
-    textureColor = texture(uTexture3, vertexTextureCoordinate * uvScale);
-    textureColor = texture(uTexture4, vertexTextureCoordinate * uvScale);
-    textureColor = texture(uTexture5, vertexTextureCoordinate * uvScale);
-
-    // Calculate phong result
-    vec3 phong = (ambient + key + diffuse + specular) * textureColor.xyz;
-
-    fragmentColor = vec4(phong, 1.0); // Send lighting results to GPU
-}
-);
-
-/* Lamp Shader Source Code*/
-const GLchar* lampVertexShaderSource = GLSL(440,
-
-    layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
-
-        //Uniform / Global variables for the  transform matrices
-uniform mat4 model;
-uniform mat4 view;
-uniform mat4 projection;
+    fragmentColor = vec4(color, 1.0); // Send lighting results to GPU
+#endif
+}
+)glsl";
 
+
+/* Deferred Lighting Shader Source Code*/
+// One triangle covering the viewport, generated from the vertex index
+const char* const deferredLightingVertexShaderSource = R"glsl(
 void main()
 {
-    gl_Position = projection * view * model * vec4(position, 1.0f); // Transforms vertices into clip coordinates
+    vec2 corner = vec2((gl_VertexID << 1) & 2, gl_VertexID & 2);
+    gl_Position = vec4(corner * 2.0 - 1.0, 0.0, 1.0);
 }
-);
+)glsl";
 
 
-/* Fragment Shader Source Code*/
-const GLchar* lampFragmentShaderSource = GLSL(440,
+// Lights every pixel of the G-buffer once with the scene shader's lighting; appended to sceneLightingShaderSource
+const char* const deferredLightingFragmentShaderSource = R"glsl(
+out vec4 fragmentColor;
 
-    out vec4 fragmentColor; // For outgoing lamp color (smaller cube) to the GPU
-uniform vec2 uvScale;
-in vec2 vertexTextureCoordinate;
-uniform sampler2D uTexture; // Useful when working with multiple textures
-uniform sampler2D uTexture1;
-uniform sampler2D uTexture2;
-uniform sampler2D uTexture3;
-uniform sampler2D uTexture4;
-uniform sampler2D uTexture5;
+uniform sampler2D uGBufferPosition;
+uniform sampler2D uGBufferNormal;
+uniform sampler2D uGBufferColor;
+uniform sampler2D uGBufferDepth;
 
-void main()
+struct MaterialRecord
 {
-    fragmentColor = texture(uTexture, vertexTextureCoordinate * uvScale);
-    fragmentColor = texture(uTexture1, vertexTextureCoordinate * uvScale);
-    fragmentColor = texture(uTexture2, vertexTextureCoordinate * uvScale);
-    fragmentColor = texture(uTexture3, vertexTextureCoordinate * uvScale);
-    fragmentColor = texture(uTexture4, vertexTextureCoordinate * uvScale);
-    fragmentColor = texture(uTexture5, vertexTextureCoordinate * uvScale);
-
-    fragmentColor = vec4(1.0f); // Set color to white (1.0f,1.0f,1.0f) with alpha 1.0
-}
-);
+    vec4 shading;
+    int layer;
+};
 
+layout(std140, binding = 2) uniform Materials
+{
+    MaterialRecord materials[MAX_MATERIAL_RECORDS];
+};
 
-// Images are loaded with Y axis going down, but OpenGL's Y axis goes up, so let's flip it
-void flipImageVertically(unsigned char* image, int width, int height, int channels)
+void main()
 {
-    for (int j = 0; j < height / 2; ++j)
-    {
-        int index1 = j * width * channels;
-        int index2 = (height - 1 - j) * width * channels;
+    ivec2 pixel = ivec2(gl_FragCoord.xy);
+    vec4 positionMaterial = texelFetch(uGBufferPosition, pixel, 0);
+    if (positionMaterial.w < 0.0)
+        discard; // Background: keep the clear color and depth
 
-        for (int i = width * channels; i > 0; --i)
-        {
-            unsigned char tmp = image[index1];
-            image[index1] = image[index2];
-            image[index2] = tmp;
-            ++index1;
-            ++index2;
-        }
+    vec3 color = texelFetch(uGBufferColor, pixel, 0).xyz;
+    vec4 shading = materials[int(positionMaterial.w)].shading;
+
+    // Unlit materials keep their color, as in the forward renderer
+    if (shading.xyz != vec3(0.0))
+    {
+        vec4 normalReach = texelFetch(uGBufferNormal, pixel, 0);
+        color *= shadeFragment(positionMaterial.xyz, normalReach.xyz, shading, normalReach.w);
     }
+
+    fragmentColor = vec4(color, 1.0);
+    gl_FragDepth = texelFetch(uGBufferDepth, pixel, 0).x;
 }
+)glsl";
 
 
-int main(int argc, char* argv[])
+/* Depth Pre-pass Shader Source Code*/
+// Positions only; the shaded pass then tests against this depth with GL_LEQUAL
+const char* const depthOnlyVertexShaderSource = GLSL_VERSION R"glsl(
+layout(location = 0) in vec3 position;
+layout(location = 3) in mat4 instanceModel;
+
+layout(std140, binding = 0) uniform Camera
 {
-    if (!UInitialize(argc, argv, &gWindow))
-        return EXIT_FAILURE;
+    mat4 view;
+    mat4 projection;
+    vec3 viewPosition;
+};
 
-    // Create the mesh
-    UCreateMesh(gMesh); // Calls the function to create the Vertex Buffer Object
+// Computed exactly as in the scene shader, so both produce the same depth
+invariant gl_Position;
 
-    // Create the shader program
-    if (!UCreateShaderProgram(vertexShaderSource, fragmentShaderSource, gProgramId))
-        return EXIT_FAILURE;
+void main()
+{
+    vec4 worldPosition = instanceModel * vec4(position, 1.0f);
+    gl_Position = projection * view * worldPosition;
+}
+)glsl";
+
+
+const char* const depthOnlyFragmentShaderSource = GLSL_VERSION R"glsl(
+void main()
+{
+}
+)glsl";
+
+
+/* Shadow Caster Shader Source Code*/
+// Renders one cube face of a light's shadow map
+const char* const shadowCasterVertexShaderSource = GLSL_VERSION R"glsl(
+layout(location = 0) in vec3 position;
+layout(location = 3) in mat4 instanceModel;
+
+uniform mat4 uLightViewProjection;
+
+out vec3 vertexFragmentPos;
+
+void main()
+{
+    vec4 worldPosition = instanceModel * vec4(position, 1.0f);
+    vertexFragmentPos = vec3(worldPosition);
+    gl_Position = uLightViewProjection * worldPosition;
+}
+)glsl";
+
+
+// Stores the distance to the light over its range, so every face compares against the same quantity
+const char* const shadowCasterFragmentShaderSource = GLSL_VERSION R"glsl(
+in vec3 vertexFragmentPos;
+
+uniform vec4 uShadowLight; // Position, range
+
+void main()
+{
+    gl_FragDepth = min(length(vertexFragmentPos - uShadowLight.xyz) / uShadowLight.w, 1.0);
+}
+)glsl";
 
-    if (!UCreateShaderProgram(lampVertexShaderSource, lampFragmentShaderSource, gLampProgramId))
-        return EXIT_FAILURE;
 
-    // Load texture
-    const char* texFilename = "../../3D Scene Interactivity/image/tubebody1.png";
-    if (!UCreateTexture(texFilename, gTextureId1))
+// Swaps two non-overlapping rows with the widest loads and stores available
+void USwapRows(unsigned char* row1, unsigned char* row2, size_t size)
+{
+    size_t i = 0;
+#ifdef USE_AVX2
+    for (; i + 32 <= size; i += 32)
     {
-        cout << "Failed to load texture " << texFilename << endl;
-        return EXIT_FAILURE;
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row1 + i));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row2 + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(row1 + i), b);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(row2 + i), a);
     }
-    texFilename = "../../3D Scene Interactivity/image/cardboard2.jpg";
-    if (!UCreateTexture(texFilename, gTextureId2))
+#endif
+#ifdef USE_SSE2
+    for (; i + 16 <= size; i += 16)
     {
-        cout << "Failed to load texture " << texFilename << endl;
-        return EXIT_FAILURE;
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row1 + i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row2 + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(row1 + i), b);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(row2 + i), a);
     }
-    texFilename = "../../3D Scene Interactivity/image/tubecap1.png";
-    if (!UCreateTexture(texFilename, gTextureId3))
+#endif
+    for (; i < size; ++i)
+        std::swap(row1[i], row2[i]);
+}
+
+
+// Images are loaded with Y axis going down, but OpenGL's Y axis goes up, so let's flip it
+void flipImageVertically(unsigned char* image, int width, int height, int channels)
+{
+    size_t rowSize = size_t(width) * channels;
+    for (int j = 0; j < height / 2; ++j)
+        USwapRows(image + j * rowSize, image + (height - 1 - j) * rowSize, rowSize);
+}
+
+
+// The original flip, one byte at a time; kept as the reference for the flip benchmark
+void UFlipImageBytewise(unsigned char* image, int width, int height, int channels)
+{
+    for (int j = 0; j < height / 2; ++j)
     {
-        cout << "Failed to load texture " << texFilename << endl;
-        return EXIT_FAILURE;
+        int index1 = j * width * channels;
+        int index2 = (height - 1 - j) * width * channels;
+
+        for (int i = width * channels; i > 0; --i)
+        {
+            unsigned char tmp = image[index1];
+            image[index1] = image[index2];
+            image[index2] = tmp;
+            ++index1;
+            ++index2;
+        }
     }
-    texFilename = "../../3D Scene Interactivity/image/octagon.png";
-    if (!UCreateTexture(texFilename, gTextureId4))
+}
+
+
+// Row swap through a scratch row with memcpy, as stb_image does when flipping on load
+void UFlipImageMemcpy(unsigned char* image, int width, int height, int channels)
+{
+    size_t rowSize = size_t(width) * channels;
+    std::vector<unsigned char> scratch(rowSize);
+    for (int j = 0; j < height / 2; ++j)
     {
-        cout << "Failed to load texture " << texFilename << endl;
-        return EXIT_FAILURE;
+        unsigned char* row1 = image + j * rowSize;
+        unsigned char* row2 = image + (height - 1 - j) * rowSize;
+        memcpy(scratch.data(), row1, rowSize);
+        memcpy(row1, row2, rowSize);
+        memcpy(row2, scratch.data(), rowSize);
     }
-    texFilename = "../../3D Scene Interactivity/image/bluebox.png";
-    if (!UCreateTexture(texFilename, gTextureId5))
+}
+
+
+// Times each way of flipping the decoded scene textures, checks they agree, and compares against
+// letting stb_image flip while decoding. Needs no GL context.
+bool URunFlipBenchmark()
+{
+    typedef std::chrono::steady_clock Clock;
+    typedef void (*FlipFunction)(unsigned char*, int, int, int);
+
+    struct FlipVariant
     {
-        cout << "Failed to load texture " << texFilename << endl;
-        return EXIT_FAILURE;
-    }
-    texFilename = "../../3D Scene Interactivity/image/pink1.png";
-    if (!UCreateTexture(texFilename, gTextureId6))
+        const char* name;
+        FlipFunction flip;
+    };
+    const FlipVariant variants[] = {
+        { "bytewise", UFlipImageBytewise },
+        { "memcpy", UFlipImageMemcpy },
+#if defined(USE_AVX2)
+        { "avx2", flipImageVertically },
+#elif defined(USE_SSE2)
+        { "sse2", flipImageVertically },
+#else
+        { "rows", flipImageVertically },
+#endif
+    };
+    const int nVariants = sizeof(variants) / sizeof(variants[0]);
+    const int runs = gOptions.flipRepetitions;
+
+    auto elapsedMs = [](Clock::time_point start) { return std::chrono::duration<double, std::milli>(Clock::now() - start).count(); };
+
+    cout << "INFO: Flip benchmark, mean ms per image over " << runs << " runs" << endl;
+
+    std::vector<double> totals(nVariants + 2, 0.0);
+    for (int t = 0; t < SCENE_TEXTURE_COUNT; ++t)
     {
-        cout << "Failed to load texture " << texFilename << endl;
-        return EXIT_FAILURE;
+        std::string filename = gOptions.assetDirectory + SCENE_TEXTURE_FILES[t];
+        std::vector<unsigned char> bytes;
+        int width, height, channels;
+        unsigned char* pixels = UReadFile(filename, bytes) ?
+            stbi_load_from_memory(bytes.data(), int(bytes.size()), &width, &height, &channels, 4) : nullptr;
+        if (!pixels)
+        {
+            cout << "Failed to load texture " << filename << endl;
+            return false;
+        }
+
+        size_t imageSize = size_t(width) * height * 4;
+        std::vector<unsigned char> reference(pixels, pixels + imageSize);
+        UFlipImageBytewise(reference.data(), width, height, 4);
+
+        cout << "FLIP: " << SCENE_TEXTURE_FILES[t] << " " << width << "x" << height << ":";
+        std::vector<unsigned char> image(imageSize);
+        for (int v = 0; v < nVariants; ++v)
+        {
+            // An odd number of flips leaves the image flipped, which is checked against the reference
+            memcpy(image.data(), pixels, imageSize);
+            Clock::time_point start = Clock::now();
+            for (int r = 0; r < (runs | 1); ++r)
+                variants[v].flip(image.data(), width, height, 4);
+            double ms = elapsedMs(start) / (runs | 1);
+
+            if (memcmp(image.data(), reference.data(), imageSize) != 0)
+            {
+                cout << endl << "Flip variant " << variants[v].name << " disagrees with the bytewise flip" << endl;
+                stbi_image_free(pixels);
+                return false;
+            }
+
+            totals[v] += ms;
+            cout << " " << variants[v].name << " " << ms;
+        }
+        stbi_image_free(pixels);
+
+        // Whole decodes, without and with stb_image's own flip
+        double decodeMs[2];
+        for (int flip = 0; flip < 2; ++flip)
+        {
+            stbi_set_flip_vertically_on_load(flip);
+            Clock::time_point start = Clock::now();
+            for (int r = 0; r < runs; ++r)
+                stbi_image_free(stbi_load_from_memory(bytes.data(), int(bytes.size()), &width, &height, &channels, 4));
+            decodeMs[flip] = elapsedMs(start) / runs;
+            totals[nVariants + flip] += decodeMs[flip];
+        }
+        stbi_set_flip_vertically_on_load(0);
+
+        cout << " | decode " << decodeMs[0] << ", decode with stb flip " << decodeMs[1] << endl;
     }
 
-    // tell opengl for each sampler to which texture unit it belongs to (only has to be done once)
-    glUseProgram(gProgramId);
-    // We set the texture as texture unit 0
-    glUniform1i(glGetUniformLocation(gProgramId, "uTexture"), 0);
-    glUniform1i(glGetUniformLocation(gProgramId, "uTexture1"), 1);
-    glUniform1i(glGetUniformLocation(gProgramId, "uTexture2"), 2);
-    glUniform1i(glGetUniformLocation(gProgramId, "uTexture3"), 3);
-    glUniform1i(glGetUniformLocation(gProgramId, "uTexture4"), 4);
-    glUniform1i(glGetUniformLocation(gProgramId, "uTexture5"), 5);
+    cout << "FLIP: all images:";
+    for (int v = 0; v < nVariants; ++v)
+        cout << " " << variants[v].name << " " << totals[v];
+    cout << " | decode " << totals[nVariants] << ", decode with stb flip " << totals[nVariants + 1] << endl;
+    return true;
+}
+
+
+int main(int argc, char* argv[])
+{
+    if (!UParseCommandLine(argc, argv, gOptions))
+        return EXIT_FAILURE;
+
+    if (gOptions.flipBenchmark)
+        return URunFlipBenchmark() ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    if (!UInitialize(argc, argv, &gWindow))
+        return EXIT_FAILURE;
+    UReportStartupPhase("window and context");
+
+    // Create the mesh
+    UCreateMesh(gMesh); // Calls the function to create the Vertex Buffer Object
+    UCreateInstanceBuffer(gInstances, gMesh.vao);
+    UCreateScene();
+    UScatterProps(gOptions.propCount);
+    UUpdateEntityTransforms(gEntities);
+    UBuildBvh(gEntities, gBvh);
+    UReportStartupPhase("mesh and scene");
+
+    // Create the uniform buffer shared by every program, and the storage buffers of the clustered lights
+    UCreateFrameUniformBuffer(gFrameUniforms);
+    UCreateClusterGrid(gClusterGrid);
+    UCreateSceneLights(gOptions.lightCount);
+
+    // Load textures: decoded in parallel, uploaded here into the layers of one array as they arrive
+    if (!ULoadTextureArray(SCENE_TEXTURE_FILES, SCENE_TEXTURE_COUNT, gSceneTextures))
+        return EXIT_FAILURE;
+    UReportStartupPhase("textures");
+
+    // Submit the shader variant each material needs; uniform locations are looked up once per variant
+    if (!UCreateMaterials())
+        return EXIT_FAILURE;
+    if (!UCreateDeferredRenderer() || !USetDeferredShading(gOptions.deferred) || !UCreateDepthPrepass()
+        || !UCreateShadowMaps(gOptions.shadowResolution, gShadowMaps))
+        return EXIT_FAILURE;
+    cout << "INFO: Cached uniform locations (" << gTotalUniformLookups << " lookups at startup)" << endl;
+    UReportStartupPhase("materials and shader variants");
 
     // Sets the background color of the window to black (it will be implicitely used by glClear)
     glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
 
+    // Benchmark and offscreen runs render a fixed number of frames and exit, with the final shaders throughout
+    // A failed run still falls through to the cleanup below, which joins the light binning workers
+    if ((gOptions.benchmark || gOptions.headless) && !UFinishShaderVariants())
+        return EXIT_FAILURE;
+    bool isRunOk = true;
+    if (gOptions.benchmark)
+        isRunOk = URunBenchmark();
+    else if (gOptions.headless)
+        isRunOk = URunHeadless();
+
     // render loop
     // -----------
-    while (!glfwWindowShouldClose(gWindow))
+    while (!gOptions.headless && !gOptions.benchmark && !glfwWindowShouldClose(gWindow))
     {
         // per-frame timing
         // --------------------
@@ -432,25 +1608,29 @@ int main(int argc, char* argv[])
         // Render this frame
         URender();
 
+        UReportFrameStats();
+
         glfwPollEvents();
     }
 
     // Release mesh data
+    UDestroyInstanceBuffer(gInstances);
     UDestroyMesh(gMesh);
 
     // Release texture
-    UDestroyTexture(gTextureId1);
-    UDestroyTexture(gTextureId2);
-    UDestroyTexture(gTextureId3);
-    UDestroyTexture(gTextureId4);
-    UDestroyTexture(gTextureId5);
-    UDestroyTexture(gTextureId6);
+    UDestroyTexture(gSceneTextures);
 
     // Release shader program
-    UDestroyShaderProgram(gProgramId);
-    UDestroyShaderProgram(gLampProgramId);
-
-    exit(EXIT_SUCCESS); // Terminates the program successfully
+    UDestroyFrameUniformBuffer(gFrameUniforms);
+    UDestroyClusterGrid(gClusterGrid);
+    glDeleteBuffers(1, &gMaterialBuffer);
+    UDestroyDeferredRenderer();
+    UDestroyShaderProgram(gDepthOnlyProgramId);
+    UDestroyShadowMaps(gShadowMaps);
+    UDestroyOcclusionQueries(gOcclusionQueries);
+    UDestroyShaderVariants();
+
+    exit(isRunOk ? EXIT_SUCCESS : EXIT_FAILURE); // Terminates the program, successfully unless a benchmark or offscreen run failed
 }
 
 
@@ -468,6 +1648,10 @@ bool UInitialize(int argc, char* argv[], GLFWwindow** window)
     glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
 #endif
 
+    // Headless runs only need a context: keep the window hidden and render into an offscreen target
+    if (gOptions.headless)
+        glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+
     // GLFW: window creation
     // ---------------------
     * window = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, WINDOW_TITLE, NULL, NULL);
@@ -478,13 +1662,18 @@ bool UInitialize(int argc, char* argv[], GLFWwindow** window)
         return false;
     }
     glfwMakeContextCurrent(*window);
-    glfwSetFramebufferSizeCallback(*window, UResizeWindow);
-    glfwSetCursorPosCallback(*window, UMousePositionCallback);
-    glfwSetScrollCallback(*window, UMouseScrollCallback);
-    glfwSetMouseButtonCallback(*window, UMouseButtonCallback);
 
-    // tell GLFW to capture our mouse
-    glfwSetInputMode(*window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+    // Input is ignored in headless mode so every run renders the same frames
+    if (!gOptions.headless)
+    {
+        glfwSetFramebufferSizeCallback(*window, UResizeWindow);
+        glfwSetCursorPosCallback(*window, UMousePositionCallback);
+        glfwSetScrollCallback(*window, UMouseScrollCallback);
+        glfwSetMouseButtonCallback(*window, UMouseButtonCallback);
+
+        // tell GLFW to capture our mouse
+        glfwSetInputMode(*window, GLFW_CURSOR, GLFW_CURSOR_DISABLED);
+    }
 
     // GLEW: initialize
     // ----------------
@@ -501,6 +1690,17 @@ bool UInitialize(int argc, char* argv[], GLFWwindow** window)
     // Displays GPU OpenGL version
     cout << "INFO: OpenGL Version: " << glGetString(GL_VERSION) << endl;
 
+    // Program binaries are only valid for the driver that produced them
+    gDriverIdentity = std::string((const char*)glGetString(GL_VENDOR)) + "|" + (const char*)glGetString(GL_RENDERER)
+        + "|" + (const char*)glGetString(GL_VERSION);
+
+    // Let the driver compile shaders on as many threads as it likes
+    if (GLEW_KHR_parallel_shader_compile)
+        glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+    else if (GLEW_ARB_parallel_shader_compile)
+        glMaxShaderCompilerThreadsARB(0xFFFFFFFF);
+    cout << "INFO: Parallel shader compile " << (GLEW_KHR_parallel_shader_compile || GLEW_ARB_parallel_shader_compile ? "available" : "unavailable") << endl;
+
     return true;
 }
 
@@ -536,12 +1736,20 @@ void UProcessInput(GLFWwindow* window)
         gIsLampOrbiting = true;
     else if (glfwGetKey(window, GLFW_KEY_K) == GLFW_PRESS && gIsLampOrbiting)
         gIsLampOrbiting = false;
+
+    // Switch between the deferred and the forward renderer
+    if (glfwGetKey(window, GLFW_KEY_G) == GLFW_PRESS && !gDeferredShading)
+        USetDeferredShading(true);
+    else if (glfwGetKey(window, GLFW_KEY_F) == GLFW_PRESS && gDeferredShading)
+        USetDeferredShading(false);
 }
 
 
 // glfw: whenever the window size changed (by OS or user resize) this callback function executes
 void UResizeWindow(GLFWwindow* window, int width, int height)
 {
+    gViewportWidth = width;
+    gViewportHeight = height;
     glViewport(0, 0, width, height);
 }
 
@@ -583,7 +1791,21 @@ void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
     case GLFW_MOUSE_BUTTON_LEFT:
     {
         if (action == GLFW_PRESS)
+        {
             cout << "Left mouse button pressed" << endl;
+
+            // Pick along the ray through the center of the screen (the cursor is captured)
+            glm::vec3 origin = gCamera.Position;
+            if (perspective)
+                origin += 1.5f * gCamera.Right - 3.0f * gCamera.Up;     // Center of the orthographic view volume
+
+            float distance;
+            GLint entity = UPickEntity(gBvh, gEntities, origin, gCamera.Front, distance);
+            if (entity >= 0)
+                cout << "Picked entity " << entity << " (" << MESH_PART_NAMES[gEntities.parts[entity]] << ") at distance " << distance << endl;
+            else
+                cout << "Picked nothing" << endl;
+        }
         else
             cout << "Left mouse button released" << endl;
     }
@@ -617,6 +1839,14 @@ void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
 // Functioned called to render a frame
 void URender()
 {
+    gFrameStats = FrameStats();
+    UPollShaderVariants();
+
+    // The G-buffer follows the viewport; (re)created before the state cache is reset since creation binds directly
+    if (gDeferredShading && !UResizeGBuffer(gViewportWidth, gViewportHeight, gGBuffer))
+        USetDeferredShading(false);
+    UResetStateCache();
+
     // Lamp orbits around the origin
     const float angularVelocity = glm::radians(45.0f);
     if (gIsLampOrbiting)
@@ -627,6 +1857,8 @@ void URender()
         gLightPosition.z = newPosition.z;
     }
 
+    UBeginPassTimer(PASS_CLEAR);
+
     // Enable z-depth
     glEnable(GL_DEPTH_TEST);
 
@@ -634,246 +1866,287 @@ void URender()
     glClearColor(1.2, 0.5f, 0.0f, 1.0f);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-    // Activate the cube VAO (used by pyramid and lamp)
-    glBindVertexArray(gMesh.vao);
-
-    // Set the shader to be used
-    glUseProgram(gProgramId);
-
-    // Model matrix: transformations are applied right-to-left order
-    glm::mat4 model = glm::translate(gCubePosition) * glm::scale(gCubeScale);
+    UEndPassTimer();
 
     // camera/view transformation
-    glm::mat4 view = gCamera.GetViewMatrix();
+    CameraBlock camera;
+    camera.view = gCamera.GetViewMatrix();
 
-    glm::mat4 projection;
     if (!perspective)
     {
         // Enables perspective view (default) by pressing "P" key
-        projection = glm::perspective(glm::radians(gCamera.Zoom), (GLfloat)WINDOW_WIDTH / (GLfloat)WINDOW_HEIGHT, 0.1f, 100.0f);
+        camera.projection = glm::perspective(glm::radians(gCamera.Zoom), (GLfloat)gViewportWidth / (GLfloat)gViewportHeight, CAMERA_NEAR, CAMERA_FAR);
     }
     else
         // Enables ortho view when pressing "O" key
-        projection = glm::ortho(-12.0f, 15.0f, -7.0f, 1.0f, 0.1f, 100.0f);
-
-    // Retrieves and passes transform matrices to the Shader program
-    GLint modelLoc = glGetUniformLocation(gProgramId, "model");
-    GLint viewLoc = glGetUniformLocation(gProgramId, "view");
-    GLint projLoc = glGetUniformLocation(gProgramId, "projection");
-
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-
-    // Reference matrix uniforms from the Cube Shader program for the cub color, light color, light position, and camera position
-    GLint objectColorLoc = glGetUniformLocation(gProgramId, "objectColor");
-    GLint lightColorLoc = glGetUniformLocation(gProgramId, "lightColor");
-    GLint lightPositionLoc = glGetUniformLocation(gProgramId, "lightPos");
-    GLint viewPositionLoc = glGetUniformLocation(gProgramId, "viewPosition");
-    GLint keyLightColorLoc = glGetUniformLocation(gProgramId, "keyLightColor");
-    GLint keyLightPositionLoc = glGetUniformLocation(gProgramId, "keyLightPos");
-
-    // Octagon
-    GLint octColorLoc = glGetUniformLocation(gProgramId, "octColor");
-    GLint octPositionLoc = glGetUniformLocation(gProgramId, "octPos");
-
-    // Tube
-    GLint tubeColorLoc = glGetUniformLocation(gProgramId, "tubeColor");
-    GLint tubePositionLoc = glGetUniformLocation(gProgramId, "tubePos");
-
-    // Cube 1 and 2
-    GLint cube1ColorLoc = glGetUniformLocation(gProgramId, "cube1Color");
-    GLint cube1PositionLoc = glGetUniformLocation(gProgramId, "cube1Pos");
-    GLint cube2ColorLoc = glGetUniformLocation(gProgramId, "cube2Color");
-    GLint cube2PositionLoc = glGetUniformLocation(gProgramId, "cube2Pos");
-
-    // Sphere
-    GLint sphereColorLoc = glGetUniformLocation(gProgramId, "sphereColor");
-    GLint spherePositionLoc = glGetUniformLocation(gProgramId, "spherePos");
-
-    // Pass color, light, and camera data to the Cube Shader program's corresponding uniforms
-    glUniform3f(objectColorLoc, gObjectColor.r, gObjectColor.g, gObjectColor.b);
-    glUniform3f(lightColorLoc, gLightColor.r, gLightColor.g, gLightColor.b);
-    glUniform3f(lightPositionLoc, gLightPosition.x, gLightPosition.y, gLightPosition.z);
-    glUniform3f(keyLightColorLoc, gKeyLightColor.r, gKeyLightColor.g, gKeyLightColor.b);
-    glUniform3f(keyLightPositionLoc, gKeyLightPosition.x, gKeyLightPosition.y, gKeyLightPosition.z);
-    glUniform3f(octColorLoc, gOctColor.r, gOctColor.g, gOctColor.b);
-    glUniform3f(octPositionLoc, gOctPosition.x, gOctPosition.y, gOctPosition.z);
-    glUniform3f(tubeColorLoc, gTubeColor.r, gTubeColor.g, gTubeColor.b);
-    glUniform3f(tubePositionLoc, gTubePosition.x, gTubePosition.y, gTubePosition.z);
-    glUniform3f(cube1ColorLoc, gCube1Color.r, gCube1Color.g, gCube1Color.b);
-    glUniform3f(cube1PositionLoc, gCube1Position.x, gCube1Position.y, gCube1Position.z);
-    glUniform3f(cube2ColorLoc, gCube2Color.r, gCube2Color.g, gCube2Color.b);
-    glUniform3f(cube2PositionLoc, gCube2Position.x, gCube2Position.y, gCube2Position.z);
-    glUniform3f(sphereColorLoc, gSphereColor.r, gSphereColor.g, gSphereColor.b);
-    glUniform3f(spherePositionLoc, gSpherePosition.x, gSpherePosition.y, gSpherePosition.z);
-    const glm::vec3 cameraPosition = gCamera.Position;
-    glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
-
-    GLint UVScaleLoc = glGetUniformLocation(gProgramId, "uvScale");
-    glUniform2fv(UVScaleLoc, 1, glm::value_ptr(gUVScale));
-
-
-    // bind textures on corresponding texture units
-    glActiveTexture(GL_TEXTURE5);
-    glBindTexture(GL_TEXTURE_2D, gTextureId2);
-    // Draws the triangles
-    glDrawArrays(GL_TRIANGLES, 36, 6);
-
-    // LAMP: draw lamp
-    //----------------
-    glUseProgram(gLampProgramId);
-
-    //Transform the smaller cube used as a visual que for the light source
-    model = glm::translate(gLightPosition) * glm::scale(gLightScale);
-
-    // Reference matrix uniforms from the Lamp Shader program
-    modelLoc = glGetUniformLocation(gLampProgramId, "model");
-    viewLoc = glGetUniformLocation(gLampProgramId, "view");
-    projLoc = glGetUniformLocation(gLampProgramId, "projection");
-
-    // Pass matrix data to the Lamp Shader program's matrix uniforms
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-
-    glDrawArrays(GL_TRIANGLES, 0, 36);
-
-    // Key light
-    glUseProgram(gLampProgramId);
-
-    model = glm::translate(gKeyLightPosition) * glm::scale(gKeyLightScale);
-
-    modelLoc = glGetUniformLocation(gLampProgramId, "model");
-    viewLoc = glGetUniformLocation(gLampProgramId, "view");
-    projLoc = glGetUniformLocation(gLampProgramId, "projection");
-
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-
-
-    glDrawArrays(GL_TRIANGLES, 0, 36);
-
-    // Tube
-    //----------------
-    glUseProgram(gProgramId);
-
-    //Transform the smaller cube used as a visual que for the light source
-    model = glm::translate(gTubePosition) * glm::scale(gTubeScale);
-
-    // Reference matrix uniforms from the Lamp Shader program
-    modelLoc = glGetUniformLocation(gProgramId, "model");
-    viewLoc = glGetUniformLocation(gProgramId, "view");
-    projLoc = glGetUniformLocation(gProgramId, "projection");
-
-    // Pass matrix data to the Lamp Shader program's matrix uniforms
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-    glActiveTexture(GL_TEXTURE5);
-    glBindTexture(GL_TEXTURE_2D, gTextureId1);
-    // Draws the triangles
-    glDrawArrays(GL_TRIANGLES, 42, 30);
-
-    glActiveTexture(GL_TEXTURE5);
-    glBindTexture(GL_TEXTURE_2D, gTextureId3);
-    // Draws the triangles
-    glDrawArrays(GL_TRIANGLES, 72, 66);
-
-    // Octagon
-    //----------------
-    glUseProgram(gProgramId);
-
-    //Transform the smaller cube used as a visual que for the light source
-    model = glm::translate(gOctPosition) * glm::scale(gOctScale);
-
-    // Reference matrix uniforms from the Lamp Shader program
-    modelLoc = glGetUniformLocation(gProgramId, "model");
-    viewLoc = glGetUniformLocation(gProgramId, "view");
-    projLoc = glGetUniformLocation(gProgramId, "projection");
-
-    // Pass matrix data to the Lamp Shader program's matrix uniforms
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-    glActiveTexture(GL_TEXTURE5);
-    glBindTexture(GL_TEXTURE_2D, gTextureId4);
-    glDrawArrays(GL_TRIANGLES, 138, 84);
-
-    // Cube 2
-    //----------------
-    glUseProgram(gProgramId);
-
-    //Transform the smaller cube used as a visual que for the light source
-    model = glm::translate(gCube2Position) * glm::scale(gCube2Scale);
-
-    // Reference matrix uniforms from the Lamp Shader program
-    modelLoc = glGetUniformLocation(gProgramId, "model");
-    viewLoc = glGetUniformLocation(gProgramId, "view");
-    projLoc = glGetUniformLocation(gProgramId, "projection");
-
-    // Pass matrix data to the Lamp Shader program's matrix uniforms
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-    glActiveTexture(GL_TEXTURE5);
-    glBindTexture(GL_TEXTURE_2D, gTextureId5);
-    glDrawArrays(GL_TRIANGLES, 0, 36);
-
-    // Cube 1
-    //----------------
-    glUseProgram(gProgramId);
-
-    //Transform the smaller cube used as a visual que for the light source
-    model = glm::translate(gCube1Position) * glm::scale(gCube1Scale);
-
-    // Reference matrix uniforms from the Lamp Shader program
-    modelLoc = glGetUniformLocation(gProgramId, "model");
-    viewLoc = glGetUniformLocation(gProgramId, "view");
-    projLoc = glGetUniformLocation(gProgramId, "projection");
-
-    // Pass matrix data to the Lamp Shader program's matrix uniforms
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-    glActiveTexture(GL_TEXTURE5);
-    glBindTexture(GL_TEXTURE_2D, gTextureId5);
-    glDrawArrays(GL_TRIANGLES, 222, 36);
-
-    // Sphere
-    //----------------
-    glUseProgram(gProgramId);
-
-    //Transform the smaller cube used as a visual que for the light source
-    model = glm::translate(gSpherePosition) * glm::scale(gSphereScale);
-
-    // Reference matrix uniforms from the Lamp Shader program
-    modelLoc = glGetUniformLocation(gProgramId, "model");
-    viewLoc = glGetUniformLocation(gProgramId, "view");
-    projLoc = glGetUniformLocation(gProgramId, "projection");
-
-    // Pass matrix data to the Lamp Shader program's matrix uniforms
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
-    glActiveTexture(GL_TEXTURE5);
-    glBindTexture(GL_TEXTURE_2D, gTextureId6);
-    glDrawArrays(GL_TRIANGLES, 258, 192);
+        camera.projection = glm::ortho(-12.0f, 15.0f, -7.0f, 1.0f, CAMERA_NEAR, CAMERA_FAR);
+
+    camera.viewPosition = glm::vec4(gCamera.Position, 1.0f);
+
+    // The lamp entity follows the orbiting light
+    if (gEntities.positions[gSceneEntities[OBJECT_LAMP]] != gLightPosition)
+        USetEntityPosition(gEntities, gSceneEntities[OBJECT_LAMP], gLightPosition);
+
+    // Refitted before the lights are binned against it
+    UUpdateEntityTransforms(gEntities);
+    URefitBvh(gEntities, gBvh, gMovedEntities);
+
+    // Find the entities the key light reaches with the same hierarchy
+    UAssignEntityLights(gBvh, gEntities, gLitEntities);
+
+    // The lamp is the first point light; every light is binned into the clusters its range reaches
+    gPointLights[0].position = glm::vec4(gLightPosition, LAMP_LIGHT_RANGE);
+    UAssignLightsToClusters(gPointLights, camera, gBvh, gEntities, gClusterGrid);
+
+    // The lights casting shadows, in ShadowLight order; the key light is treated as a point light for them
+    const glm::vec4 shadowLights[SHADOW_LIGHT_COUNT] = { gPointLights[0].position, glm::vec4(gKeyLightPosition, KEY_LIGHT_RANGE) };
+    UUploadClusterGrid(gPointLights, gClusterGrid);
+
+    // Lights read by the lit shader variants
+    LightBlock lights = {};
+    lights.keyLightColor = glm::vec4(gKeyLightColor, 1.0f);
+    lights.clusterGrid[0] = CLUSTER_TILES_X;
+    lights.clusterGrid[1] = CLUSTER_TILES_Y;
+    lights.clusterGrid[2] = CLUSTER_SLICES;
+    lights.clusterGrid[3] = GLint(gPointLights.size());
+    lights.clusterSlicing = glm::vec4(gClusterGrid.sliceScale, gClusterGrid.sliceBias,
+                                      float(gViewportWidth) / CLUSTER_TILES_X, float(gViewportHeight) / CLUSTER_TILES_Y);
+    for (int i = 0; i < SHADOW_LIGHT_COUNT; ++i)
+        lights.shadowLights[i] = shadowLights[i];
+    lights.shadowSettings[0] = gOptions.shadowTaps;
+    lights.shadowSettings[1] = gOptions.shadows ? 1 : 0;
+    lights.shadowFilter = glm::vec4(2.0f / gOptions.shadowResolution, SHADOW_NORMAL_OFFSET_TEXELS, SHADOW_FILTER_TEXELS, 0.0f);
+
+    // Send everything to the GPU in a single upload shared by both programs
+    UUploadFrameUniforms(gFrameUniforms, camera, lights);
+
+    // Pick the tessellation of the round objects from their size on screen
+    UUpdateEntityLods(gEntities);
+
+    // Only entities whose bounding sphere touches the view frustum are drawn
+    Frustum frustum;
+    UExtractFrustum(camera.projection * camera.view, frustum);
+    UCullEntities(gEntities, frustum, gVisibleEntities);
+    gFrameStats.culledEntities = GLuint(gEntities.positions.size() - gVisibleEntities.size());
+
+    // Of those, skip the ones earlier frames found hidden behind others
+    if (gOptions.occlusionCulling)
+        UCullOccludedEntities(gEntities, frustum, gOcclusionQueries, gVisibleEntities);
+
+    // Sort the frame's draws by state, then merge runs sharing program, texture and mesh range into instanced batches
+    UBuildRenderQueue(gEntities, gVisibleEntities, gRenderQueue);
+    UBuildDrawBatches(gEntities, gRenderQueue, gInstances, gDrawBatches);
+    if (gOptions.depthPrepass)
+        UBuildDepthBatches(gEntities, gRenderQueue, gDepthQueue, gInstances, gDepthBatches);
+    if (gOptions.shadows)
+        UBuildShadowBatches(gEntities, shadowLights, gShadowMaps, gInstances);
+    if (gOptions.occlusionCulling)
+        UAddOcclusionBoxes(gEntities, gOcclusionQueries, gInstances);
+    UUploadInstances(gInstances);
+
+    // Activate the cube VAO (used by pyramid and lamp)
+    UBindVertexArray(gMesh.vao);
+
+    // Shadow maps first; the lit variants sample them
+    if (gOptions.shadows)
+    {
+        URenderShadowMaps(gShadowMaps);
+        UBindTexture(SHADOW_TEXTURE_UNIT, GL_TEXTURE_CUBE_MAP_ARRAY, gShadowMaps.depthTexture);
+    }
+
+    // Lit objects first, then the lamps
+    if (gDeferredShading)
+        UDrawDeferredOpaque();
+    else
+        UDrawOpaquePass();
+    UDrawPass(PASS_LAMPS, gDrawBatches);
+
+    // Test this frame's query candidates against the finished depth; the results are read in later frames
+    if (gOptions.occlusionCulling)
+        UIssueOcclusionQueries(gOcclusionQueries);
 
     // Deactivate the Vertex Array Object
-    glBindVertexArray(0);
-    glUseProgram(0);
+    UBindVertexArray(0);
+    UUseProgram(0);
 
     // glfw: swap buffers and poll IO events (keys pressed/released, mouse moved etc.)
-    glfwSwapBuffers(gWindow);    // Flips the the back buffer with the front buffer every frame.
+    if (!gOptions.headless)
+        glfwSwapBuffers(gWindow);    // Flips the the back buffer with the front buffer every frame.
+}
+
+// Draws the batches of one pass
+void UDrawPass(RenderPass pass, const std::vector<DrawBatch>& batches)
+{
+    UBeginPassTimer(pass);
+
+    for (size_t i = 0; i < batches.size(); ++i)
+    {
+        const DrawBatch& batch = batches[i];
+        if (batch.pass != pass)
+            continue;
+
+        UUseProgram(batch.programId);
+        if (batch.textureId != 0)
+            UBindTexture(SCENE_TEXTURE_UNIT, GL_TEXTURE_2D_ARRAY, batch.textureId);
+
+        UDrawSubMesh(gMesh, batch.part, batch.lod, batch.firstInstance, batch.nInstances);
+    }
+
+    UEndPassTimer();
+}
+
+
+// Draws the opaque batches into the bound framebuffer. With the depth pre-pass, depth is laid down front to back
+// first, so the shaded pass only runs for the fragment that ends up visible in each pixel.
+void UDrawOpaquePass()
+{
+    if (gOptions.depthPrepass)
+    {
+        glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+        UDrawPass(PASS_DEPTH_PREPASS, gDepthBatches);
+        glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+
+        // The depth is final: keep it and let through only fragments at it
+        glDepthFunc(GL_LEQUAL);
+        glDepthMask(GL_FALSE);
+    }
+
+    UBeginSampleCounter();
+    UDrawPass(PASS_OPAQUE, gDrawBatches);
+    UEndSampleCounter();
+
+    if (gOptions.depthPrepass)
+    {
+        glDepthFunc(GL_LESS);
+        glDepthMask(GL_TRUE);
+    }
+}
+
+
+// Deferred renderer: the opaque batches fill the G-buffer, then a fullscreen triangle lights each covered pixel once
+// and writes its color and depth to the frame, where the lamps are drawn next
+void UDrawDeferredOpaque()
+{
+    GLint sceneFramebuffer = 0;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &sceneFramebuffer);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, gGBuffer.fbo);
+    const GLfloat noSurface[4] = { 0.0f, 0.0f, 0.0f, -1.0f };
+    const GLfloat zero[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    const GLfloat farDepth = 1.0f;
+    glClearBufferfv(GL_COLOR, 0, noSurface);
+    glClearBufferfv(GL_COLOR, 1, zero);
+    glClearBufferfv(GL_COLOR, 2, zero);
+    glClearBufferfv(GL_DEPTH, 0, &farDepth);
+
+    UDrawOpaquePass();
+
+    glBindFramebuffer(GL_FRAMEBUFFER, sceneFramebuffer);
+
+    UBeginPassTimer(PASS_LIGHTING);
+
+    UUseProgram(gDeferredLightingProgramId);
+    const GLuint textures[4] = { gGBuffer.positionTexture, gGBuffer.normalTexture, gGBuffer.colorTexture, gGBuffer.depthTexture };
+    for (int i = 0; i < 4; ++i)
+        UBindTexture(GBUFFER_TEXTURE_UNIT + i, GL_TEXTURE_2D, textures[i]);
+
+    // Every pixel passes the test; the G-buffer depth it writes is what the lamps are tested against
+    glDepthFunc(GL_ALWAYS);
+    UBindVertexArray(gFullscreenVao);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    ++gFrameStats.drawCalls;
+    ++gFrameStats.instances;
+    ++gFrameStats.triangles;
+    glDepthFunc(GL_LESS);
+    UBindVertexArray(gMesh.vao);
+
+    UEndPassTimer();
+}
+
+
+// Draws each face's batches into one cube of a shadow map texture, clearing the faces first when asked to
+static void UDrawShadowFaces(GLuint texture, int light, const glm::vec4& lightPosition, const std::vector<DrawBatch>* faceBatches, bool clear)
+{
+    const GLfloat farDepth = 1.0f;
+    for (int face = 0; face < CUBE_FACE_COUNT; ++face)
+    {
+        if (!clear && faceBatches[face].empty())
+            continue;
+
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, texture, 0, light * CUBE_FACE_COUNT + face);
+        if (clear)
+            glClearBufferfv(GL_DEPTH, 0, &farDepth);
+
+        USetUniform(gShadowCasterUniforms.lightViewProjection, UShadowFaceViewProjection(lightPosition, face));
+        for (size_t i = 0; i < faceBatches[face].size(); ++i)
+        {
+            const DrawBatch& batch = faceBatches[face][i];
+            UDrawSubMesh(gMesh, batch.part, batch.lod, batch.firstInstance, batch.nInstances);
+        }
+    }
+}
+
+
+// Draws every caster of the lights that moved straight into the sampled map. For the others, re-renders the static
+// cache when it needs it, copies the cache into the sampled map if the moving casters changed, and draws those
+// casters over it. Lights that stay put with nothing moving in range cost nothing.
+// The bound framebuffer and viewport are restored.
+void URenderShadowMaps(GLShadowMaps& maps)
+{
+    UBeginPassTimer(PASS_SHADOWS);
+    GLuint drawCalls = gFrameStats.drawCalls;
+    GLuint instances = gFrameStats.instances;
+
+    GLint sceneFramebuffer = 0;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &sceneFramebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, maps.fbo);
+    glViewport(0, 0, maps.resolution, maps.resolution);
+    UUseProgram(gShadowCasterProgramId);
+
+    for (int light = 0; light < SHADOW_LIGHT_COUNT; ++light)
+    {
+        if (maps.drawDirect[light])
+        {
+            USetUniform(gShadowCasterUniforms.shadowLight, maps.lights[light]);
+            UDrawShadowFaces(maps.depthTexture, light, maps.lights[light], maps.staticBatches[light], true);
+            UDrawShadowFaces(maps.depthTexture, light, maps.lights[light], maps.dynamicBatches[light], false);
+            continue;
+        }
+
+        // Otherwise the sampled map still holds exactly the cached casters
+        if (!maps.copyStatic[light])
+            continue;
+
+        USetUniform(gShadowCasterUniforms.shadowLight, maps.lights[light]);
+        if (maps.rebuildStatic[light])
+        {
+            UDrawShadowFaces(maps.staticTexture, light, maps.lights[light], maps.staticBatches[light], true);
+            ++gFrameStats.shadowStaticRebuilds;
+        }
+        else
+            ++gFrameStats.shadowCacheHits;
+
+        glCopyImageSubData(maps.staticTexture, GL_TEXTURE_CUBE_MAP_ARRAY, 0, 0, 0, light * CUBE_FACE_COUNT,
+                           maps.depthTexture, GL_TEXTURE_CUBE_MAP_ARRAY, 0, 0, 0, light * CUBE_FACE_COUNT,
+                           maps.resolution, maps.resolution, CUBE_FACE_COUNT);
+        UDrawShadowFaces(maps.depthTexture, light, maps.lights[light], maps.dynamicBatches[light], false);
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, sceneFramebuffer);
+    glViewport(0, 0, gViewportWidth, gViewportHeight);
+
+    gFrameStats.shadowDrawCalls = gFrameStats.drawCalls - drawCalls;
+    gFrameStats.shadowInstances = gFrameStats.instances - instances;
+    gTotalShadowCacheHits += gFrameStats.shadowCacheHits;
+    UEndPassTimer();
 }
 
+
 // Implements the UCreateMesh function
 void UCreateMesh(GLMesh& mesh)
 {
     // Vertex Data
-    GLfloat verts[] = {
+    const GLfloat cubeVerts[] = {
 
         // Floating cube lamp
         //Back Face          //Negative Z Normal  Texture Coords.
@@ -923,6 +2196,9 @@ void UCreateMesh(GLMesh& mesh)
     0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,
    -0.5f,  0.5f,  0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 0.0f,
    -0.5f,  0.5f, -0.5f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f,
+  };
+
+    const GLfloat tableVerts[] = {
 
    // White Table
   -15.0f, -5.0f, -12.10f,   0.0f, -1.0f, 0.0f,   0.5f, 1.0f,
@@ -931,714 +2207,3696 @@ void UCreateMesh(GLMesh& mesh)
    15.0f, -5.0f,  12.10f,   0.0f, -1.0f, 0.0f,   0.5f, 1.0f,
   -15.0f, -5.0f,  12.10f,   0.0f, -1.0f, 0.0f,   0.0f, 0.0f,
   -15.0f, -5.0f, -12.10f,   0.0f, -1.0f, 0.0f,   1.0f, 0.0f,
-
-  //Body of the tube
-  //Triangle 0
-  1.0f, 3.0f, 0.0f,                      0.0f,  0.0f, 1.0f,  0.0f, 0.0f, // Coordinate 1
- -1.0f, 3.0f, 0.0f,                      0.0f,  0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 0
-  cos(5 * PI / 8), 0, -sin(5 * PI / 8),  0.0f,  0.0f, 1.0f,  0.5f, 1.0f, // Coordinate 6
-  //Triangle 1
-  1.0f, 3.0f, 0.0f,                        0.0f,  0.0f, 1.0f,  0.0f, 0.0f, // Coordinate 1
- -1.0f, 3.0f, 0.0f,                        0.0f,  0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 0
-  cos(13 * PI / 8), 0, -sin(13 * PI / 8),  0.0f,  0.0f, 1.0f,  0.5f, 1.0f, // Coordinate 2
-  // Triangle 2
-  1.0f, 3.0f, 0.0f,                      0.0f,  0.0f, 1.0f,  0.5f, 1.0f, // Coordinate 1
-  cos(3 * PI / 8), 0, -sin(3 * PI / 8),  0.0f,  0.0f, 1.0f,  0.0f, 0.0f, // Coordinate 5
-  cos(5 * PI / 8), 0, -sin(5 * PI / 8),  0.0f,  0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 6
-  // Triangle 3
-  1.0f, 3.0f, 0.0f,                      0.0f,  0.0f, 1.0f,  0.5f, 1.0f, // Coordinate 1
-  cos(3 * PI / 8), 0, -sin(3 * PI / 8),  0.0f,  0.0f, 1.0f,  0.0f, 0.0f, // Coordinate 5
-  cos(1 * PI / 8), 0, -sin(1 * PI / 8),  0.0f,  0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 4
-  //Triangle 4
-  1.0f, 3.0f, 0.0f,                        0.0f, 0.0f,  1.0f,  0.5f, 1.0f, // Coordinate 1
-  cos(15 * PI / 8), 0, -sin(15 * PI / 8),  0.0f, 0.0f,  1.0f,  0.0f, 0.0f, // Coordinate 3
-  cos(1 * PI / 8), 0, -sin(1 * PI / 8),    0.0f, 0.0f,  1.0f,  1.0f, 0.0f, // Coordinate 4
-  //Triangle 5
-  1.0f, 3.0f, 0.0f,                        0.0f,  0.0f,  1.0f,  0.5f, 1.0f, // Coordinate 1
-  cos(15 * PI / 8), 0, -sin(15 * PI / 8),  0.0f,  0.0f,  1.0f,  0.0f, 0.0f, // Coordinate 3
-  cos(13 * PI / 8), 0, -sin(13 * PI / 8),  0.0f,  0.0f,  1.0f,  1.0f, 0.0f, // Coordinate 2
-  //Triangle 6
-  -1.0f, 3.0f, 0.0f,                        0.0f,  0.0f, 1.0f,  0.5f, 1.0f, // Coordinate 0
-  cos(13 * PI / 8), 0, -sin(13 * PI / 8),   0.0f,  0.0f, 1.0f,  0.0f, 0.0f, // Coordinate 2
-  cos(11 * PI / 8), 0, -sin(11 * PI / 8),   0.0f,  0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 9
-  //Triangle 7
-  -1.0f, 3.0f, 0.0f,                       0.0f,  0.0f, 1.0f,  0.5f, 1.0f, // Coordinate 0
-  cos(9 * PI / 8), 0, -sin(9 * PI / 8),    0.0f,  0.0f, 1.0f,  0.0f, 0.0f, // Coordinate 8
-  cos(11 * PI / 8), 0, -sin(11 * PI / 8),  0.0f,  0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 9
-  //Triangle 8
-  -1.0f, 3.0f, 0.0f,                     0.0f,  0.0f, 1.0f,  0.5f, 1.0f, // Coordinate 0
-  cos(9 * PI / 8), 0, -sin(9 * PI / 8),  0.0f,  0.0f, 1.0f,  0.0f, 0.0f, // Coordinate 8
-  cos(7 * PI / 8), 0, -sin(7 * PI / 8),  0.0f,  0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 7
-  //Triangle 9
-  -1.0f, 3.0f, 0.0f,                     0.0f,  0.0f, 1.0f,  0.5f, 1.0f, // Coordinate 0
-  cos(7 * PI / 8), 0, -sin(7 * PI / 8),  0.0f,  0.0f, 1.0f,  0.0f, 0.0f, // Coordinate 7
-  cos(5 * PI / 8), 0, -sin(5 * PI / 8),  0.0f,  0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 6
-
-  // Cap of the tube
-  //Triangle 0
-  cos(13 * PI / 8), 0, -sin(13 * PI / 8),   0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 0
-  cos(15 * PI / 8), 0, -sin(15 * PI / 8),   0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 1
-  cos(13 * PI / 8), -1, -sin(13 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 1.0f, // Coordinate 8
-  // Triangle 1
-  cos(15 * PI / 8), 0, -sin(15 * PI / 8),   0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 1
-  cos(13 * PI / 8), -1, -sin(13 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 1.0f, // Coordinate 8
-  cos(15 * PI / 8), -1, -sin(15 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 1.0f, // Coordinate 9
-  //Triangle 2
-  cos(15 * PI / 8), 0, -sin(15 * PI / 8),   0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 1
-  cos(15 * PI / 8), -1, -sin(15 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 1.0f, // Coordinate 9
-  cos(1 * PI / 8), 0, -sin(1 * PI / 8),     0.0f, 0.0f, 1.0f,  1.0f, 1.0f, // Coordinate 2
-  //Triangle 3
-  cos(15 * PI / 8), -1, -sin(15 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 9
-  cos(1 * PI / 8), 0, -sin(1 * PI / 8),     0.0f, 0.0f, 1.0f,  1.0f, 1.0f, // Coordinate 2
-  cos(1 * PI / 8), -1, -sin(1 * PI / 8),    0.0f, 0.0f, 1.0f,  1.0f, 1.0f, // Coordinate 10
-  //Triangle 4
-  cos(1 * PI / 8), 0, -sin(1 * PI / 8),   0.0f, 0.0f, 1.0f,  1.0f, 1.0f, // Coordinate 2
-  cos(1 * PI / 8), -1, -sin(1 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 1.0f, // Coordinate 10
-  cos(3 * PI / 8), 0, -sin(3 * PI / 8),   0.0f, 0.0f, 1.0f,  1.0f, 1.0f, // Coordinate 3
-  //Triangle 5
-  cos(1 * PI / 8), -1, -sin(1 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 10
-  cos(3 * PI / 8), 0, -sin(3 * PI / 8),   0.0f, 0.0f, 1.0f,  1.0f, 1.0f, // Coordinate 3
-  cos(3 * PI / 8), -1, -sin(3 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f,// Coordinate 11
-  //Triangle 6
-  cos(3 * PI / 8), 0, -sin(3 * PI / 8),   0.0f, 0.0f, 1.0f,  1.0f, 1.0f, // Coordinate 3
-  cos(3 * PI / 8), -1, -sin(3 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 11
-  cos(5 * PI / 8), 0, -sin(5 * PI / 8),   0.0f, 0.0f, 1.0f,  1.0f, 1.0f, // Coordinate 4
-  //Triangle 7
-  cos(3 * PI / 8), -1, -sin(3 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 11
-  cos(5 * PI / 8), 0, -sin(5 * PI / 8),   0.0f, 0.0f, 1.0f,  1.0f, 1.0f, // Coordinate 4
-  cos(5 * PI / 8), -1, -sin(5 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 12
-  //Triangle 8 
-  cos(5 * PI / 8), 0, -sin(5 * PI / 8),   0.0f, 0.0f, 1.0f,  1.0f, 1.0f, // Coordinate 4
-  cos(5 * PI / 8), -1, -sin(5 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 12
-  cos(7 * PI / 8), 0, -sin(7 * PI / 8),   0.0f, 0.0f, 1.0f,  1.0f, 1.0f, // Coordinate 5
-  //Triangle 9
-  cos(5 * PI / 8), -1, -sin(5 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 12
-  cos(7 * PI / 8), 0, -sin(7 * PI / 8),   0.0f, 0.0f, 1.0f,  1.0f, 1.0f, // Coordinate 5
-  cos(7 * PI / 8), -1, -sin(7 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 13
-  //Triangle 10
-  cos(7 * PI / 8), 0, -sin(7 * PI / 8),   0.0f, 0.0f, 1.0f,  1.0f, 1.0f, // Coordinate 5
-  cos(7 * PI / 8), -1, -sin(7 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 13
-  cos(9 * PI / 8), 0, -sin(9 * PI / 8),   0.0f, 0.0f, 1.0f,  1.0f, 1.0f, // Coordinate 6
-  //Triangle 11
-  cos(7 * PI / 8), -1, -sin(7 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 13
-  cos(9 * PI / 8), 0, -sin(9 * PI / 8),   0.0f, 0.0f, 1.0f,  1.0f, 1.0f, // Coordinate 6
-  cos(9 * PI / 8), -1, -sin(9 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 14
-  //Triangle 12
-  cos(9 * PI / 8), 0, -sin(9 * PI / 8),    0.0f, 0.0f, 1.0f,  1.0f, 1.0f, // Coordinate 6
-  cos(9 * PI / 8), -1, -sin(9 * PI / 8),   0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 14
-  cos(11 * PI / 8), 0, -sin(11 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 1.0f, // Coordinate 7
-  //Triangle 13
-  cos(9 * PI / 8), -1, -sin(9 * PI / 8),    0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 14
-  cos(11 * PI / 8), 0, -sin(11 * PI / 8),   0.0f, 0.0f, 1.0f,  1.0f, 1.0f, // Coordinate 7
-  cos(11 * PI / 8), -1, -sin(11 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 15
-  //Triangle 14
-  cos(11 * PI / 8), 0, -sin(11 * PI / 8),   0.0f, 0.0f, 1.0f,  1.0f, 1.0f, // Coordinate 7
-  cos(11 * PI / 8), -1, -sin(11 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 15
-  cos(13 * PI / 8), 0, -sin(13 * PI / 8),   0.0f, 0.0f, 1.0f,  1.0f, 1.0f, // Coordinate 0
-  //Triangle 15
-  cos(11 * PI / 8), -1, -sin(11 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 15
-  cos(13 * PI / 8), 0, -sin(13 * PI / 8),   0.0f, 0.0f, 1.0f,  1.0f, 1.0f, // Coordinate 0
-  cos(13 * PI / 8), -1, -sin(13 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 8
-  //Triangle 16
-  cos(5 * PI / 8), -1, -sin(5 * PI / 8),  0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // Coordinate 12
-  cos(7 * PI / 8), -1, -sin(7 * PI / 8),  0.0f, 0.0f, 1.0f,  0.0f, 0.0f, // Coordinate 13
-  cos(9 * PI / 8), -1, -sin(9 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 14
-  //Triangle 17
-  cos(9 * PI / 8), -1, -sin(9 * PI / 8),    0.0f, 0.0f, 1.0f,  0.0f, 0.0f, // Coordinate 14
-  cos(5 * PI / 8), -1, -sin(5 * PI / 8),    0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // Coordinate 12
-  cos(11 * PI / 8), -1, -sin(11 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 15
-  //Triangle 18
-  cos(5 * PI / 8), -1, -sin(5 * PI / 8),    0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // Coordinate 12
-  cos(11 * PI / 8), -1, -sin(11 * PI / 8),  0.0f, 0.0f, 1.0f,  0.0f, 0.0f, // Coordinate 15
-  cos(13 * PI / 8), -1, -sin(13 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 8
-  //Triangle 19
-  cos(13 * PI / 8), -1, -sin(13 * PI / 8),  0.0f, 0.0f, 1.0f,  0.0f, 0.0f, // Coordinate 8
-  cos(5 * PI / 8), -1, -sin(5 * PI / 8),    0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // Coordinate 12
-  cos(15 * PI / 8), -1, -sin(15 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 9
-  //Triangle 20
-  cos(5 * PI / 8), -1, -sin(5 * PI / 8),    0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // Coordinate 12
-  cos(15 * PI / 8), -1, -sin(15 * PI / 8),  0.0f, 0.0f, 1.0f,  0.0f, 0.0f, // Coordinate 9
-  cos(1 * PI / 8), -1, -sin(1 * PI / 8),    0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 10
-  //Triangle 21
-  cos(1 * PI / 8), -1, -sin(1 * PI / 8),  0.0f, 0.0f, 1.0f,  0.0f, 0.0f, // Coordinate 10
-  cos(5 * PI / 8), -1, -sin(5 * PI / 8),  0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // Coordinate 12
-  cos(3 * PI / 8), -1, -sin(3 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 11
-
-  // Octagon
-  //Triangle 0
-  2*cos(13 * PI / 8), 0, -2*sin(13 * PI / 8),   0.0f, 0.0f, 1.0f,   1.0f, 0.0f, // Coordinate 0
-  2*cos(15 * PI / 8), 0, -2*sin(15 * PI / 8),   0.0f, 0.0f, 1.0f,   1.0f, 0.0f, // Coordinate 1
-  2*cos(13 * PI / 8), -1, -2*sin(13 * PI / 8),  0.0f, 0.0f, 1.0f,   1.0f, 1.0f, // Coordinate 8
-  // Triangle 1
-  2*cos(15 * PI / 8), 0, -2*sin(15 * PI / 8),    0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 1
-  2*cos(13 * PI / 8), -1, -2*sin(13 * PI / 8),   0.0f, 0.0f, 1.0f,  1.0f, 1.0f, // Coordinate 8
-  2*cos(15 * PI / 8), -1, -2*sin(15 * PI / 8),   0.0f, 0.0f, 1.0f,  1.0f, 1.0f, // Coordinate 9
-  //Triangle 2
-  2*cos(15 * PI / 8), 0, -2*sin(15 * PI / 8),   0.0f, 0.0f, 1.0f,   1.0f, 1.0f, // Coordinate 1
-  2*cos(15 * PI / 8), -1, -2*sin(15 * PI / 8),  0.0f, 0.0f, 1.0f,   1.0f, 0.0f, // Coordinate 9
-  2*cos(1 * PI / 8), 0, -2*sin(1 * PI / 8),     0.0f, 0.0f, 1.0f,   1.0f, 1.0f, // Coordinate 2
-  //Triangle 3
-  2*cos(15 * PI / 8), -1, -2*sin(15 * PI / 8),  0.0f, 0.0f, 1.0f,   1.0f, 0.0f, // Coordinate 9
-  2*cos(1 * PI / 8), 0, -2*sin(1 * PI / 8),     0.0f, 0.0f, 1.0f,   1.0f, 1.0f, // Coordinate 2
-  2*cos(1 * PI / 8), -1, -2*sin(1 * PI / 8),    0.0f, 0.0f, 1.0f,   1.0f, 0.0f, // Coordinate 10
-  //Triangle 4
-  2*cos(1 * PI / 8), 0, -2*sin(1 * PI / 8),   0.0f, 0.0f, 1.0f,  1.0f, 1.0f, // Coordinate 2
-  2*cos(1 * PI / 8), -1, -2*sin(1 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 10
-  2*cos(3 * PI / 8), 0, -2*sin(3 * PI / 8),   0.0f, 0.0f, 1.0f,  1.0f, 1.0f, // Coordinate 3
-  //Triangle 5
-  2*cos(1 * PI / 8), -1, -2*sin(1 * PI / 8),  0.0f, 0.0f, 1.0f,   1.0f, 0.0f, // Coordinate 10
-  2*cos(3 * PI / 8), 0, -2*sin(3 * PI / 8),   0.0f, 0.0f, 1.0f,   1.0f, 1.0f, // Coordinate 3
-  2*cos(3 * PI / 8), -1, -2*sin(3 * PI / 8),  0.0f, 0.0f, 1.0f,   1.0f, 0.0f,// Coordinate 11
-  //Triangle 6
-  2*cos(3 * PI / 8), 0, -2*sin(3 * PI / 8),   0.0f, 0.0f, 1.0f,   1.0f, 1.0f, // Coordinate 3
-  2*cos(3 * PI / 8), -1, -2*sin(3 * PI / 8),  0.0f, 0.0f, 1.0f,   1.0f, 0.0f, // Coordinate 11
-  2*cos(5 * PI / 8), 0, -2*sin(5 * PI / 8),   0.0f, 0.0f, 1.0f,   1.0f, 1.0f, // Coordinate 4
-  //Triangle 7
-  2*cos(3 * PI / 8), -1, -2*sin(3 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 11
-  2*cos(5 * PI / 8), 0, -2*sin(5 * PI / 8),   0.0f, 0.0f, 1.0f,  1.0f, 1.0f, // Coordinate 4
-  2*cos(5 * PI / 8), -1, -2*sin(5 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 12
-  //Triangle 8 
-  2*cos(5 * PI / 8), 0, -2*sin(5 * PI / 8),   0.0f, 0.0f, 1.0f,   1.0f, 1.0f, // Coordinate 4
-  2*cos(5 * PI / 8), -1, -2*sin(5 * PI / 8),  0.0f, 0.0f, 1.0f,   1.0f, 0.0f, // Coordinate 12
-  2*cos(7 * PI / 8), 0, -2*sin(7 * PI / 8),   0.0f, 0.0f, 1.0f,   1.0f, 1.0f, // Coordinate 5
-  //Triangle 9
-  2*cos(5 * PI / 8), -1, -2*sin(5 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 12
-  2*cos(7 * PI / 8), 0, -2*sin(7 * PI / 8),   0.0f, 0.0f, 1.0f,  1.0f, 1.0f, // Coordinate 5
-  2*cos(7 * PI / 8), -1, -2*sin(7 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 13
-  //Triangle 10
-  2*cos(7 * PI / 8), 0, -2*sin(7 * PI / 8),   0.0f, 0.0f, 1.0f,  1.0f, 1.0f, // Coordinate 5
-  2*cos(7 * PI / 8), -1, -2*sin(7 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 13
-  2*cos(9 * PI / 8), 0, -2*sin(9 * PI / 8),   0.0f, 0.0f, 1.0f,  1.0f, 1.0f, // Coordinate 6
-  //Triangle 11
-  2*cos(7 * PI / 8), -1, -2*sin(7 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 13
-  2*cos(9 * PI / 8), 0, -2*sin(9 * PI / 8),   0.0f, 0.0f, 1.0f,  1.0f, 1.0f, // Coordinate 6
-  2*cos(9 * PI / 8), -1, -2*sin(9 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 14
-  //Triangle 12
-  2*cos(9 * PI / 8), 0, -2*sin(9 * PI / 8),    0.0f, 0.0f, 1.0f,  1.0f, 1.0f, // Coordinate 6
-  2*cos(9 * PI / 8), -1, -2*sin(9 * PI / 8),   0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 14
-  2*cos(11 * PI / 8), 0, -2*sin(11 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 1.0f, // Coordinate 7
-  //Triangle 13
-  2*cos(9 * PI / 8), -1, -2*sin(9 * PI / 8),    0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 14
-  2*cos(11 * PI / 8), 0, -2*sin(11 * PI / 8),   0.0f, 0.0f, 1.0f,  1.0f, 1.0f, // Coordinate 7
-  2*cos(11 * PI / 8), -1, -2*sin(11 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 15
-  //Triangle 14
-  2*cos(11 * PI / 8), 0, -2*sin(11 * PI / 8),   0.0f, 0.0f, 1.0f,  1.0f, 1.0f, // Coordinate 7
-  2*cos(11 * PI / 8), -1, -2*sin(11 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 15
-  2*cos(13 * PI / 8), 0, -2*sin(13 * PI / 8),   0.0f, 0.0f, 1.0f,  1.0f, 1.0f, // Coordinate 0
-  //Triangle 15
-  2*cos(11 * PI / 8), -1, -2*sin(11 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 15
-  2*cos(13 * PI / 8), 0, -2*sin(13 * PI / 8),   0.0f, 0.0f, 1.0f,  1.0f, 1.0f, // Coordinate 0
-  2*cos(13 * PI / 8), -1, -2*sin(13 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 8
-  // Triangle 16
-  2*cos(5 * PI / 8), 0, -2*sin(5 * PI / 8),  0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // Coordinate 4
-  2*cos(7 * PI / 8), 0, -2*sin(7 * PI / 8),  0.0f, 0.0f, 1.0f,  0.0f, 0.0f, // Coordinate 5
-  2*cos(9 * PI / 8), 0, -2*sin(9 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 6
-  // Triangle 17
-  2*cos(5 * PI / 8), 0, -2*sin(5 * PI / 8),   0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // Coordinate 4
-  2*cos(9 * PI / 8), 0, -2*sin(9 * PI / 8),   0.0f, 0.0f, 1.0f,  0.0f, 0.0f, // Coordinate 6
-  2*cos(11 * PI / 8), 0, -2*sin(11 * PI / 8), 0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 7
-  // Triangle 18
-  2*cos(5 * PI / 8), 0, -2*sin(5 * PI / 8),    0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // Coordinate 4
-  2*cos(11 * PI / 8), 0, -2*sin(11 * PI / 8),  0.0f, 0.0f, 1.0f,  0.0f, 0.0f, // Coordinate 7
-  2*cos(13 * PI / 8), 0, -2*sin(13 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 0
-  // Triangle 19
-  2*cos(5 * PI / 8), 0, -2*sin(5 * PI / 8),    0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // Coordinate 4
-  2*cos(13 * PI / 8), 0, -2*sin(13 * PI / 8),  0.0f, 0.0f, 1.0f,  0.0f, 0.0f, // Coordinate 0
-  2*cos(15 * PI / 8), 0, -2*sin(15 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 1
-  // Triangle 20
-  2*cos(5 * PI / 8), 0, -2*sin(5 * PI / 8),    0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // Coordinate 4
-  2*cos(15 * PI / 8), 0, -2*sin(15 * PI / 8),  0.0f, 0.0f, 1.0f,  0.0f, 0.0f, // Coordinate 1
-  2*cos(1 * PI / 8), 0, -2*sin(1 * PI / 8),    0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 2
-  // Triangle 21
-  2*cos(5 * PI / 8), 0, -2*sin(5 * PI / 8),  0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // Coordinate 4
-  2*cos(1 * PI / 8), 0, -2*sin(1 * PI / 8),  0.0f, 0.0f, 1.0f,  0.0f, 0.0f, // Coordinate 2
-  2*cos(3 * PI / 8), 0, -2*sin(3 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 3
-  //Triangle 22
-  2*cos(5 * PI / 8), -1, -2*sin(5 * PI / 8),  0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // Coordinate 12
-  2*cos(7 * PI / 8), -1, -2*sin(7 * PI / 8),  0.0f, 0.0f, 1.0f,  0.0f, 0.0f, // Coordinate 13
-  2*cos(9 * PI / 8), -1, -2*sin(9 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 14
-  //Triangle 23
-  2*cos(9 * PI / 8), -1, -2*sin(9 * PI / 8),    0.0f, 0.0f, 1.0f,  0.0f, 0.0f, // Coordinate 14
-  2*cos(5 * PI / 8), -1, -2*sin(5 * PI / 8),    0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // Coordinate 12
-  2*cos(11 * PI / 8), -1, -2*sin(11 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 15
-  //Triangle 24
-  2*cos(5 * PI / 8), -1, -2*sin(5 * PI / 8),    0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // Coordinate 12
-  2*cos(11 * PI / 8), -1, -2*sin(11 * PI / 8),  0.0f, 0.0f, 1.0f,  0.0f, 0.0f, // Coordinate 15
-  2*cos(13 * PI / 8), -1, -2*sin(13 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 8
-  //Triangle 25
-  2*cos(13 * PI / 8), -1, -2*sin(13 * PI / 8),  0.0f, 0.0f, 1.0f,  0.0f, 0.0f, // Coordinate 8
-  2*cos(5 * PI / 8), -1, -2*sin(5 * PI / 8),    0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // Coordinate 12
-  2*cos(15 * PI / 8), -1, -2*sin(15 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 9
-  //Triangle 26
-  2*cos(5 * PI / 8), -1, -2*sin(5 * PI / 8),    0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // Coordinate 12
-  2*cos(15 * PI / 8), -1, -2*sin(15 * PI / 8),  0.0f, 0.0f, 1.0f,  0.0f, 0.0f, // Coordinate 9
-  2*cos(1 * PI / 8), -1, -2*sin(1 * PI / 8),    0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 10
-  //Triangle 27
-  2*cos(1 * PI / 8), -1, -2*sin(1 * PI / 8),  0.0f, 0.0f, 1.0f,  0.0f, 0.0f, // Coordinate 10
-  2*cos(5 * PI / 8), -1, -2*sin(5 * PI / 8),  0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // Coordinate 12
-  2*cos(3 * PI / 8), -1, -2*sin(3 * PI / 8),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Coordinate 11
-
-  // Top Blue Cube
-  //Back Face          //Negative Z Normal  Texture Coords.
- -0.6f, -0.1f, -0.6f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,
-  0.6f, -0.1f, -0.6f,  0.0f,  0.0f, -1.0f,  1.0f, 0.0f,
-  0.6f,  0.1f, -0.6f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,
-  0.6f,  0.1f, -0.6f,  0.0f,  0.0f, -1.0f,  1.0f, 1.0f,
- -0.6f,  0.1f, -0.6f,  0.0f,  0.0f, -1.0f,  0.0f, 1.0f,
- -0.6f, -0.1f, -0.6f,  0.0f,  0.0f, -1.0f,  0.0f, 0.0f,
-
-  //Front Face         //Positive Z Normal
- -0.6f, -0.1f,  0.6f,  0.0f,  0.0f,  1.0f,  0.0f, 0.0f,
-  0.6f, -0.1f,  0.6f,  0.0f,  0.0f,  1.0f,  1.0f, 0.0f,
-  0.6f,  0.1f,  0.6f,  0.0f,  0.0f,  1.0f,  1.0f, 1.0f,
-  0.6f,  0.1f,  0.6f,  0.0f,  0.0f,  1.0f,  1.0f, 1.0f,
- -0.6f,  0.1f,  0.6f,  0.0f,  0.0f,  1.0f,  0.0f, 1.0f,
- -0.6f, -0.1f,  0.6f,  0.0f,  0.0f,  1.0f,  0.0f, 0.0f,
-
- //Left Face          //Negative X Normal
- -0.6f,  0.1f,  0.6f, -1.0f,  0.0f,  0.0f,  1.0f, 0.0f,
- -0.6f,  0.1f, -0.6f, -1.0f,  0.0f,  0.0f,  1.0f, 1.0f,
- -0.6f, -0.1f, -0.6f, -1.0f,  0.0f,  0.0f,  0.0f, 1.0f,
- -0.6f, -0.1f, -0.6f, -1.0f,  0.0f,  0.0f,  0.0f, 1.0f,
- -0.6f, -0.1f,  0.6f, -1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
- -0.6f,  0.1f,  0.6f, -1.0f,  0.0f,  0.0f,  1.0f, 0.0f,
-
- //Right Face         //Positive X Normal
-  0.6f,  0.1f,  0.6f,  1.0f,  0.0f,  0.0f,  1.0f, 0.0f,
-  0.6f,  0.1f, -0.6f,  1.0f,  0.0f,  0.0f,  1.0f, 1.0f,
-  0.6f, -0.1f, -0.6f,  1.0f,  0.0f,  0.0f,  0.0f, 1.0f,
-  0.6f, -0.1f, -0.6f,  1.0f,  0.0f,  0.0f,  0.0f, 1.0f,
-  0.6f, -0.1f,  0.6f,  1.0f,  0.0f,  0.0f,  0.0f, 0.0f,
-  0.6f,  0.1f,  0.6f,  1.0f,  0.0f,  0.0f,  1.0f, 0.0f,
-
-  //Bottom Face        //Negative Y Normal
- -0.6f, -0.1f, -0.6f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,
-  0.6f, -0.1f, -0.6f,  0.0f, -1.0f,  0.0f,  1.0f, 1.0f,
-  0.6f, -0.1f,  0.6f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,
-  0.6f, -0.1f,  0.6f,  0.0f, -1.0f,  0.0f,  1.0f, 0.0f,
- -0.6f, -0.1f,  0.6f,  0.0f, -1.0f,  0.0f,  0.0f, 0.0f,
- -0.6f, -0.1f, -0.6f,  0.0f, -1.0f,  0.0f,  0.0f, 1.0f,
-
-  //Top Face           //Positive Y Normal
- -0.6f,  0.1f, -0.6f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f,
-  0.6f,  0.1f, -0.6f,  0.0f,  1.0f,  0.0f,  1.0f, 1.0f,
-  0.6f,  0.1f,  0.6f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,
-  0.6f,  0.1f,  0.6f,  0.0f,  1.0f,  0.0f,  1.0f, 0.0f,
- -0.6f,  0.1f,  0.6f,  0.0f,  1.0f,  0.0f,  0.0f, 0.0f,
- -0.6f,  0.1f, -0.6f,  0.0f,  1.0f,  0.0f,  0.0f, 1.0f,
-
-  // Pink Sphere
-  // Sphere Top
-  // 1
-  1 * cos(0.5 * (PI / 4)), 0, 1 * sin(0.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // C
-  0, 0, 0,                                              0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // A
-  1 * cos(1 * (PI / 4)), 0, 1 * sin(1 * (PI / 4)),      0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // D
-  // 2
-  1 * cos(1 * (PI / 4)), 0, 1 * sin(1 * (PI / 4)),      0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // D
-  0, 0, 0,                                              0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // A
-  1 * cos(1.5 * (PI / 4)), 0, 1 * sin(1.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // E
-  // 3
-  1 * cos(1.5 * (PI / 4)), 0, 1 * sin(1.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // E
-  0, 0, 0,                                              0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // A
-  1 * cos(2 * (PI / 4)), 0, 1 * sin(2 * (PI / 4)),      0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // F
-  // 4
-  1 * cos(2 * (PI / 4)), 0, 1 * sin(2 * (PI / 4)),      0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // F
-  0, 0, 0,                                              0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // A
-  1 * cos(2.5 * (PI / 4)), 0, 1 * sin(2.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // G
-  // 5
-  1 * cos(2.5 * (PI / 4)), 0, 1 * sin(2.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // G
-  0, 0, 0,                                              0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // A
-  1 * cos(3 * (PI / 4)), 0, 1 * sin(3 * (PI / 4)),      0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // H
-  // 6
-  1 * cos(3 * (PI / 4)), 0, 1 * sin(3 * (PI / 4)),      0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // H
-  0, 0, 0,                                              0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // A
-  1 * cos(3.5 * (PI / 4)), 0, 1 * sin(3.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // I
-  // 7
-  1 * cos(3.5 * (PI / 4)), 0, 1 * sin(3.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // I
-  0, 0, 0,                                              0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // A
-  1 * cos(4 * (PI / 4)), 0, 1 * sin(4 * (PI / 4)),      0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // J
-  // 8
-  1 * cos(4 * (PI / 4)), 0, 1 * sin(4 * (PI / 4)),      0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // J
-  0, 0, 0,                                              0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // A
-  1 * cos(4.5 * (PI / 4)), 0, 1 * sin(4.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // K
-  // 9
-  1 * cos(4.5 * (PI / 4)), 0, 1 * sin(4.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // K
-  0, 0, 0,                                              0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // A
-  1 * cos(5 * (PI / 4)), 0, 1 * sin(5 * (PI / 4)),      0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // L
-  // 10
-  1 * cos(5 * (PI / 4)), 0, 1 * sin(5 * (PI / 4)),      0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // L
-  0, 0, 0,                                              0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // A
-  1 * cos(5.5 * (PI / 4)), 0, 1 * sin(5.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // M
-  // 11
-  1 * cos(5.5 * (PI / 4)), 0, 1 * sin(5.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // M
-  0, 0, 0,                                              0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // A
-  1 * cos(6 * (PI / 4)), 0, 1 * sin(6 * (PI / 4)),      0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // N
-  // 12
-  1 * cos(6 * (PI / 4)), 0, 1 * sin(6 * (PI / 4)),      0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // N
-  0, 0, 0,                                              0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // A
-  1 * cos(6.5 * (PI / 4)), 0, 1 * sin(6.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // O
-  // 13
-  1 * cos(6.5 * (PI / 4)), 0, 1 * sin(6.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // O
-  0, 0, 0,                                              0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // A
-  1 * cos(7 * (PI / 4)), 0, 1 * sin(7 * (PI / 4)),      0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // P
-  // 14
-  1 * cos(7 * (PI / 4)), 0, 1 * sin(7 * (PI / 4)),      0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // P
-  0, 0, 0,                                              0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // A
-  1 * cos(7.5 * (PI / 4)), 0, 1 * sin(7.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Q
-  // 15
-  1 * cos(7.5 * (PI / 4)), 0, 1 * sin(7.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Q
-  0, 0, 0,                                              0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // A
-  1, 0, 0,                                              0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // B
-  // 16
-  1, 0, 0,                                              0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // B
-  0, 0, 0,                                              0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // A
-  1 * cos(0.5 * (PI / 4)), 0, 1 * sin(0.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // C
-  // Sphere Bottom
-  // 1
-  1 * cos(0.5 * (PI / 4)), 0.5, 1 * sin(0.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // C1
-  0, 0.5, 0,                                              0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // A1
-  1 * cos(1 * (PI / 4)), 0.5, 1 * sin(1 * (PI / 4)),      0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // D1
-  // 2
-  1 * cos(1 * (PI / 4)), 0.5, 1 * sin(1 * (PI / 4)),      0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // D1
-  0, 0.5, 0,                                              0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // A1
-  1 * cos(1.5 * (PI / 4)), 0.5, 1 * sin(1.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // E1
-  // 3
-  1 * cos(1.5 * (PI / 4)), 0.5, 1 * sin(1.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // E1
-  0, 0.5, 0,                                              0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // A1
-  1 * cos(2 * (PI / 4)), 0.5, 1 * sin(2 * (PI / 4)),      0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // F1
-  // 4
-  1 * cos(2 * (PI / 4)), 0.5, 1 * sin(2 * (PI / 4)),      0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // F1
-  0, 0.5, 0,                                              0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // A1
-  1 * cos(2.5 * (PI / 4)), 0.5, 1 * sin(2.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // G1
-  // 5
-  1 * cos(2.5 * (PI / 4)), 0.5, 1 * sin(2.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // G1
-  0, 0.5, 0,                                              0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // A1
-  1 * cos(3 * (PI / 4)), 0.5, 1 * sin(3 * (PI / 4)),      0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // H1
-  // 6
-  1 * cos(3 * (PI / 4)), 0.5, 1 * sin(3 * (PI / 4)),      0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // H1
-  0, 0.5, 0,                                              0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // A1
-  1 * cos(3.5 * (PI / 4)), 0.5, 1 * sin(3.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // I1
-  // 7
-  1 * cos(3.5 * (PI / 4)), 0.5, 1 * sin(3.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // I1
-  0, 0.5, 0,                                              0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // A1
-  1 * cos(4 * (PI / 4)), 0.5, 1 * sin(4 * (PI / 4)),      0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // J1
-  // 8
-  1 * cos(4 * (PI / 4)), 0.5, 1 * sin(4 * (PI / 4)),      0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // J1
-  0, 0.5, 0,                                              0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // A1
-  1 * cos(4.5 * (PI / 4)), 0.5, 1 * sin(4.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // K1
-  // 9
-  1 * cos(4.5 * (PI / 4)), 0.5, 1 * sin(4.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // K1
-  0, 0.5, 0,                                              0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // A1
-  1 * cos(5 * (PI / 4)), 0.5, 1 * sin(5 * (PI / 4)),      0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // L1
-  // 10
-  1 * cos(5 * (PI / 4)), 0.5, 1 * sin(5 * (PI / 4)),      0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // L1
-  0, 0.5, 0,                                              0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // A1
-  1 * cos(5.5 * (PI / 4)), 0.5, 1 * sin(5.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // M1
-  // 11
-  1 * cos(5.5 * (PI / 4)), 0.5, 1 * sin(5.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // M1
-  0, 0.5, 0,                                              0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // A1
-  1 * cos(6 * (PI / 4)), 0.5, 1 * sin(6 * (PI / 4)),      0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // N1
-  // 12
-  1 * cos(6 * (PI / 4)), 0.5, 1 * sin(6 * (PI / 4)),      0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // N1
-  0, 0.5, 0,                                              0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // A1
-  1 * cos(6.5 * (PI / 4)), 0.5, 1 * sin(6.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // O1
-  // 13
-  1 * cos(6.5 * (PI / 4)), 0.5, 1 * sin(6.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // O1
-  0, 0.5, 0,                                              0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // A1
-  1 * cos(7 * (PI / 4)), 0.5, 1 * sin(7 * (PI / 4)),      0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // P1
-  // 14
-  1 * cos(7 * (PI / 4)), 0.5, 1 * sin(7 * (PI / 4)),      0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // P1
-  0, 0.5, 0,                                              0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // A1
-  1 * cos(7.5 * (PI / 4)), 0.5, 1 * sin(7.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Q1
-  // 15
-  1 * cos(7.5 * (PI / 4)), 0.5, 1 * sin(7.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Q1
-  0, 0.5, 0,                                              0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // A1
-  1, 0.5, 0,                                              0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // B1
-  // 16
-  1, 0.5, 0,                                              0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // B1
-  0, 0.5, 0,                                              0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // A1
-  1 * cos(0.5 * (PI / 4)), 0.5, 1 * sin(0.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // C1
-  // Sphere side 1
-  // 1
-  1, 0, 0,                                              0.0f, 0.0f, 1.0f,  1.0f, 0.0f,// B
-  1, 0.5, 0,                                            0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // B1
-  1 * cos(0.5 * (PI / 4)), 0, 1 * sin(0.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  0.5f, 1.0f,  // C
-  // 2 
-  1 * cos(0.5 * (PI / 4)), 0, 1 * sin(0.5 * (PI / 4)),    0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // C
-  1 * cos(0.5 * (PI / 4)), 0.5, 1 * sin(0.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // C1
-  1 * cos(1 * (PI / 4)), 0, 1 * sin(1 * (PI / 4)),        0.0f, 0.0f, 1.0f,  0.5f, 1.0f,  // D
-  // 3
-  1 * cos(1 * (PI / 4)), 0, 1 * sin(1 * (PI / 4)),      0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // D
-  1 * cos(1 * (PI / 4)), 0.5, 1 * sin(1 * (PI / 4)),    0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // D1
-  1 * cos(1.5 * (PI / 4)), 0, 1 * sin(1.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  0.5f, 1.0f,  // E
-  // 4
-  1 * cos(1.5 * (PI / 4)), 0, 1 * sin(1.5 * (PI / 4)),    0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // E
-  1 * cos(1.5 * (PI / 4)), 0.5, 1 * sin(1.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // E1
-  1 * cos(2 * (PI / 4)), 0, 1 * sin(2 * (PI / 4)),        0.0f, 0.0f, 1.0f,  0.5f, 1.0f,  // F
-  // 5
-  1 * cos(2 * (PI / 4)), 0, 1 * sin(2 * (PI / 4)),      0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // F
-  1 * cos(2 * (PI / 4)), 0.5, 1 * sin(2 * (PI / 4)),    0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // F1
-  1 * cos(2.5 * (PI / 4)), 0, 1 * sin(2.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  0.5f, 1.0f,  // G
-  // 6
-  1 * cos(2.5 * (PI / 4)), 0, 1 * sin(2.5 * (PI / 4)),    0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // G
-  1 * cos(2.5 * (PI / 4)), 0.5, 1 * sin(2.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // G1
-  1 * cos(3 * (PI / 4)), 0, 1 * sin(3 * (PI / 4)),        0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // H
-  // 7
-  1 * cos(3 * (PI / 4)), 0, 1 * sin(3 * (PI / 4)),      0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // H
-  1 * cos(3 * (PI / 4)), 0.5, 1 * sin(3 * (PI / 4)),    0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // H1
-  1 * cos(3.5 * (PI / 4)), 0, 1 * sin(3.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  0.5f, 1.0f,  // I
-  // 8
-  1 * cos(3.5 * (PI / 4)), 0, 1 * sin(3.5 * (PI / 4)),    0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // I
-  1 * cos(3.5 * (PI / 4)), 0.5, 1 * sin(3.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // I1
-  1 * cos(4 * (PI / 4)), 0, 1 * sin(4 * (PI / 4)),        0.0f, 0.0f, 1.0f,  0.5f, 1.0f,  // J
-  // 9
-  1 * cos(4 * (PI / 4)), 0, 1 * sin(4 * (PI / 4)),      0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // J
-  1 * cos(4 * (PI / 4)), 0.5, 1 * sin(4 * (PI / 4)),    0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // J1
-  1 * cos(4.5 * (PI / 4)), 0, 1 * sin(4.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  0.5f, 1.0f,  // K
-  // 10
-  1 * cos(4.5 * (PI / 4)), 0, 1 * sin(4.5 * (PI / 4)),    0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // K
-  1 * cos(4.5 * (PI / 4)), 0.5, 1 * sin(4.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // K1
-  1 * cos(5 * (PI / 4)), 0, 1 * sin(5 * (PI / 4)),        0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // L
-  // 11
-  1 * cos(5 * (PI / 4)), 0, 1 * sin(5 * (PI / 4)),      0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // L
-  1 * cos(5 * (PI / 4)), 0.5, 1 * sin(5 * (PI / 4)),    0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // L1 
-  1 * cos(5.5 * (PI / 4)), 0, 1 * sin(5.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // M
-  // 12
-  1 * cos(5.5 * (PI / 4)), 0, 1 * sin(5.5 * (PI / 4)),    0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // M
-  1 * cos(5.5 * (PI / 4)), 0.5, 1 * sin(5.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // M1
-  1 * cos(6 * (PI / 4)), 0, 1 * sin(6 * (PI / 4)),        0.0f, 0.0f, 1.0f,  0.5f, 1.0f,  // N
-  // 13
-  1 * cos(6 * (PI / 4)), 0, 1 * sin(6 * (PI / 4)),      0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // N
-  1 * cos(6 * (PI / 4)), 0.5, 1 * sin(6 * (PI / 4)),    0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // N1
-  1 * cos(6.5 * (PI / 4)), 0, 1 * sin(6.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // O
-  // 14
-  1 * cos(6.5 * (PI / 4)), 0, 1 * sin(6.5 * (PI / 4)),    0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // O
-  1 * cos(6.5 * (PI / 4)), 0.5, 1 * sin(6.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // O1
-  1 * cos(6.5 * (PI / 4)), 0, 1 * sin(6.5 * (PI / 4)),    0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // P
-  // 15
-  1 * cos(6.5 * (PI / 4)), 0, 1 * sin(6.5 * (PI / 4)),    0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // P
-  1 * cos(6.5 * (PI / 4)), 0.5, 1 * sin(6.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // P1
-  1 * cos(7.5 * (PI / 4)), 0, 1 * sin(7.5 * (PI / 4)),    0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // Q
-  // 16
-  1 * cos(7.5 * (PI / 4)), 0, 1 * sin(7.5 * (PI / 4)),    0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Q
-  1 * cos(7.5 * (PI / 4)), 0.5, 1 * sin(7.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // Q1
-  1, 0, 0,                                                0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // B
-  // Sphere Side 2
-  // 1
-  1, 0.5, 0,                                              0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // B1
-  1 * cos(0.5 * (PI / 4)), 0, 1 * sin(0.5 * (PI / 4)),    0.0f, 0.0f, 1.0f,  0.0f, 1.0f,  // C
-  1 * cos(0.5 * (PI / 4)), 0.5, 1 * sin(0.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // C1
-  // 2
-  1 * cos(0.5 * (PI / 4)), 0.5, 1 * sin(0.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // C1
-  1 * cos(1 * (PI / 4)), 0, 1 * sin(1 * (PI / 4)),        0.0f, 0.0f, 1.0f,  0.0f, 1.0f,  // D
-  1 * cos(1 * (PI / 4)), 0.5, 1 * sin(1 * (PI / 4)),      0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // D1
-  // 3
-  1 * cos(1 * (PI / 4)), 0.5, 1 * sin(1 * (PI / 4)),      0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // D1
-  1 * cos(1.5 * (PI / 4)), 0, 1 * sin(1.5 * (PI / 4)),    0.0f, 0.0f, 1.0f,  0.0f, 1.0f,  // E
-  1 * cos(1.5 * (PI / 4)), 0.5, 1 * sin(1.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // E1
-  // 4
-  1 * cos(1.5 * (PI / 4)), 0.5, 1 * sin(1.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // E1
-  1 * cos(2 * (PI / 4)), 0, 1 * sin(2 * (PI / 4)),        0.0f, 0.0f, 1.0f,  0.0f, 1.0f,  // F
-  1 * cos(2 * (PI / 4)), 0.5, 1 * sin(2 * (PI / 4)),      0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // F1
-  // 5
-  1 * cos(2 * (PI / 4)), 0.5, 1 * sin(2 * (PI / 4)),      0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // F1
-  1 * cos(2.5 * (PI / 4)), 0, 1 * sin(2.5 * (PI / 4)),    0.0f, 0.0f, 1.0f,  0.0f, 1.0f,  // G
-  1 * cos(2.5 * (PI / 4)), 0.5, 1 * sin(2.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // G1
-  // 6
-  1 * cos(2.5 * (PI / 4)), 0.5, 1 * sin(2.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // G1
-  1 * cos(3 * (PI / 4)), 0, 1 * sin(3 * (PI / 4)),        0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // H
-  1 * cos(3 * (PI / 4)), 0.5, 1 * sin(3 * (PI / 4)),      0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // H1
-  // 7
-  1 * cos(3 * (PI / 4)), 0.5, 1 * sin(3 * (PI / 4)),      0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // H1
-  1 * cos(3.5 * (PI / 4)), 0, 1 * sin(3.5 * (PI / 4)),    0.0f, 0.0f, 1.0f,  0.0f, 1.0f,  // I
-  1 * cos(3.5 * (PI / 4)), 0.5, 1 * sin(3.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // I1
-  // 8
-  1 * cos(3.5 * (PI / 4)), 0.5, 1 * sin(3.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // I1
-  1 * cos(4 * (PI / 4)), 0, 1 * sin(4 * (PI / 4)),        0.0f, 0.0f, 1.0f,  0.0f, 1.0f,  // J
-  1 * cos(4 * (PI / 4)), 0.5, 1 * sin(4 * (PI / 4)),      0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // J1
-  // 9
-  1 * cos(4 * (PI / 4)), 0.5, 1 * sin(4 * (PI / 4)),      0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // J1
-  1 * cos(4.5 * (PI / 4)), 0, 1 * sin(4.5 * (PI / 4)),    0.0f, 0.0f, 1.0f,  0.0f, 1.0f,  // K
-  1 * cos(4.5 * (PI / 4)), 0.5, 1 * sin(4.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // K1
-  // 10
-  1 * cos(4.5 * (PI / 4)), 0.5, 1 * sin(4.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // K1
-  1 * cos(5 * (PI / 4)), 0, 1 * sin(5 * (PI / 4)),        0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // L
-  1 * cos(5 * (PI / 4)), 0.5, 1 * sin(5 * (PI / 4)),      0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // L1
-  // 11
-  1 * cos(5 * (PI / 4)), 0.5, 1 * sin(5 * (PI / 4)),      0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // L1 
-  1 * cos(5.5 * (PI / 4)), 0, 1 * sin(5.5 * (PI / 4)),    0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // M
-  1 * cos(5.5 * (PI / 4)), 0.5, 1 * sin(5.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // M1
-  // 12
-  1 * cos(5.5 * (PI / 4)), 0.5, 1 * sin(5.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // M1
-  1 * cos(6 * (PI / 4)), 0, 1 * sin(6 * (PI / 4)),        0.0f, 0.0f, 1.0f,  0.0f, 1.0f,  // N
-  1 * cos(6 * (PI / 4)), 0.5, 1 * sin(6 * (PI / 4)),      0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // N1
-  // 13
-  1 * cos(6 * (PI / 4)), 0.5, 1 * sin(6 * (PI / 4)),      0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // N1
-  1 * cos(6.5 * (PI / 4)), 0, 1 * sin(6.5 * (PI / 4)),    0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // O
-  1 * cos(6.5 * (PI / 4)), 0.5, 1 * sin(6.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // O1
-  // 14
-  1 * cos(6.5 * (PI / 4)), 0.5, 1 * sin(6.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // O1
-  1 * cos(6.5 * (PI / 4)), 0, 1 * sin(6.5 * (PI / 4)),    0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // P
-  1 * cos(6.5 * (PI / 4)), 0.5, 1 * sin(6.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // P1
-  // 15
-  1 * cos(6.5 * (PI / 4)), 0.5, 1 * sin(6.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // P1
-  1 * cos(7.5 * (PI / 4)), 0, 1 * sin(7.5 * (PI / 4)),    0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // Q
-  1 * cos(7.5 * (PI / 4)), 0.5, 1 * sin(7.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // Q1
-  // 16
-  1 * cos(7.5 * (PI / 4)), 0.5, 1 * sin(7.5 * (PI / 4)),  0.0f, 0.0f, 1.0f,  0.5f, 1.0f, // Q1
-  1, 0, 0,                                                0.0f, 0.0f, 1.0f,  0.0f, 1.0f, // B
-  1, 0.5, 0,                                              0.0f, 0.0f, 1.0f,  1.0f, 0.0f, // B1
-
   };
 
-    const GLuint floatsPerVertex = 3;
-    const GLuint floatsPerNormal = 3;
-    const GLuint floatsPerUV = 2;
-
-    mesh.nVertices = sizeof(verts) / (sizeof(verts[0]) * (floatsPerVertex + floatsPerNormal + floatsPerUV));
+    // Weld every part into one indexed mesh
+    MeshBuilder builder;
+    UMeshBuilderAddTriangles(builder, PART_CUBE, cubeVerts, sizeof(cubeVerts) / sizeof(cubeVerts[0]));
+    UMeshBuilderAddTriangles(builder, PART_TABLE, tableVerts, sizeof(tableVerts) / sizeof(tableVerts[0]));
 
-    glGenVertexArrays(1, &mesh.vao); // we can also generate multiple VAOs or buffers at the same time
-    glBindVertexArray(mesh.vao);
+    // Round shapes are generated at every level of detail into the same vertex pool
+    for (int lod = 0; lod < MAX_LOD_LEVELS; ++lod)
+    {
+        int segments = LOD_SEGMENTS[lod];
+
+        // Tube body: crimped from a round opening at y = 0 to a flat seam at y = 3
+        UMeshBuilderBeginLod(builder, PART_TUBE_BODY);
+        UGenerateTubeBody(builder, segments, 1.0f, 3.0f);
+        UMeshBuilderEndLod(builder);
+
+        // Tube cap: closed cylinder below the body, sharing its opening ring
+        UMeshBuilderBeginLod(builder, PART_TUBE_CAP);
+        UGenerateCylinder(builder, segments, 1.0f, -1.0f, 0.0f, true, false, 0.0f);
+        UMeshBuilderEndLod(builder);
+
+        // Pink sphere
+        UMeshBuilderBeginLod(builder, PART_SPHERE);
+        UGenerateCylinder(builder, segments, 1.0f, 0.0f, 0.5f, true, true, 0.0f);
+        UMeshBuilderEndLod(builder);
+
+        UMeshBuilderBeginLod(builder, PART_UV_SPHERE);
+        UGenerateUVSphere(builder, segments, segments / 2, 0.5f);
+        UMeshBuilderEndLod(builder);
+    }
 
-    // Create 2 buffers: first one for the vertex data; second one for the indices
-    glGenBuffers(1, &mesh.vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
+    // The octagon keeps its eight flat sides, so it has a single level
+    UMeshBuilderBeginLod(builder, PART_OCTAGON);
+    UGeneratePrism(builder, 8, 2.0f, -1.0f, 0.0f, PI / 8.0f);
+    UMeshBuilderEndLod(builder);
 
-    // Strides between vertex coordinates is 6 (x, y, z, r, g, b, a). A tightly packed stride is 0.
-    GLint stride = sizeof(float) * (floatsPerVertex + floatsPerNormal + floatsPerUV);// The number of floats before each
+    UUploadMesh(builder, mesh);
+}
 
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerVertex));
-    glEnableVertexAttribArray(1);
+// Starts a new level of detail of a mesh part at the current end of the index buffer
+void UMeshBuilderBeginLod(MeshBuilder& builder, MeshPart part)
+{
+    GLMeshPart& meshPart = builder.parts[part];
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
+    builder.currentPart = part;
+    meshPart.lods[meshPart.nLods].firstIndex = GLuint(builder.indices.size());
+    meshPart.lods[meshPart.nLods].nIndices = 0;
 }
 
 
-void UDestroyMesh(GLMesh& mesh)
+// Closes the level of detail opened by UMeshBuilderBeginLod
+void UMeshBuilderEndLod(MeshBuilder& builder)
 {
-    glDeleteVertexArrays(1, &mesh.vao);
-    glDeleteBuffers(1, &mesh.vbo);
+    GLMeshPart& meshPart = builder.parts[builder.currentPart];
+    GLSubMesh& subMesh = meshPart.lods[meshPart.nLods];
+
+    subMesh.nIndices = GLuint(builder.indices.size()) - subMesh.firstIndex;
+    ++meshPart.nLods;
 }
 
 
-/*Generate and load the texture*/
-bool UCreateTexture(const char* filename, GLuint& textureId)
+// Returns the index of an interleaved vertex, adding it only if no identical vertex exists yet
+GLuint UMeshBuilderAddVertex(MeshBuilder& builder, const GLfloat* vertex)
 {
-    int width, height, channels;
-    unsigned char* image = stbi_load(filename, &width, &height, &channels, 0);
-    if (image)
-    {
-        flipImageVertically(image, width, height, channels);
+    ++builder.nInputVertices;
 
-        glGenTextures(1, &textureId);
-        glBindTexture(GL_TEXTURE_2D, textureId);
+    VertexKey key;
+    for (GLuint i = 0; i < FLOATS_PER_VERTEX; ++i)
+    {
+        GLfloat value = vertex[i] + 0.0f; // Folds -0.0 into 0.0 so both weld together
+        memcpy(&key.bits[i], &value, sizeof(value));
+    }
 
-        // set the texture wrapping parameters
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    GLuint index = GLuint(builder.vertices.size() / FLOATS_PER_VERTEX);
+    std::pair<std::unordered_map<VertexKey, GLuint, VertexKeyHash>::iterator, bool> found = builder.lookup.insert(std::make_pair(key, index));
+    if (!found.second)
+        return found.first->second;
 
-        // set texture filtering parameters
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    builder.vertices.insert(builder.vertices.end(), vertex, vertex + FLOATS_PER_VERTEX);
+    return index;
+}
 
-        if (channels == 3)
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
-        else if (channels == 4)
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, image);
-        else
-        {
-            cout << "Not implemented to handle image with " << channels << " channels" << endl;
-            return false;
-        }
 
-        glGenerateMipmap(GL_TEXTURE_2D);
+GLuint UMeshBuilderAddVertex(MeshBuilder& builder, const glm::vec3& position, const glm::vec3& normal, const glm::vec2& uv)
+{
+    const GLfloat vertex[FLOATS_PER_VERTEX] = {
+        position.x, position.y, position.z,
+        normal.x, normal.y, normal.z,
+        uv.x, uv.y
+    };
 
-        stbi_image_free(image);
-        glBindTexture(GL_TEXTURE_2D, 0); // Unbind the texture
+    return UMeshBuilderAddVertex(builder, vertex);
+}
 
-        return true;
-    }
 
-    // Error loading the image
-    return false;
+// Adds one counter-clockwise (front facing) triangle to the current level of detail
+void UMeshBuilderAddTriangle(MeshBuilder& builder, GLuint i0, GLuint i1, GLuint i2)
+{
+    builder.indices.push_back(i0);
+    builder.indices.push_back(i1);
+    builder.indices.push_back(i2);
 }
 
 
-void UDestroyTexture(GLuint textureId)
+// Appends a hand-written, non-indexed triangle list as a single-level mesh part
+void UMeshBuilderAddTriangles(MeshBuilder& builder, MeshPart part, const GLfloat* verts, size_t nFloats)
 {
-    glGenTextures(1, &textureId);
+    GLuint nVerts = GLuint(nFloats / FLOATS_PER_VERTEX);
+
+    UMeshBuilderBeginLod(builder, part);
+    for (GLuint v = 0; v < nVerts; ++v)
+        builder.indices.push_back(UMeshBuilderAddVertex(builder, verts + v * FLOATS_PER_VERTEX));
+    UMeshBuilderEndLod(builder);
 }
 
 
-// Implements the UCreateShaders function
-bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint& programId)
+// Point on a circle of the XZ plane, using the same (cos, -sin) convention as the original hand-made shapes
+glm::vec3 UCirclePoint(float angle, float radius, float y)
 {
-    // Compilation and linkage error reporting
-    int success = 0;
-    char infoLog[512];
-
-    // Create a Shader program object.
-    programId = glCreateProgram();
+    return glm::vec3(radius * cos(angle), y, -radius * sin(angle));
+}
 
-    // Create the vertex and fragment shader objects
-    GLuint vertexShaderId = glCreateShader(GL_VERTEX_SHADER);
-    GLuint fragmentShaderId = glCreateShader(GL_FRAGMENT_SHADER);
 
-    // Retrive the shader source
-    glShaderSource(vertexShaderId, 1, &vtxShaderSource, NULL);
-    glShaderSource(fragmentShaderId, 1, &fragShaderSource, NULL);
+// Flat disc facing up or down, used to close cylinders
+void UGenerateDisc(MeshBuilder& builder, int segments, float radius, float y, bool facingUp, float startAngle)
+{
+    glm::vec3 normal(0.0f, facingUp ? 1.0f : -1.0f, 0.0f);
+    GLuint center = UMeshBuilderAddVertex(builder, glm::vec3(0.0f, y, 0.0f), normal, glm::vec2(0.5f, 0.5f));
 
-    // Compile the vertex shader, and print compilation errors (if any)
-    glCompileShader(vertexShaderId); // compile the vertex shader
-    // check for shader compile errors
-    glGetShaderiv(vertexShaderId, GL_COMPILE_STATUS, &success);
-    if (!success)
+    for (int i = 0; i < segments; ++i)
     {
-        glGetShaderInfoLog(vertexShaderId, 512, NULL, infoLog);
-        std::cout << "ERROR::SHADER::VERTEX::COMPILATION_FAILED\n" << infoLog << std::endl;
+        float a0 = startAngle + 2.0f * PI * i / segments;
+        float a1 = startAngle + 2.0f * PI * (i + 1) / segments;
 
-        return false;
-    }
+        GLuint v0 = UMeshBuilderAddVertex(builder, UCirclePoint(a0, radius, y), normal, glm::vec2(0.5f + 0.5f * cos(a0), 0.5f + 0.5f * sin(a0)));
+        GLuint v1 = UMeshBuilderAddVertex(builder, UCirclePoint(a1, radius, y), normal, glm::vec2(0.5f + 0.5f * cos(a1), 0.5f + 0.5f * sin(a1)));
+
+        if (facingUp)
+            UMeshBuilderAddTriangle(builder, center, v0, v1);
+        else
+            UMeshBuilderAddTriangle(builder, center, v1, v0);
+    }
+}
+
+
+// Smooth-shaded cylinder around the Y axis with optional caps
+void UGenerateCylinder(MeshBuilder& builder, int segments, float radius, float yBottom, float yTop, bool bottomCap, bool topCap, float startAngle)
+{
+    // The seam column is emitted twice (u = 0 and u = 1) so the texture wraps once around
+    for (int i = 0; i < segments; ++i)
+    {
+        float a0 = startAngle + 2.0f * PI * i / segments;
+        float a1 = startAngle + 2.0f * PI * (i + 1) / segments;
+        float u0 = float(i) / segments;
+        float u1 = float(i + 1) / segments;
+        glm::vec3 n0 = UCirclePoint(a0, 1.0f, 0.0f);
+        glm::vec3 n1 = UCirclePoint(a1, 1.0f, 0.0f);
+
+        GLuint b0 = UMeshBuilderAddVertex(builder, UCirclePoint(a0, radius, yBottom), n0, glm::vec2(u0, 0.0f));
+        GLuint b1 = UMeshBuilderAddVertex(builder, UCirclePoint(a1, radius, yBottom), n1, glm::vec2(u1, 0.0f));
+        GLuint t0 = UMeshBuilderAddVertex(builder, UCirclePoint(a0, radius, yTop), n0, glm::vec2(u0, 1.0f));
+        GLuint t1 = UMeshBuilderAddVertex(builder, UCirclePoint(a1, radius, yTop), n1, glm::vec2(u1, 1.0f));
+
+        UMeshBuilderAddTriangle(builder, b0, b1, t1);
+        UMeshBuilderAddTriangle(builder, b0, t1, t0);
+    }
+
+    if (bottomCap)
+        UGenerateDisc(builder, segments, radius, yBottom, false, startAngle);
+    if (topCap)
+        UGenerateDisc(builder, segments, radius, yTop, true, startAngle);
+}
+
+
+// Closed prism with flat-shaded sides (the octagon is an 8-sided prism)
+void UGeneratePrism(MeshBuilder& builder, int sides, float radius, float yBottom, float yTop, float startAngle)
+{
+    for (int i = 0; i < sides; ++i)
+    {
+        float a0 = startAngle + 2.0f * PI * i / sides;
+        float a1 = startAngle + 2.0f * PI * (i + 1) / sides;
+        glm::vec3 normal = UCirclePoint(0.5f * (a0 + a1), 1.0f, 0.0f);
+
+        GLuint b0 = UMeshBuilderAddVertex(builder, UCirclePoint(a0, radius, yBottom), normal, glm::vec2(0.0f, 0.0f));
+        GLuint b1 = UMeshBuilderAddVertex(builder, UCirclePoint(a1, radius, yBottom), normal, glm::vec2(1.0f, 0.0f));
+        GLuint t0 = UMeshBuilderAddVertex(builder, UCirclePoint(a0, radius, yTop), normal, glm::vec2(0.0f, 1.0f));
+        GLuint t1 = UMeshBuilderAddVertex(builder, UCirclePoint(a1, radius, yTop), normal, glm::vec2(1.0f, 1.0f));
+
+        UMeshBuilderAddTriangle(builder, b0, b1, t1);
+        UMeshBuilderAddTriangle(builder, b0, t1, t0);
+    }
+
+    UGenerateDisc(builder, sides, radius, yBottom, false, startAngle);
+    UGenerateDisc(builder, sides, radius, yTop, true, startAngle);
+}
+
+
+// Squeeze tube body: a ruled surface from a circle at y = 0 to a flat seam along X at y = height
+void UGenerateTubeBody(MeshBuilder& builder, int segments, float radius, float height)
+{
+    for (int i = 0; i < segments; ++i)
+    {
+        float a0 = 2.0f * PI * i / segments;
+        float a1 = 2.0f * PI * (i + 1) / segments;
+        float u0 = float(i) / segments;
+        float u1 = float(i + 1) / segments;
+
+        // Surface P(a, t) = (r cos a, t h, -(1 - t) r sin a); normals are dP/da x dP/dt at t = 0 and t = 1
+        glm::vec3 ringNormal0 = glm::normalize(glm::vec3(height * cos(a0), radius * sin(a0) * sin(a0), -height * sin(a0)));
+        glm::vec3 ringNormal1 = glm::normalize(glm::vec3(height * cos(a1), radius * sin(a1) * sin(a1), -height * sin(a1)));
+        glm::vec3 seamNormal0(0.0f, radius * sin(a0) * sin(a0), -height * sin(a0));
+        glm::vec3 seamNormal1(0.0f, radius * sin(a1) * sin(a1), -height * sin(a1));
+
+        // At the ends of the seam the surface normal vanishes, use the side direction instead
+        seamNormal0 = glm::length(seamNormal0) > 1e-4f ? glm::normalize(seamNormal0) : glm::vec3(cos(a0) > 0.0f ? 1.0f : -1.0f, 0.0f, 0.0f);
+        seamNormal1 = glm::length(seamNormal1) > 1e-4f ? glm::normalize(seamNormal1) : glm::vec3(cos(a1) > 0.0f ? 1.0f : -1.0f, 0.0f, 0.0f);
+
+        GLuint b0 = UMeshBuilderAddVertex(builder, UCirclePoint(a0, radius, 0.0f), ringNormal0, glm::vec2(u0, 0.0f));
+        GLuint b1 = UMeshBuilderAddVertex(builder, UCirclePoint(a1, radius, 0.0f), ringNormal1, glm::vec2(u1, 0.0f));
+        GLuint t0 = UMeshBuilderAddVertex(builder, glm::vec3(radius * cos(a0), height, 0.0f), seamNormal0, glm::vec2(u0, 1.0f));
+        GLuint t1 = UMeshBuilderAddVertex(builder, glm::vec3(radius * cos(a1), height, 0.0f), seamNormal1, glm::vec2(u1, 1.0f));
+
+        UMeshBuilderAddTriangle(builder, b0, b1, t1);
+
+        // Segments whose seam points coincide collapse into a single triangle
+        if (fabs(cos(a0) - cos(a1)) > 1e-6f)
+            UMeshBuilderAddTriangle(builder, b0, t1, t0);
+    }
+}
+
+
+// UV sphere centered on the origin, with the poles on the Y axis
+void UGenerateUVSphere(MeshBuilder& builder, int segments, int rings, float radius)
+{
+    for (int j = 0; j < rings; ++j)
+    {
+        float theta0 = PI * j / rings;          // Upper ring of the band
+        float theta1 = PI * (j + 1) / rings;    // Lower ring of the band
+
+        for (int i = 0; i < segments; ++i)
+        {
+            float a0 = 2.0f * PI * i / segments;
+            float a1 = 2.0f * PI * (i + 1) / segments;
+            float u0 = float(i) / segments;
+            float u1 = float(i + 1) / segments;
+
+            glm::vec3 n00(sin(theta0) * cos(a0), cos(theta0), -sin(theta0) * sin(a0));
+            glm::vec3 n01(sin(theta0) * cos(a1), cos(theta0), -sin(theta0) * sin(a1));
+            glm::vec3 n10(sin(theta1) * cos(a0), cos(theta1), -sin(theta1) * sin(a0));
+            glm::vec3 n11(sin(theta1) * cos(a1), cos(theta1), -sin(theta1) * sin(a1));
+
+            GLuint t0 = UMeshBuilderAddVertex(builder, n00 * radius, n00, glm::vec2(u0, 1.0f - float(j) / rings));
+            GLuint t1 = UMeshBuilderAddVertex(builder, n01 * radius, n01, glm::vec2(u1, 1.0f - float(j) / rings));
+            GLuint b0 = UMeshBuilderAddVertex(builder, n10 * radius, n10, glm::vec2(u0, 1.0f - float(j + 1) / rings));
+            GLuint b1 = UMeshBuilderAddVertex(builder, n11 * radius, n11, glm::vec2(u1, 1.0f - float(j + 1) / rings));
+
+            // The bands touching a pole are fans, skip their zero-area triangle
+            if (j != rings - 1)
+                UMeshBuilderAddTriangle(builder, b0, b1, t1);
+            if (j != 0)
+                UMeshBuilderAddTriangle(builder, b0, t1, t0);
+        }
+    }
+}
+
+
+// Creates the VAO, VBO and EBO of a welded mesh and reports the memory saved by indexing
+void UUploadMesh(const MeshBuilder& builder, GLMesh& mesh)
+{
+    const GLuint floatsPerVertex = 3;
+    const GLuint floatsPerNormal = 3;
+    const GLuint floatsPerUV = 2;
+
+    mesh.nVertices = GLuint(builder.vertices.size() / FLOATS_PER_VERTEX);
+    mesh.nIndices = GLuint(builder.indices.size());
+    for (int i = 0; i < MESH_PART_COUNT; ++i)
+    {
+        mesh.parts[i] = builder.parts[i];
+
+        // Bounds of the finest level, used to measure the part on screen
+        const GLSubMesh& finest = mesh.parts[i].lods[0];
+        mesh.parts[i].boundsMin = glm::vec3(1e30f);
+        mesh.parts[i].boundsMax = glm::vec3(-1e30f);
+        for (GLuint j = finest.firstIndex; j < finest.firstIndex + finest.nIndices; ++j)
+        {
+            const GLfloat* vertex = &builder.vertices[builder.indices[j] * FLOATS_PER_VERTEX];
+            glm::vec3 position(vertex[0], vertex[1], vertex[2]);
+            mesh.parts[i].boundsMin = glm::min(mesh.parts[i].boundsMin, position);
+            mesh.parts[i].boundsMax = glm::max(mesh.parts[i].boundsMax, position);
+        }
+    }
+
+    glGenVertexArrays(1, &mesh.vao); // we can also generate multiple VAOs or buffers at the same time
+    glBindVertexArray(mesh.vao);
+
+    // Create 2 buffers: first one for the vertex data; second one for the indices
+    glGenBuffers(1, &mesh.vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo); // Activates the buffer
+    glBufferData(GL_ARRAY_BUFFER, builder.vertices.size() * sizeof(GLfloat), builder.vertices.data(), GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
+
+    // 16-bit indices halve the index buffer whenever the vertex count allows it
+    size_t indexSize;
+    glGenBuffers(1, &mesh.ebo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh.ebo); // Stays attached to the VAO
+    if (mesh.nVertices <= 0xFFFF)
+    {
+        std::vector<GLushort> shortIndices(builder.indices.begin(), builder.indices.end());
+        mesh.indexType = GL_UNSIGNED_SHORT;
+        indexSize = sizeof(GLushort);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, shortIndices.size() * indexSize, shortIndices.data(), GL_STATIC_DRAW);
+    }
+    else
+    {
+        mesh.indexType = GL_UNSIGNED_INT;
+        indexSize = sizeof(GLuint);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, builder.indices.size() * indexSize, builder.indices.data(), GL_STATIC_DRAW);
+    }
+
+    // Strides between vertex coordinates is 8 (x, y, z, nx, ny, nz, u, v). A tightly packed stride is 0.
+    GLint stride = sizeof(float) * (floatsPerVertex + floatsPerNormal + floatsPerUV);// The number of floats before each
+
+    // Create Vertex Attribute Pointers
+    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
+    glEnableVertexAttribArray(0);
+
+    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerVertex));
+    glEnableVertexAttribArray(1);
+
+    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
+    glEnableVertexAttribArray(2);
+
+    glBindVertexArray(0);
+
+    size_t unindexedBytes = builder.nInputVertices * stride;
+    size_t indexedBytes = mesh.nVertices * stride + mesh.nIndices * indexSize;
+    cout << "INFO: Mesh welded " << builder.nInputVertices << " vertices into " << mesh.nVertices
+         << " (" << unindexedBytes << " -> " << indexedBytes << " bytes including indices)" << endl;
+
+    for (int i = 0; i < MESH_PART_COUNT; ++i)
+    {
+        if (mesh.parts[i].nLods < 2)
+            continue;
+
+        cout << "INFO: Mesh part " << MESH_PART_NAMES[i] << " triangles per LOD:";
+        for (int lod = 0; lod < mesh.parts[i].nLods; ++lod)
+            cout << " " << mesh.parts[i].lods[lod].nIndices / 3;
+        cout << endl;
+    }
+}
+
+
+// Draws instances [firstInstance, firstInstance + instanceCount) of one level of detail of a named mesh part;
+// the mesh VAO must be bound and the instance buffer uploaded
+void UDrawSubMesh(const GLMesh& mesh, MeshPart part, int lod, GLuint firstInstance, GLsizei instanceCount)
+{
+    size_t indexSize = mesh.indexType == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint);
+    const GLSubMesh& subMesh = mesh.parts[part].lods[lod];
+
+    ++gFrameStats.drawCalls;
+    gFrameStats.instances += instanceCount;
+    gFrameStats.triangles += subMesh.nIndices / 3 * instanceCount;
+    if (mesh.parts[part].nLods > 1)
+        gFrameStats.lodTriangles[lod] += subMesh.nIndices / 3 * instanceCount;
+
+    glDrawElementsInstancedBaseInstance(GL_TRIANGLES, subMesh.nIndices, mesh.indexType,
+        (void*)(subMesh.firstIndex * indexSize), instanceCount, firstInstance);
+}
+
+
+// Radius in pixels of a world-space sphere once projected with the current camera
+float UProjectedRadius(const glm::vec3& center, float radius)
+{
+    if (perspective)
+    {
+        // The orthographic view maps 8 world units onto the window height
+        return radius * gViewportHeight / 8.0f;
+    }
+
+    float distance = glm::length(center - gCamera.Position);
+    if (distance <= radius)
+        return 1e30f; // Camera inside the bounds: always the finest level
+
+    float halfFovTangent = tan(glm::radians(gCamera.Zoom) * 0.5f);
+    return radius / (distance * halfFovTangent) * (gViewportHeight * 0.5f);
+}
+
+
+// Moves from the current level to the one matching the projected size, with a dead band around each threshold
+int USelectLod(const GLMeshPart& part, float projectedRadius, int currentLod)
+{
+    int lod = glm::clamp(currentLod, 0, part.nLods - 1);
+
+    while (lod > 0 && projectedRadius > LOD_PIXEL_THRESHOLDS[lod - 1] * (1.0f + LOD_HYSTERESIS))
+        --lod;
+    while (lod < part.nLods - 1 && projectedRadius < LOD_PIXEL_THRESHOLDS[lod] * (1.0f - LOD_HYSTERESIS))
+        ++lod;
+
+    return lod;
+}
+
+
+// Appends an entity drawing a mesh part with a material; its bounds are those of the finest level of the part
+GLuint UCreateEntity(EntityStore& store, MeshPart part, MaterialId material, const glm::vec3& position, const glm::vec3& scale, const glm::vec4& tint)
+{
+    const GLMeshPart& meshPart = gMesh.parts[part];
+    glm::vec3 center = 0.5f * (meshPart.boundsMin + meshPart.boundsMax);
+    float radius = 0.5f * glm::length(meshPart.boundsMax - meshPart.boundsMin);
+
+    store.positions.push_back(position);
+    store.scales.push_back(scale);
+    store.models.push_back(glm::mat4(1.0f));
+    store.normalMatrices.push_back(glm::mat3(1.0f));
+    store.parts.push_back(part);
+    store.lods.push_back(0);
+    store.materials.push_back(material);
+    store.tints.push_back(tint);
+    store.lightMasks.push_back(0);
+    store.localBounds.push_back(glm::vec4(center, radius));
+    store.boundsX.push_back(0.0f);
+    store.boundsY.push_back(0.0f);
+    store.boundsZ.push_back(0.0f);
+    store.boundsRadius.push_back(0.0f);
+    store.isDynamic.push_back(false);
+
+    return GLuint(store.positions.size() - 1);
+}
+
+
+// Creates the hand-placed objects of the scene; the mesh must be uploaded first
+void UCreateScene()
+{
+    gSceneEntities[OBJECT_TABLE] = UCreateEntity(gEntities, PART_TABLE, MATERIAL_TABLE, glm::vec3(1.0f, -2.0f, 0.0f), glm::vec3(1.0f));
+    gSceneEntities[OBJECT_LAMP] = UCreateEntity(gEntities, PART_CUBE, MATERIAL_LAMP, gLightPosition, glm::vec3(0.5f));
+    gSceneEntities[OBJECT_KEY_LIGHT] = UCreateEntity(gEntities, PART_CUBE, MATERIAL_LAMP, gKeyLightPosition, glm::vec3(0.2f));
+    gSceneEntities[OBJECT_TUBE] = UCreateEntity(gEntities, PART_TUBE_BODY, MATERIAL_TUBE_BODY, glm::vec3(5.0f, -5.3f, 0.0f), glm::vec3(1.5f));
+    gSceneEntities[OBJECT_TUBE_CAP] = UCreateEntity(gEntities, PART_TUBE_CAP, MATERIAL_TUBE_CAP, glm::vec3(5.0f, -5.3f, 0.0f), glm::vec3(1.5f));
+    gSceneEntities[OBJECT_OCTAGON] = UCreateEntity(gEntities, PART_OCTAGON, MATERIAL_OCTAGON, glm::vec3(0.0f, -6.1f, -1.0f), glm::vec3(0.8f));
+    gSceneEntities[OBJECT_SPHERE] = UCreateEntity(gEntities, PART_SPHERE, MATERIAL_PINK, glm::vec3(0.0f, -6.9f, 3.0f), glm::vec3(1.3f));
+    gSceneEntities[OBJECT_CUBE2] = UCreateEntity(gEntities, PART_CUBE, MATERIAL_BLUE_BOX, glm::vec3(-4.0f, -5.5f, -1.0f), glm::vec3(2.9f));
+    // Top cube: the unit cube flattened
+    gSceneEntities[OBJECT_CUBE1] = UCreateEntity(gEntities, PART_CUBE, MATERIAL_BLUE_BOX, glm::vec3(-4.0f, -4.0f, -1.0f), glm::vec3(3.0f, 0.5f, 3.0f));
+
+    // The cap measures itself with the body's bounds so both always pick the same tessellation
+    gEntities.localBounds[gSceneEntities[OBJECT_TUBE_CAP]] = gEntities.localBounds[gSceneEntities[OBJECT_TUBE]];
+}
+
+
+// Places boxes and spheres of random size and tint on the table; the fixed seed keeps benchmark runs comparable
+void UScatterProps(int count)
+{
+    std::mt19937 random(1);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+    for (int i = 0; i < count; ++i)
+    {
+        bool isBox = i < (count + 1) / 2;   // Boxes first so they follow the blue cubes
+        float size = 0.4f + 0.6f * unit(random);
+        glm::vec3 position(-13.0f + 28.0f * unit(random), TABLE_TOP_Y + 0.5f * size, -11.0f + 22.0f * unit(random));
+        glm::vec4 tint(0.6f + 0.4f * unit(random), 0.6f + 0.4f * unit(random), 0.6f + 0.4f * unit(random), 1.0f);
+
+        UCreateEntity(gEntities, isBox ? PART_CUBE : PART_UV_SPHERE, isBox ? MATERIAL_BLUE_BOX : MATERIAL_PINK, position, glm::vec3(size), tint);
+    }
+
+    if (count > 0)
+        cout << "INFO: Scattered " << count << " props on the table" << endl;
+}
+
+
+// Fills the material table once the textures exist, submits the shader variant each material needs and
+// uploads the records the scene shader reads. Only the fallback variants are waited for; the others finish
+// in the background and UPollShaderVariants swaps them in.
+bool UCreateMaterials()
+{
+    static_assert(MATERIAL_COUNT <= MAX_MATERIAL_RECORDS, "The Materials block in the lit shader is too small");
+
+    const Material materials[MATERIAL_COUNT] = {
+        { gSceneTextures, LAYER_CARDBOARD, PHONG_SHADING, PASS_OPAQUE },    // Table
+        { gSceneTextures, LAYER_TUBE_BODY, PHONG_SHADING, PASS_OPAQUE },    // Tube body
+        { gSceneTextures, LAYER_TUBE_CAP, PHONG_SHADING, PASS_OPAQUE },     // Tube cap
+        { gSceneTextures, LAYER_OCTAGON, PHONG_SHADING, PASS_OPAQUE },      // Octagon
+        { gSceneTextures, LAYER_BLUE_BOX, PHONG_SHADING, PASS_OPAQUE },     // Blue boxes
+        { gSceneTextures, LAYER_PINK, PHONG_SHADING, PASS_OPAQUE },         // Pink spheres
+        { 0, 0, glm::vec4(0.0f), PASS_LAMPS },                              // Lamps: flat white
+    };
+
+    // Submit every variant before waiting on any, so the driver compiles them side by side
+    gShaderSubmitTime = std::chrono::steady_clock::now();
+    for (int i = 0; i < MATERIAL_COUNT; ++i)
+    {
+        gMaterials[i] = materials[i];
+        gMaterials[i].features = UMaterialFeatures(materials[i]);
+        gMaterials[i].fallbackFeatures = gMaterials[i].features & SHADER_TEXTURED;
+        gMaterials[i].deferredFeatures = gMaterials[i].pass != PASS_OPAQUE ? gMaterials[i].features
+                                       : (gMaterials[i].features & SHADER_TEXTURED) | SHADER_LIGHTING | SHADER_GBUFFER;
+        URequestShaderVariant(gMaterials[i].features);
+        URequestShaderVariant(gMaterials[i].deferredFeatures);
+    }
+
+    // The fallbacks are few and cheap; the first frame cannot draw without them
+    for (int i = 0; i < MATERIAL_COUNT; ++i)
+    {
+        ShaderVariant fallback;
+        if (!UGetShaderVariant(gMaterials[i].fallbackFeatures, fallback))
+            return false;
+    }
+    UAssignMaterialPrograms();
+
+    // Uploaded whole, so the buffer is exactly the size of the Materials block the shaders declare
+    MaterialRecord records[MAX_MATERIAL_RECORDS] = {};
+    static_assert(sizeof(records) == MAX_MATERIAL_RECORDS * 32, "MaterialRecord no longer matches its std140 layout");
+    for (int i = 0; i < MATERIAL_COUNT; ++i)
+    {
+        records[i].shading = gMaterials[i].shading;
+        records[i].layer = gMaterials[i].textureLayer;
+    }
+
+    glGenBuffers(1, &gMaterialBuffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, gMaterialBuffer);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(records), records, GL_STATIC_DRAW);
+    glBindBufferBase(GL_UNIFORM_BUFFER, MATERIAL_BLOCK_BINDING, gMaterialBuffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+    cout << "INFO: " << MATERIAL_COUNT << " materials use " << gShaderVariants.size() << " shader variants ("
+         << gPendingShaderVariants << " still compiling)" << endl;
+    return true;
+}
+
+
+// The cheapest shader features that reproduce a material's look
+GLuint UMaterialFeatures(const Material& material)
+{
+    GLuint features = 0;
+    if (material.textureId != 0)
+        features |= SHADER_TEXTURED;
+
+    // Unlit materials have no shading parameters at all
+    if (material.shading.x != 0.0f || material.shading.y != 0.0f || material.shading.z != 0.0f)
+    {
+        features |= SHADER_LIGHTING;
+        if (material.shading.z > 0.0f)
+            features |= SHADER_SPECULAR;
+    }
+    return features;
+}
+
+
+// Prepends the version line, one #define per feature and the Materials array size to a variant's shader source
+std::string UBuildShaderSource(GLuint features, const char* source)
+{
+    std::string header = GLSL_VERSION;
+    header += "#define TEXTURED " + std::to_string((features & SHADER_TEXTURED) ? 1 : 0) + "\n";
+    header += "#define LIGHTING " + std::to_string((features & SHADER_LIGHTING) ? 1 : 0) + "\n";
+    header += "#define SPECULAR " + std::to_string((features & SHADER_SPECULAR) ? 1 : 0) + "\n";
+    header += "#define GBUFFER " + std::to_string((features & SHADER_GBUFFER) ? 1 : 0) + "\n";
+    header += "#define MAX_MATERIAL_RECORDS " + std::to_string(MAX_MATERIAL_RECORDS) + "\n";
+    return header + source;
+}
+
+
+// Returns the variant for a feature mask, loading it from the binary cache or submitting its compile on first use.
+// A submitted variant is not ready until UFinishShaderVariant has run.
+ShaderVariant& URequestShaderVariant(GLuint features)
+{
+    std::unordered_map<GLuint, ShaderVariant>::iterator found = gShaderVariants.find(features);
+    if (found != gShaderVariants.end())
+        return found->second;
+
+    ShaderVariant& variant = gShaderVariants[features];
+    variant = ShaderVariant();
+    variant.submitTime = std::chrono::steady_clock::now();
+
+    std::string vertexSource = UBuildShaderSource(features, sceneVertexShaderSource);
+    std::string fragmentSource = UBuildShaderSource(features, sceneLightingShaderSource) + sceneFragmentShaderSource;
+    if (UProgramCacheKey(vertexSource, fragmentSource, variant.cacheKey, variant.cacheFilename)
+        && ULoadProgramBinary(variant.cacheFilename, variant.cacheKey, variant.programId))
+    {
+        // Nothing to wait for; the binary is already linked
+        variant.cacheFilename.clear();
+        UFinishShaderVariant(features, variant);
+        return variant;
+    }
+
+    USubmitShaderProgram(vertexSource.c_str(), fragmentSource.c_str(), variant.programId, variant.vertexShaderId, variant.fragmentShaderId);
+    variant.isCompiling = true;
+    ++gPendingShaderVariants;
+    return variant;
+}
+
+
+// Checks a variant's compile and link (blocking if the driver is still busy), then readies it for drawing
+bool UFinishShaderVariant(GLuint features, ShaderVariant& variant)
+{
+    bool fromCache = !variant.isCompiling;
+    if (variant.isCompiling)
+    {
+        variant.isCompiling = false;
+        --gPendingShaderVariants;
+        bool linked = UFinishShaderProgram(variant.programId, variant.vertexShaderId, variant.fragmentShaderId);
+        variant.vertexShaderId = variant.fragmentShaderId = 0;
+        if (!linked)
+        {
+            cout << "Failed to compile shader variant 0x" << std::hex << features << std::dec << endl;
+            variant.hasFailed = true;
+            return false;
+        }
+        if (!variant.cacheFilename.empty())
+            USaveProgramBinary(variant.cacheFilename, variant.cacheKey, variant.programId);
+    }
+
+    // Uniform locations and sampler units are per program state, set once here
+    glUseProgram(variant.programId);
+    UCacheUniformLocations(variant.programId, variant.uniforms);
+    USetUniform(variant.uniforms.sceneTextures, GLint(SCENE_TEXTURE_UNIT - GL_TEXTURE0));
+    USetUniform(variant.uniforms.shadowMaps, GLint(SHADOW_TEXTURE_UNIT - GL_TEXTURE0));
+    USetUniform(variant.uniforms.uvScale, gUVScale);
+    variant.isReady = true;
+
+    cout << "INFO: " << (fromCache ? "Loaded cached" : "Compiled") << " shader variant 0x" << std::hex << features << std::dec << " in "
+         << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - variant.submitTime).count() << " ms" << endl;
+    return true;
+}
+
+
+// Returns the ready variant for a feature mask, waiting for its compile if needed
+bool UGetShaderVariant(GLuint features, ShaderVariant& variant)
+{
+    ShaderVariant& requested = URequestShaderVariant(features);
+    if (!requested.isReady && (requested.hasFailed || !UFinishShaderVariant(features, requested)))
+        return false;
+
+    variant = requested;
+    return true;
+}
+
+
+// Points each material at its own variant once ready, at its fallback until then, and re-ranks the programs;
+// the deferred renderer uses the deferred variants throughout
+void UAssignMaterialPrograms()
+{
+    for (int i = 0; i < MATERIAL_COUNT; ++i)
+    {
+        // USetDeferredShading waited for the deferred variants, they have no fallback
+        if (gDeferredShading)
+        {
+            gMaterials[i].programId = gShaderVariants[gMaterials[i].deferredFeatures].programId;
+            continue;
+        }
+
+        const ShaderVariant& variant = gShaderVariants[gMaterials[i].features];
+        gMaterials[i].programId = variant.isReady ? variant.programId : gShaderVariants[gMaterials[i].fallbackFeatures].programId;
+    }
+
+    for (int i = 0; i < MATERIAL_COUNT; ++i)
+    {
+        // Rank of the program and texture among the distinct ones seen so far, small enough for the sort key
+        std::vector<GLuint> programs, textures;
+        for (int j = 0; j <= i; ++j)
+        {
+            if (std::find(programs.begin(), programs.end(), gMaterials[j].programId) == programs.end())
+                programs.push_back(gMaterials[j].programId);
+            if (std::find(textures.begin(), textures.end(), gMaterials[j].textureId) == textures.end())
+                textures.push_back(gMaterials[j].textureId);
+        }
+        gMaterials[i].programKey = GLuint(std::find(programs.begin(), programs.end(), gMaterials[i].programId) - programs.begin());
+        gMaterials[i].textureKey = GLuint(std::find(textures.begin(), textures.end(), gMaterials[i].textureId) - textures.begin());
+    }
+}
+
+
+// Called once per frame: finishes the variants the driver has completed and swaps them in for their fallbacks
+void UPollShaderVariants()
+{
+    if (gPendingShaderVariants == 0)
+        return;
+
+    bool changed = false;
+    for (std::unordered_map<GLuint, ShaderVariant>::iterator it = gShaderVariants.begin(); it != gShaderVariants.end(); ++it)
+    {
+        ShaderVariant& variant = it->second;
+        if (variant.isReady || variant.hasFailed || !UIsProgramComplete(variant.programId))
+            continue;
+        changed |= UFinishShaderVariant(it->first, variant);
+    }
+
+    if (changed)
+        UAssignMaterialPrograms();
+    if (gPendingShaderVariants == 0)
+        cout << "INFO: All shader variants ready "
+             << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - gShaderSubmitTime).count()
+             << " ms after submission" << endl;
+}
+
+
+// Waits for every pending variant; benchmark and headless runs measure and capture the final shaders only
+bool UFinishShaderVariants()
+{
+    bool success = true;
+    for (std::unordered_map<GLuint, ShaderVariant>::iterator it = gShaderVariants.begin(); it != gShaderVariants.end(); ++it)
+    {
+        if (!it->second.isReady && !it->second.hasFailed)
+            success &= UFinishShaderVariant(it->first, it->second);
+    }
+    UAssignMaterialPrograms();
+    return success;
+}
+
+
+void UDestroyShaderVariants()
+{
+    for (std::unordered_map<GLuint, ShaderVariant>::const_iterator it = gShaderVariants.begin(); it != gShaderVariants.end(); ++it)
+    {
+        // A compile still in flight at exit owns its shaders too
+        glDeleteShader(it->second.vertexShaderId);
+        glDeleteShader(it->second.fragmentShaderId);
+        UDestroyShaderProgram(it->second.programId);
+    }
+    gShaderVariants.clear();
+    gPendingShaderVariants = 0;
+}
+
+
+// Compiles the deferred lighting program and the empty vertex array of its fullscreen triangle; the G-buffer is
+// created on first use, at the viewport size
+bool UCreateDeferredRenderer()
+{
+    // Same lighting as the lit scene variants; materials without specular have zero intensity
+    const GLuint features = SHADER_LIGHTING | SHADER_SPECULAR;
+    std::string vertexSource = UBuildShaderSource(features, deferredLightingVertexShaderSource);
+    std::string fragmentSource = UBuildShaderSource(features, sceneLightingShaderSource) + deferredLightingFragmentShaderSource;
+    if (!UCreateCachedShaderProgram(vertexSource, fragmentSource, gDeferredLightingProgramId))
+        return false;
+
+    const char* const samplers[] = { "uGBufferPosition", "uGBufferNormal", "uGBufferColor", "uGBufferDepth" };
+    for (int i = 0; i < 4; ++i)
+        USetUniform(UGetUniformLocation(gDeferredLightingProgramId, samplers[i]), GLint(GBUFFER_TEXTURE_UNIT - GL_TEXTURE0) + i);
+    USetUniform(UGetUniformLocation(gDeferredLightingProgramId, "uShadowMaps"), GLint(SHADOW_TEXTURE_UNIT - GL_TEXTURE0));
+
+    glGenVertexArrays(1, &gFullscreenVao);
+    gGBuffer = GLGBuffer();
+    return true;
+}
+
+
+// Switches the opaque pass between the forward and the deferred renderer. The deferred variants have no fallback,
+// so switching to it waits for them (they were submitted with the others at startup).
+bool USetDeferredShading(bool enabled)
+{
+    for (int i = 0; enabled && i < MATERIAL_COUNT; ++i)
+    {
+        ShaderVariant variant;
+        if (!UGetShaderVariant(gMaterials[i].deferredFeatures, variant))
+            return false;
+    }
+
+    gDeferredShading = enabled;
+    UAssignMaterialPrograms();
+
+    cout << "INFO: " << (enabled ? "Deferred" : "Forward") << " renderer" << endl;
+    return true;
+}
+
+
+// Recreates the G-buffer when the viewport size changed; the bound framebuffer is left as it was
+bool UResizeGBuffer(int width, int height, GLGBuffer& gbuffer)
+{
+    if (gbuffer.fbo != 0 && gbuffer.width == width && gbuffer.height == height)
+        return true;
+    UDestroyGBuffer(gbuffer);
+
+    GLint sceneFramebuffer = 0;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &sceneFramebuffer);
+
+    gbuffer.width = width;
+    gbuffer.height = height;
+    glGenFramebuffers(1, &gbuffer.fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, gbuffer.fbo);
+
+    const GLenum formats[4] = { GL_RGBA32F, GL_RGBA16F, GL_RGBA8, GL_DEPTH_COMPONENT24 };
+    const GLenum attachments[4] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2, GL_DEPTH_ATTACHMENT };
+    GLuint* textures[4] = { &gbuffer.positionTexture, &gbuffer.normalTexture, &gbuffer.colorTexture, &gbuffer.depthTexture };
+    for (int i = 0; i < 4; ++i)
+    {
+        // Read back with texelFetch only, one texel per pixel
+        glGenTextures(1, textures[i]);
+        glBindTexture(GL_TEXTURE_2D, *textures[i]);
+        glTexStorage2D(GL_TEXTURE_2D, 1, formats[i], width, height);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, attachments[i], GL_TEXTURE_2D, *textures[i], 0);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+    glDrawBuffers(3, attachments);
+
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glBindFramebuffer(GL_FRAMEBUFFER, sceneFramebuffer);
+
+    if (status != GL_FRAMEBUFFER_COMPLETE)
+    {
+        cout << "ERROR::FRAMEBUFFER::INCOMPLETE G-buffer (0x" << hex << status << dec << ")" << endl;
+        UDestroyGBuffer(gbuffer);
+        return false;
+    }
+
+    cout << "INFO: Created " << width << "x" << height << " G-buffer" << endl;
+    return true;
+}
+
+
+void UDestroyGBuffer(GLGBuffer& gbuffer)
+{
+    glDeleteFramebuffers(1, &gbuffer.fbo);
+    glDeleteTextures(1, &gbuffer.positionTexture);
+    glDeleteTextures(1, &gbuffer.normalTexture);
+    glDeleteTextures(1, &gbuffer.colorTexture);
+    glDeleteTextures(1, &gbuffer.depthTexture);
+    gbuffer = GLGBuffer();
+}
+
+
+void UDestroyDeferredRenderer()
+{
+    UDestroyGBuffer(gGBuffer);
+    glDeleteVertexArrays(1, &gFullscreenVao);
+    UDestroyShaderProgram(gDeferredLightingProgramId);
+}
+
+
+// Compiles the trivial program of the depth pre-pass
+bool UCreateDepthPrepass()
+{
+    if (!UCreateCachedShaderProgram(depthOnlyVertexShaderSource, depthOnlyFragmentShaderSource, gDepthOnlyProgramId))
+        return false;
+
+    if (gOptions.depthPrepass)
+        cout << "INFO: Depth pre-pass enabled" << endl;
+    return true;
+}
+
+
+// Compiles the shadow caster program and creates both cube map arrays and the framebuffer their faces are rendered
+// through; with --no-shadows nothing is created
+bool UCreateShadowMaps(int resolution, GLShadowMaps& maps)
+{
+    static_assert(SHADOW_LIGHT_COUNT == sizeof(LightBlock::shadowLights) / sizeof(glm::vec4), "The Lights block has a position per shadow-casting light");
+
+    maps = GLShadowMaps();
+    if (!gOptions.shadows)
+    {
+        cout << "INFO: Shadows disabled" << endl;
+        return true;
+    }
+
+    GLint maxSize = 0;
+    glGetIntegerv(GL_MAX_CUBE_MAP_TEXTURE_SIZE, &maxSize);
+    if (resolution > maxSize)
+    {
+        cout << "Shadow map resolution " << resolution << " exceeds the largest cube map size " << maxSize << endl;
+        return false;
+    }
+
+    if (!UCreateCachedShaderProgram(shadowCasterVertexShaderSource, shadowCasterFragmentShaderSource, gShadowCasterProgramId))
+        return false;
+    UCacheUniformLocations(gShadowCasterProgramId, gShadowCasterUniforms);
+
+    GLint sceneFramebuffer = 0;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &sceneFramebuffer);
+
+    maps.resolution = resolution;
+    GLuint* textures[2] = { &maps.depthTexture, &maps.staticTexture };
+    for (int i = 0; i < 2; ++i)
+    {
+        glGenTextures(1, textures[i]);
+        glBindTexture(GL_TEXTURE_CUBE_MAP_ARRAY, *textures[i]);
+        glTexStorage3D(GL_TEXTURE_CUBE_MAP_ARRAY, 1, GL_DEPTH_COMPONENT32F, resolution, resolution, SHADOW_LIGHT_COUNT * CUBE_FACE_COUNT);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    }
+
+    // Each lookup compares against four texels in hardware, on top of the filter taps
+    glBindTexture(GL_TEXTURE_CUBE_MAP_ARRAY, maps.depthTexture);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+    glTexParameteri(GL_TEXTURE_CUBE_MAP_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+    glBindTexture(GL_TEXTURE_CUBE_MAP_ARRAY, 0);
+
+    // Depth only; the layer attached changes with every face rendered
+    glGenFramebuffers(1, &maps.fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, maps.fbo);
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+    glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, maps.depthTexture, 0, 0);
+
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glBindFramebuffer(GL_FRAMEBUFFER, sceneFramebuffer);
+
+    if (status != GL_FRAMEBUFFER_COMPLETE)
+    {
+        cout << "ERROR::FRAMEBUFFER::INCOMPLETE shadow maps (0x" << hex << status << dec << ")" << endl;
+        UDestroyShadowMaps(maps);
+        return false;
+    }
+
+    cout << "INFO: Shadow maps: " << SHADOW_LIGHT_COUNT << " cubes of " << resolution << "x" << resolution << ", "
+         << gOptions.shadowTaps << " filter taps" << endl;
+    return true;
+}
+
+
+void UDestroyShadowMaps(GLShadowMaps& maps)
+{
+    glDeleteFramebuffers(1, &maps.fbo);
+    glDeleteTextures(1, &maps.depthTexture);
+    glDeleteTextures(1, &maps.staticTexture);
+    UDestroyShaderProgram(gShadowCasterProgramId);
+    gShadowCasterProgramId = 0;
+    maps = GLShadowMaps();
+}
+
+
+// Recomputes the model matrices and world bounds of every entity
+void UUpdateEntityTransforms(EntityStore& store)
+{
+    size_t count = store.positions.size();
+
+    // translate(position) * scale(scale), written out directly
+    for (size_t i = 0; i < count; ++i)
+    {
+        const glm::vec3& position = store.positions[i];
+        const glm::vec3& scale = store.scales[i];
+        glm::mat4& model = store.models[i];
+        glm::mat3& normalMatrix = store.normalMatrices[i];
+
+        model[0] = glm::vec4(scale.x, 0.0f, 0.0f, 0.0f);
+        model[1] = glm::vec4(0.0f, scale.y, 0.0f, 0.0f);
+        model[2] = glm::vec4(0.0f, 0.0f, scale.z, 0.0f);
+        model[3] = glm::vec4(position, 1.0f);
+
+        // The inverse transpose of a scale is the reciprocal scale
+        normalMatrix[0] = glm::vec3(1.0f / scale.x, 0.0f, 0.0f);
+        normalMatrix[1] = glm::vec3(0.0f, 1.0f / scale.y, 0.0f);
+        normalMatrix[2] = glm::vec3(0.0f, 0.0f, 1.0f / scale.z);
+    }
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        const glm::vec4& local = store.localBounds[i];
+        const glm::vec3& position = store.positions[i];
+        const glm::vec3& scale = store.scales[i];
+
+        store.boundsX[i] = position.x + local.x * scale.x;
+        store.boundsY[i] = position.y + local.y * scale.y;
+        store.boundsZ[i] = position.z + local.z * scale.z;
+        store.boundsRadius[i] = local.w * std::max(std::max(fabs(scale.x), fabs(scale.y)), fabs(scale.z));
+    }
+}
+
+
+// Updates the level of detail of the entities whose mesh part has several
+void UUpdateEntityLods(EntityStore& store)
+{
+    for (size_t i = 0; i < store.positions.size(); ++i)
+    {
+        const GLMeshPart& meshPart = gMesh.parts[store.parts[i]];
+        if (meshPart.nLods < 2)
+            continue;
+
+        glm::vec3 center(store.boundsX[i], store.boundsY[i], store.boundsZ[i]);
+        store.lods[i] = USelectLod(meshPart, UProjectedRadius(center, store.boundsRadius[i]), store.lods[i]);
+    }
+}
+
+
+// Packs the draw state of an item so that sorting groups state changes and orders each group front to back
+uint64_t UMakeSortKey(const Material& material, MeshPart part, int lod, float depth)
+{
+    // Non-negative floats compare like their bit patterns
+    GLuint depthBits;
+    float clampedDepth = std::max(depth, 0.0f);
+    memcpy(&depthBits, &clampedDepth, sizeof(depthBits));
+
+    return (uint64_t(material.pass) << SORT_KEY_PASS_SHIFT)
+         | (uint64_t(material.programKey & 0xFF) << SORT_KEY_PROGRAM_SHIFT)
+         | (uint64_t(material.textureKey & 0xFFF) << SORT_KEY_TEXTURE_SHIFT)
+         | (uint64_t((part * MAX_LOD_LEVELS + lod) & 0xFF) << SORT_KEY_MESH_SHIFT)
+         | depthBits;
+}
+
+
+// Extracts the frustum planes from a view-projection matrix (Gribb and Hartmann); works for
+// perspective and orthographic projections alike
+void UExtractFrustum(const glm::mat4& viewProjection, Frustum& frustum)
+{
+    // Rows of the matrix (glm matrices are indexed by column)
+    glm::vec4 rows[4];
+    for (int i = 0; i < 4; ++i)
+        rows[i] = glm::vec4(viewProjection[0][i], viewProjection[1][i], viewProjection[2][i], viewProjection[3][i]);
+
+    frustum.planes[0] = rows[3] + rows[0];  // Left
+    frustum.planes[1] = rows[3] - rows[0];  // Right
+    frustum.planes[2] = rows[3] + rows[1];  // Bottom
+    frustum.planes[3] = rows[3] - rows[1];  // Top
+    frustum.planes[4] = rows[3] + rows[2];  // Near
+    frustum.planes[5] = rows[3] - rows[2];  // Far
+
+    for (int i = 0; i < 6; ++i)
+        frustum.planes[i] = frustum.planes[i] / glm::length(glm::vec3(frustum.planes[i]));
+}
+
+
+// Lists the entities whose world bounding sphere is not entirely behind one of the frustum planes, through the
+// hierarchy unless disabled. The flat path tests four spheres at once with SSE2 when available.
+void UCullEntities(const EntityStore& store, const Frustum& frustum, std::vector<GLuint>& visible)
+{
+    size_t count = store.positions.size();
+    visible.clear();
+
+    if (!gOptions.frustumCulling)
+    {
+        for (size_t i = 0; i < count; ++i)
+            visible.push_back(GLuint(i));
+        return;
+    }
+
+    if (gOptions.useBvh && !gBvh.nodes.empty())
+    {
+        UCullBvh(gBvh, store, frustum, visible);
+        return;
+    }
+
+    size_t i = 0;
+
+#ifdef USE_SSE2
+    __m128 planeX[6], planeY[6], planeZ[6], planeW[6];
+    for (int p = 0; p < 6; ++p)
+    {
+        planeX[p] = _mm_set1_ps(frustum.planes[p].x);
+        planeY[p] = _mm_set1_ps(frustum.planes[p].y);
+        planeZ[p] = _mm_set1_ps(frustum.planes[p].z);
+        planeW[p] = _mm_set1_ps(frustum.planes[p].w);
+    }
+
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128 x = _mm_loadu_ps(&store.boundsX[i]);
+        __m128 y = _mm_loadu_ps(&store.boundsY[i]);
+        __m128 z = _mm_loadu_ps(&store.boundsZ[i]);
+        __m128 negativeRadius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(&store.boundsRadius[i]));
+
+        // A sphere is visible while its signed distance to every plane is at least -radius
+        __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        for (int p = 0; p < 6; ++p)
+        {
+            __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(planeX[p], x), _mm_mul_ps(planeY[p], y)),
+                                         _mm_add_ps(_mm_mul_ps(planeZ[p], z), planeW[p]));
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, negativeRadius));
+        }
+
+        int mask = _mm_movemask_ps(inside);
+        for (int lane = 0; lane < 4; ++lane)
+        {
+            if (mask & (1 << lane))
+                visible.push_back(GLuint(i + lane));
+        }
+    }
+#endif
+
+    // Remaining entities (all of them without SSE2)
+    for (; i < count; ++i)
+    {
+        glm::vec3 center(store.boundsX[i], store.boundsY[i], store.boundsZ[i]);
+
+        bool inside = true;
+        for (int p = 0; p < 6 && inside; ++p)
+            inside = glm::dot(glm::vec3(frustum.planes[p]), center) + frustum.planes[p].w >= -store.boundsRadius[i];
+
+        if (inside)
+            visible.push_back(GLuint(i));
+    }
+}
+
+
+// Moves an entity and queues it for the next hierarchy refit; its first move takes it out of the cached shadow casters
+void USetEntityPosition(EntityStore& store, GLuint entity, const glm::vec3& position)
+{
+    store.positions[entity] = position;
+    gMovedEntities.push_back(entity);
+
+    if (!store.isDynamic[entity])
+    {
+        store.isDynamic[entity] = true;
+        ++store.staticVersion;
+    }
+}
+
+
+// Box around the world bounding sphere of an entity
+static void UEntityBox(const EntityStore& store, GLuint entity, glm::vec3& boxMin, glm::vec3& boxMax)
+{
+    glm::vec3 center(store.boundsX[entity], store.boundsY[entity], store.boundsZ[entity]);
+    glm::vec3 extent(store.boundsRadius[entity]);
+
+    boxMin = center - extent;
+    boxMax = center + extent;
+}
+
+
+// Recomputes the box of a node from its children, or from its items for a leaf
+static void UUpdateBvhNodeBounds(const EntityStore& store, Bvh& bvh, GLint nodeIndex)
+{
+    BvhNode& node = bvh.nodes[nodeIndex];
+
+    if (node.left >= 0)
+    {
+        node.boundsMin = glm::min(bvh.nodes[node.left].boundsMin, bvh.nodes[node.right].boundsMin);
+        node.boundsMax = glm::max(bvh.nodes[node.left].boundsMax, bvh.nodes[node.right].boundsMax);
+        return;
+    }
+
+    node.boundsMin = glm::vec3(1e30f);
+    node.boundsMax = glm::vec3(-1e30f);
+    for (GLuint i = node.firstItem; i < node.firstItem + node.nItems; ++i)
+    {
+        glm::vec3 boxMin, boxMax;
+        UEntityBox(store, bvh.items[i], boxMin, boxMax);
+        node.boundsMin = glm::min(node.boundsMin, boxMin);
+        node.boundsMax = glm::max(node.boundsMax, boxMax);
+    }
+}
+
+
+// Splits the items of a node at the median along the longest axis of their centers until leaves are small enough
+static GLint UBuildBvhNode(const EntityStore& store, Bvh& bvh, GLint parent, GLuint firstItem, GLuint nItems)
+{
+    GLint nodeIndex = GLint(bvh.nodes.size());
+    BvhNode node = { glm::vec3(0.0f), glm::vec3(0.0f), -1, -1, firstItem, nItems };
+    bvh.nodes.push_back(node);
+    bvh.parents.push_back(parent);
+
+    if (nItems <= GLuint(BVH_MAX_LEAF_ITEMS))
+    {
+        for (GLuint i = firstItem; i < firstItem + nItems; ++i)
+            bvh.entityLeaves[bvh.items[i]] = nodeIndex;
+
+        UUpdateBvhNodeBounds(store, bvh, nodeIndex);
+        return nodeIndex;
+    }
+
+    glm::vec3 centerMin(1e30f), centerMax(-1e30f);
+    for (GLuint i = firstItem; i < firstItem + nItems; ++i)
+    {
+        glm::vec3 center(store.boundsX[bvh.items[i]], store.boundsY[bvh.items[i]], store.boundsZ[bvh.items[i]]);
+        centerMin = glm::min(centerMin, center);
+        centerMax = glm::max(centerMax, center);
+    }
+
+    glm::vec3 size = centerMax - centerMin;
+    const std::vector<float>& axis = size.x >= size.y && size.x >= size.z ? store.boundsX : (size.y >= size.z ? store.boundsY : store.boundsZ);
+
+    GLuint half = nItems / 2;
+    std::nth_element(bvh.items.begin() + firstItem, bvh.items.begin() + firstItem + half, bvh.items.begin() + firstItem + nItems,
+        [&axis](GLuint a, GLuint b) { return axis[a] < axis[b]; });
+
+    GLint left = UBuildBvhNode(store, bvh, nodeIndex, firstItem, half);
+    GLint right = UBuildBvhNode(store, bvh, nodeIndex, firstItem + half, nItems - half);
+
+    bvh.nodes[nodeIndex].left = left;
+    bvh.nodes[nodeIndex].right = right;
+    UUpdateBvhNodeBounds(store, bvh, nodeIndex);
+    return nodeIndex;
+}
+
+
+// Builds the hierarchy over the current world bounds of every entity
+void UBuildBvh(const EntityStore& store, Bvh& bvh)
+{
+    GLuint count = GLuint(store.positions.size());
+
+    bvh.nodes.clear();
+    bvh.parents.clear();
+    bvh.items.resize(count);
+    bvh.entityLeaves.assign(count, -1);
+    for (GLuint i = 0; i < count; ++i)
+        bvh.items[i] = i;
+
+    if (count > 0)
+        UBuildBvhNode(store, bvh, -1, 0, count);
+
+    gMovedEntities.clear();
+}
+
+
+// Grows or shrinks the boxes on the path from each moved entity's leaf to the root; the tree shape is kept.
+// Entities created since the last build trigger a full rebuild.
+void URefitBvh(const EntityStore& store, Bvh& bvh, std::vector<GLuint>& movedEntities)
+{
+    if (bvh.entityLeaves.size() != store.positions.size())
+    {
+        UBuildBvh(store, bvh);
+        return;
+    }
+
+    for (size_t i = 0; i < movedEntities.size(); ++i)
+    {
+        for (GLint node = bvh.entityLeaves[movedEntities[i]]; node >= 0; node = bvh.parents[node])
+            UUpdateBvhNodeBounds(store, bvh, node);
+    }
+
+    movedEntities.clear();
+}
+
+
+// Appends the entities inside the frustum. Subtrees whose box is entirely inside are taken whole,
+// boxes entirely behind a plane are skipped, and leaf items are tested one sphere at a time.
+void UCullBvh(const Bvh& bvh, const EntityStore& store, const Frustum& frustum, std::vector<GLuint>& visible)
+{
+    std::vector<GLint> stack(1, 0);
+
+    while (!stack.empty())
+    {
+        const BvhNode& node = bvh.nodes[stack.back()];
+        stack.pop_back();
+        ++gFrameStats.bvhNodesVisited;
+
+        bool outside = false, fullyInside = true;
+        for (int p = 0; p < 6 && !outside; ++p)
+        {
+            glm::vec3 normal(frustum.planes[p]);
+
+            // Box corners farthest along and against the plane normal
+            glm::vec3 positive(normal.x >= 0.0f ? node.boundsMax.x : node.boundsMin.x,
+                               normal.y >= 0.0f ? node.boundsMax.y : node.boundsMin.y,
+                               normal.z >= 0.0f ? node.boundsMax.z : node.boundsMin.z);
+            glm::vec3 negative(normal.x >= 0.0f ? node.boundsMin.x : node.boundsMax.x,
+                               normal.y >= 0.0f ? node.boundsMin.y : node.boundsMax.y,
+                               normal.z >= 0.0f ? node.boundsMin.z : node.boundsMax.z);
+
+            outside = glm::dot(normal, positive) + frustum.planes[p].w < 0.0f;
+            fullyInside = fullyInside && glm::dot(normal, negative) + frustum.planes[p].w >= 0.0f;
+        }
+
+        if (outside)
+            continue;
+
+        if (fullyInside)
+        {
+            visible.insert(visible.end(), bvh.items.begin() + node.firstItem, bvh.items.begin() + node.firstItem + node.nItems);
+            continue;
+        }
+
+        if (node.left >= 0)
+        {
+            stack.push_back(node.left);
+            stack.push_back(node.right);
+            continue;
+        }
+
+        for (GLuint i = node.firstItem; i < node.firstItem + node.nItems; ++i)
+        {
+            GLuint entity = bvh.items[i];
+            glm::vec3 center(store.boundsX[entity], store.boundsY[entity], store.boundsZ[entity]);
+
+            bool inside = true;
+            for (int p = 0; p < 6 && inside; ++p)
+                inside = glm::dot(glm::vec3(frustum.planes[p]), center) + frustum.planes[p].w >= -store.boundsRadius[entity];
+
+            if (inside)
+                visible.push_back(entity);
+        }
+    }
+}
+
+
+// Returns the entity whose bounding sphere the ray enters first, or -1; distance receives the hit distance
+GLint UPickEntity(const Bvh& bvh, const EntityStore& store, const glm::vec3& origin, const glm::vec3& direction, float& distance)
+{
+    GLint closest = -1;
+    distance = 1e30f;
+    if (bvh.nodes.empty())
+        return closest;
+
+    glm::vec3 inverseDirection(1.0f / direction.x, 1.0f / direction.y, 1.0f / direction.z);
+    std::vector<GLint> stack(1, 0);
+
+    while (!stack.empty())
+    {
+        const BvhNode& node = bvh.nodes[stack.back()];
+        stack.pop_back();
+
+        // Slab test, skipping boxes that start beyond the closest hit so far
+        glm::vec3 t0 = (node.boundsMin - origin) * inverseDirection;
+        glm::vec3 t1 = (node.boundsMax - origin) * inverseDirection;
+        glm::vec3 tNear = glm::min(t0, t1);
+        glm::vec3 tFar = glm::max(t0, t1);
+        float enter = std::max(std::max(tNear.x, tNear.y), std::max(tNear.z, 0.0f));
+        float exit = std::min(std::min(tFar.x, tFar.y), tFar.z);
+        if (enter > exit || enter > distance)
+            continue;
+
+        if (node.left >= 0)
+        {
+            stack.push_back(node.left);
+            stack.push_back(node.right);
+            continue;
+        }
+
+        for (GLuint i = node.firstItem; i < node.firstItem + node.nItems; ++i)
+        {
+            GLuint entity = bvh.items[i];
+            glm::vec3 toCenter = glm::vec3(store.boundsX[entity], store.boundsY[entity], store.boundsZ[entity]) - origin;
+            float radius = store.boundsRadius[entity];
+
+            // Ray/sphere intersection with a normalized direction
+            float along = glm::dot(toCenter, direction);
+            float squaredMiss = glm::dot(toCenter, toCenter) - along * along;
+            if (squaredMiss > radius * radius)
+                continue;
+
+            float hit = along - sqrt(radius * radius - squaredMiss);
+            if (hit < 0.0f)
+                hit = 0.0f;     // Origin inside the sphere
+            if (along + sqrt(radius * radius - squaredMiss) >= 0.0f && hit < distance)
+            {
+                distance = hit;
+                closest = GLint(entity);
+            }
+        }
+    }
+
+    return closest;
+}
+
+
+// Lists the entities whose bounding sphere overlaps a sphere, e.g. the range of a light
+void UQueryBvhSphere(const Bvh& bvh, const EntityStore& store, const glm::vec3& center, float radius, std::vector<GLuint>& entities)
+{
+    entities.clear();
+    if (bvh.nodes.empty())
+        return;
+
+    std::vector<GLint> stack(1, 0);
+    while (!stack.empty())
+    {
+        const BvhNode& node = bvh.nodes[stack.back()];
+        stack.pop_back();
+
+        // Distance from the sphere center to the box
+        glm::vec3 closestPoint = glm::clamp(center, node.boundsMin, node.boundsMax);
+        glm::vec3 offset = closestPoint - center;
+        if (glm::dot(offset, offset) > radius * radius)
+            continue;
+
+        if (node.left >= 0)
+        {
+            stack.push_back(node.left);
+            stack.push_back(node.right);
+            continue;
+        }
+
+        for (GLuint i = node.firstItem; i < node.firstItem + node.nItems; ++i)
+        {
+            GLuint entity = bvh.items[i];
+            glm::vec3 toEntity = glm::vec3(store.boundsX[entity], store.boundsY[entity], store.boundsZ[entity]) - center;
+            float reach = radius + store.boundsRadius[entity];
+            if (glm::dot(toEntity, toEntity) <= reach * reach)
+                entities.push_back(entity);
+        }
+    }
+}
+
+
+// Sets the light mask of every entity from one range query per light; point lights are binned into clusters instead
+void UAssignEntityLights(const Bvh& bvh, EntityStore& store, std::vector<GLuint>& litEntities)
+{
+    std::fill(store.lightMasks.begin(), store.lightMasks.end(), 0u);
+
+    UQueryBvhSphere(bvh, store, gKeyLightPosition, KEY_LIGHT_RANGE, litEntities);
+    for (size_t i = 0; i < litEntities.size(); ++i)
+        store.lightMasks[litEntities[i]] |= LIGHT_MASK_KEY_LIGHT;
+}
+
+
+// Reads the occlusion results that have arrived, then drops the entities last found hidden from the visible list and
+// picks the entities to query this frame. Entities back in the frustum after an absence are drawn until queried anew.
+void UCullOccludedEntities(const EntityStore& store, const Frustum& frustum, GLOcclusionQueries& occlusion, std::vector<GLuint>& visible)
+{
+    size_t count = store.positions.size();
+    if (occlusion.queries.size() < count)
+    {
+        size_t first = occlusion.queries.size();
+        occlusion.queries.resize(count);
+        glGenQueries(GLsizei(count - first), &occlusion.queries[first]);
+        occlusion.isPending.resize(count, false);
+        occlusion.isOccluded.resize(count, false);
+        occlusion.lastFrames.resize(count, 0);
+        occlusion.enterFrames.resize(count, 0);
+        occlusion.queryFrames.resize(count, 0);
+    }
+    ++occlusion.frame;
+
+    // Never waits: a result still in flight is simply read in a later frame
+    size_t nPending = 0;
+    for (size_t i = 0; i < occlusion.pending.size(); ++i)
+    {
+        GLuint entity = occlusion.pending[i];
+        GLuint available = GL_FALSE;
+        glGetQueryObjectuiv(occlusion.queries[entity], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available)
+        {
+            occlusion.pending[nPending++] = entity;
+            continue;
+        }
+
+        GLuint anySamplesPassed = GL_TRUE;
+        glGetQueryObjectuiv(occlusion.queries[entity], GL_QUERY_RESULT, &anySamplesPassed);
+        if (occlusion.queryFrames[entity] >= occlusion.enterFrames[entity])
+            occlusion.isOccluded[entity] = !anySamplesPassed;
+        occlusion.isPending[entity] = false;
+    }
+    occlusion.pending.resize(nPending);
+
+    const glm::vec4& nearPlane = frustum.planes[4];
+    occlusion.issued.clear();
+
+    size_t nVisible = 0;
+    for (size_t i = 0; i < visible.size(); ++i)
+    {
+        GLuint entity = visible[i];
+        bool isStale = occlusion.lastFrames[entity] + 1 != occlusion.frame;
+        occlusion.lastFrames[entity] = occlusion.frame;
+        if (isStale)
+        {
+            occlusion.isOccluded[entity] = false;
+            occlusion.enterFrames[entity] = occlusion.frame;
+        }
+
+        // A box cut by the near plane loses its front faces and could pass for hidden; such entities are always drawn
+        glm::vec3 center(store.boundsX[entity], store.boundsY[entity], store.boundsZ[entity]);
+        float radius = store.boundsRadius[entity];
+        if (glm::dot(glm::vec3(nearPlane), center) + nearPlane.w < 1.7320508f * radius + OCCLUSION_NEAR_MARGIN)
+        {
+            occlusion.isOccluded[entity] = false;
+            visible[nVisible++] = entity;
+            continue;
+        }
+
+        bool isOccluded = occlusion.isOccluded[entity];
+        if (!occlusion.isPending[entity] && (isOccluded || isStale || (occlusion.frame + entity) % OCCLUSION_VISIBLE_INTERVAL == 0))
+            occlusion.issued.push_back(entity);
+
+        if (isOccluded)
+            ++gFrameStats.occludedEntities;
+        else
+            visible[nVisible++] = entity;
+    }
+    visible.resize(nVisible);
+}
+
+
+// Appends a box instance per entity queried this frame: the cube part scaled over the entity's world bounding sphere
+void UAddOcclusionBoxes(const EntityStore& store, GLOcclusionQueries& occlusion, GLInstanceBuffer& instances)
+{
+    const GLMeshPart& cube = gMesh.parts[PART_CUBE];
+    glm::vec3 cubeCenter = 0.5f * (cube.boundsMin + cube.boundsMax);
+    glm::vec3 cubeSize = cube.boundsMax - cube.boundsMin;
+
+    occlusion.firstInstance = GLuint(instances.instances.size());
+    for (size_t i = 0; i < occlusion.issued.size(); ++i)
+    {
+        GLuint entity = occlusion.issued[i];
+        glm::vec3 center(store.boundsX[entity], store.boundsY[entity], store.boundsZ[entity]);
+        glm::vec3 scale = glm::vec3(2.0f * store.boundsRadius[entity]) / cubeSize;
+
+        glm::mat4 model(1.0f);
+        model[0].x = scale.x;
+        model[1].y = scale.y;
+        model[2].z = scale.z;
+        model[3] = glm::vec4(center - scale * cubeCenter, 1.0f);
+        UAddInstance(instances, model, glm::mat3(1.0f), glm::vec4(1.0f), 0, 0);
+    }
+}
+
+
+// Draws the box of every entity picked this frame inside its own query, without writing color or depth
+void UIssueOcclusionQueries(GLOcclusionQueries& occlusion)
+{
+    UBeginPassTimer(PASS_OCCLUSION);
+
+    UUseProgram(gDepthOnlyProgramId);
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    glDepthMask(GL_FALSE);
+
+    for (size_t i = 0; i < occlusion.issued.size(); ++i)
+    {
+        GLuint entity = occlusion.issued[i];
+        glBeginQuery(GL_ANY_SAMPLES_PASSED_CONSERVATIVE, occlusion.queries[entity]);
+        UDrawSubMesh(gMesh, PART_CUBE, 0, occlusion.firstInstance + GLuint(i), 1);
+        glEndQuery(GL_ANY_SAMPLES_PASSED_CONSERVATIVE);
+
+        occlusion.isPending[entity] = true;
+        occlusion.queryFrames[entity] = occlusion.frame;
+        occlusion.pending.push_back(entity);
+    }
+
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    glDepthMask(GL_TRUE);
+    gFrameStats.occlusionQueries = GLuint(occlusion.issued.size());
+
+    UEndPassTimer();
+}
+
+
+void UDestroyOcclusionQueries(GLOcclusionQueries& occlusion)
+{
+    if (!occlusion.queries.empty())
+        glDeleteQueries(GLsizei(occlusion.queries.size()), occlusion.queries.data());
+    occlusion = GLOcclusionQueries();
+}
+
+
+// Collects one item per listed entity and sorts them by key
+void UBuildRenderQueue(const EntityStore& store, const std::vector<GLuint>& entities, std::vector<RenderItem>& queue)
+{
+    queue.resize(entities.size());
+
+    for (size_t i = 0; i < queue.size(); ++i)
+    {
+        GLuint entity = entities[i];
+        float depth = glm::length(glm::vec3(store.boundsX[entity], store.boundsY[entity], store.boundsZ[entity]) - gCamera.Position);
+
+        queue[i].key = UMakeSortKey(gMaterials[store.materials[entity]], store.parts[entity], store.lods[entity], depth);
+        queue[i].entity = entity;
+    }
+
+    std::sort(queue.begin(), queue.end());
+}
+
+
+// Writes the instances in queue order and merges items whose keys differ only by depth into one batch
+void UBuildDrawBatches(const EntityStore& store, const std::vector<RenderItem>& queue, GLInstanceBuffer& instances, std::vector<DrawBatch>& batches)
+{
+    instances.instances.clear();
+    batches.clear();
+
+    for (size_t i = 0; i < queue.size(); ++i)
+    {
+        GLuint entity = queue[i].entity;
+        GLuint instance = UAddInstance(instances, store.models[entity], store.normalMatrices[entity], store.tints[entity], store.lightMasks[entity], store.materials[entity]);
+
+        if (i > 0 && (queue[i].key >> SORT_KEY_MESH_SHIFT) == (queue[i - 1].key >> SORT_KEY_MESH_SHIFT))
+        {
+            ++batches.back().nInstances;
+            continue;
+        }
+
+        const Material& material = gMaterials[store.materials[entity]];
+        DrawBatch batch = { material.pass, material.programId, material.textureId, store.parts[entity], store.lods[entity], instance, 1 };
+        batches.push_back(batch);
+    }
+}
+
+
+// Re-sorts the opaque items of the queue strictly front to back for the depth pre-pass and appends their instances;
+// consecutive items of the same mesh range still share a draw
+void UBuildDepthBatches(const EntityStore& store, const std::vector<RenderItem>& queue, std::vector<RenderItem>& depthQueue, GLInstanceBuffer& instances, std::vector<DrawBatch>& batches)
+{
+    depthQueue.clear();
+    for (size_t i = 0; i < queue.size(); ++i)
+    {
+        if (gMaterials[store.materials[queue[i].entity]].pass != PASS_OPAQUE)
+            continue;
+
+        // Depth from the low bits of the queue key, then the mesh field
+        RenderItem item = { ((queue[i].key & 0xFFFFFFFF) << 8) | ((queue[i].key >> SORT_KEY_MESH_SHIFT) & 0xFF), queue[i].entity };
+        depthQueue.push_back(item);
+    }
+    std::sort(depthQueue.begin(), depthQueue.end());
+
+    batches.clear();
+    for (size_t i = 0; i < depthQueue.size(); ++i)
+    {
+        GLuint entity = depthQueue[i].entity;
+        GLuint instance = UAddInstance(instances, store.models[entity], store.normalMatrices[entity], store.tints[entity], store.lightMasks[entity], store.materials[entity]);
+
+        if (i > 0 && (depthQueue[i].key & 0xFF) == (depthQueue[i - 1].key & 0xFF))
+        {
+            ++batches.back().nInstances;
+            continue;
+        }
+
+        DrawBatch batch = { PASS_DEPTH_PREPASS, gDepthOnlyProgramId, 0, store.parts[entity], store.lods[entity], instance, 1 };
+        batches.push_back(batch);
+    }
+}
+
+
+// View and projection of one face of a light's shadow cube, in the face order and orientation cube map lookups use
+glm::mat4 UShadowFaceViewProjection(const glm::vec4& light, int face)
+{
+    static const glm::vec3 directions[CUBE_FACE_COUNT] = {
+        glm::vec3(1.0f, 0.0f, 0.0f), glm::vec3(-1.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f),
+        glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f), glm::vec3(0.0f, 0.0f, -1.0f)
+    };
+    static const glm::vec3 ups[CUBE_FACE_COUNT] = {
+        glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f),
+        glm::vec3(0.0f, 0.0f, -1.0f), glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(0.0f, -1.0f, 0.0f)
+    };
+
+    glm::vec3 position(light);
+    return glm::perspective(glm::radians(90.0f), 1.0f, SHADOW_NEAR, light.w) * glm::lookAt(position, position + directions[face], ups[face]);
+}
+
+
+// Batches the shadow casters of each light per cube face and appends their instances. Casters are the entities within
+// the light's range, lamps excepted. The static ones are only batched when the light moved since last frame, which
+// draws them without the cache, or when the cache has to be re-rendered because it was dropped or the static set
+// changed.
+void UBuildShadowBatches(const EntityStore& store, const glm::vec4* lights, GLShadowMaps& maps, GLInstanceBuffer& instances)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<GLuint> casters;
+
+    for (int light = 0; light < SHADOW_LIGHT_COUNT; ++light)
+    {
+        // A cache for a moving light would be stale by the next frame, so it is dropped until the light stops. The first
+        // frame has no previous position and starts with a cache.
+        bool drawDirect = maps.lights[light].w > 0.0f && maps.lights[light] != lights[light];
+        bool rebuildStatic = !drawDirect && (!maps.isCacheValid[light] || maps.staticVersions[light] != store.staticVersion);
+        maps.drawDirect[light] = drawDirect;
+        maps.rebuildStatic[light] = rebuildStatic;
+        maps.lights[light] = lights[light];
+        maps.staticVersions[light] = store.staticVersion;
+        maps.isCacheValid[light] = !drawDirect;
+
+        // Lamps emit the light rather than block it; the rest is ordered by mesh range so a face's casters share draws
+        UQueryBvhSphere(gBvh, store, glm::vec3(lights[light]), lights[light].w, casters);
+        casters.erase(std::remove_if(casters.begin(), casters.end(), [&store](GLuint entity) {
+            return gMaterials[store.materials[entity]].pass == PASS_LAMPS;
+        }), casters.end());
+        std::sort(casters.begin(), casters.end(), [&store](GLuint a, GLuint b) {
+            return store.parts[a] * MAX_LOD_LEVELS + store.lods[a] < store.parts[b] * MAX_LOD_LEVELS + store.lods[b];
+        });
+
+        bool hasDynamicCasters = false;
+        for (int face = 0; face < CUBE_FACE_COUNT; ++face)
+        {
+            maps.staticBatches[light][face].clear();
+            maps.dynamicBatches[light][face].clear();
+
+            Frustum frustum;
+            UExtractFrustum(UShadowFaceViewProjection(lights[light], face), frustum);
+
+            for (size_t i = 0; i < casters.size(); ++i)
+            {
+                GLuint entity = casters[i];
+                bool isDynamic = store.isDynamic[entity];
+                if (!isDynamic && !drawDirect && !rebuildStatic)
+                    continue;
+
+                glm::vec3 center(store.boundsX[entity], store.boundsY[entity], store.boundsZ[entity]);
+                bool inside = true;
+                for (int p = 0; p < 6 && inside; ++p)
+                    inside = glm::dot(glm::vec3(frustum.planes[p]), center) + frustum.planes[p].w >= -store.boundsRadius[entity];
+                if (!inside)
+                    continue;
+
+                hasDynamicCasters |= isDynamic;
+                std::vector<DrawBatch>& batches = isDynamic ? maps.dynamicBatches[light][face] : maps.staticBatches[light][face];
+                GLuint instance = UAddInstance(instances, store.models[entity], store.normalMatrices[entity], store.tints[entity], store.lightMasks[entity], store.materials[entity]);
+
+                // Static and moving casters interleave in the instance buffer, so a batch only grows over consecutive instances
+                if (!batches.empty() && batches.back().part == store.parts[entity] && batches.back().lod == store.lods[entity]
+                    && batches.back().firstInstance + batches.back().nInstances == instance)
+                {
+                    ++batches.back().nInstances;
+                    continue;
+                }
+
+                DrawBatch batch = { PASS_SHADOWS, gShadowCasterProgramId, 0, store.parts[entity], store.lods[entity], instance, 1 };
+                batches.push_back(batch);
+            }
+        }
+
+        // A map that held moving casters last frame is restored from the cache even if none remain
+        maps.copyStatic[light] = !drawDirect && (rebuildStatic || hasDynamicCasters || maps.hadDynamicCasters[light]);
+        maps.hadDynamicCasters[light] = hasDynamicCasters;
+    }
+
+    gFrameStats.shadowBuildMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+
+void UDestroyMesh(GLMesh& mesh)
+{
+    glDeleteVertexArrays(1, &mesh.vao);
+    glDeleteBuffers(1, &mesh.vbo);
+    glDeleteBuffers(1, &mesh.ebo);
+}
+
+
+// Decodes an encoded image to RGBA8 and flips it; touches no GL state so it can run on any thread
+bool UDecodeImage(const std::vector<unsigned char>& bytes, DecodedImage& image)
+{
+    image.pixels = stbi_load_from_memory(bytes.data(), int(bytes.size()), &image.width, &image.height, &image.channels, 4);
+    if (!image.pixels)
+        return false;
+
+    flipImageVertically(image.pixels, image.width, image.height, 4);
+    return true;
+}
+
+
+// FNV-1a; identifies source images and their contents in the texture cache
+uint64_t UHashBytes(const void* data, size_t size)
+{
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+
+bool UReadFile(const std::string& filename, std::vector<unsigned char>& bytes)
+{
+    ifstream file(filename, ios::binary | ios::ate);
+    if (!file)
+        return false;
+
+    bytes.resize(size_t(file.tellg()));
+    file.seekg(0);
+    file.read(reinterpret_cast<char*>(bytes.data()), bytes.size());
+    return bool(file);
+}
+
+
+// Maps the image's texture cache file if it is still current, otherwise decodes the image, bakes the
+// cache file and writes it for the next run. Opaque textures (keepAlpha false) always get BC1 or RGBA8,
+// so textures sharing an array also share a format. Touches no GL state so it can run on any thread.
+bool UPrepareTexture(const std::string& filename, bool keepAlpha, TextureBlob& blob)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    blob = TextureBlob();
+
+    struct stat info;
+    if (stat(filename.c_str(), &info) != 0)
+        return false;
+
+    TextureCacheHeader source = {};
+    memcpy(source.magic, TEXTURE_CACHE_MAGIC, sizeof(source.magic));
+    source.version = TEXTURE_CACHE_VERSION;
+    source.pathHash = UHashBytes(filename.data(), filename.size());
+    source.sourceTime = int64_t(info.st_mtime);
+    source.sourceSize = uint64_t(info.st_size);
+    source.keepAlpha = keepAlpha ? 1 : 0;
+
+    // The cache is rebaked when the driver's S3TC support differs from the one it was baked for
+    bool canCompress = GLEW_EXT_texture_compression_s3tc != GL_FALSE;
+    std::string cacheFilename = filename + ".texcache";
+
+    if (gOptions.textureCache && UMapFile(cacheFilename, blob))
+    {
+        // Copied rather than referenced: the mapping is replaced when the header is refreshed below
+        TextureCacheHeader cached = {};
+        bool isValid = UIsTextureCacheValid(blob, source, canCompress);
+        if (isValid)
+            memcpy(&cached, blob.data, sizeof(cached));
+
+        // A touched but unchanged image (e.g. after a fresh checkout) still matches by content. Its new time
+        // and size are written back so the next run does not read and hash the image again.
+        if (isValid && (cached.sourceTime != source.sourceTime || cached.sourceSize != source.sourceSize))
+        {
+            std::vector<unsigned char> bytes;
+            isValid = UReadFile(filename, bytes) && UHashBytes(bytes.data(), bytes.size()) == cached.contentHash;
+
+            if (isValid)
+            {
+                cached.sourceTime = source.sourceTime;
+                cached.sourceSize = source.sourceSize;
+                UReleaseTextureBlob(blob);
+
+                fstream file(cacheFilename, ios::in | ios::out | ios::binary);
+                file.write(reinterpret_cast<const char*>(&cached), sizeof(cached));
+                file.close();
+                if (!file)
+                    cout << "INFO: Could not refresh texture cache " << cacheFilename << endl;
+
+                isValid = UMapFile(cacheFilename, blob) && UIsTextureCacheValid(blob, source, canCompress);
+            }
+        }
+
+        if (isValid)
+        {
+            blob.fromCache = true;
+            blob.prepareMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            return true;
+        }
+        UReleaseTextureBlob(blob);
+    }
+
+    std::vector<unsigned char> bytes;
+    if (!UReadFile(filename, bytes))
+        return false;
+    source.contentHash = UHashBytes(bytes.data(), bytes.size());
+
+    DecodedImage image;
+    if (!UDecodeImage(bytes, image))
+        return false;
+
+    bool hasAlpha = keepAlpha && (image.channels == 2 || image.channels == 4);
+    if (!canCompress)
+        source.format = GL_RGBA8;
+    else
+        source.format = hasAlpha ? GL_COMPRESSED_RGBA_S3TC_DXT5_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+
+    bool isBaked = UBakeTexture(image, source, blob.owned);
+    stbi_image_free(image.pixels);
+    if (!isBaked)
+        return false;
+
+    blob.data = blob.owned.data();
+    blob.size = blob.owned.size();
+
+    // Written under a temporary name so an interrupted run never leaves a truncated cache behind
+    if (gOptions.textureCache)
+    {
+        std::string tempFilename = cacheFilename + ".tmp";
+        ofstream file(tempFilename, ios::binary);
+        file.write(reinterpret_cast<const char*>(blob.data), blob.size);
+        file.close();
+
+        std::remove(cacheFilename.c_str());
+        if (!file || std::rename(tempFilename.c_str(), cacheFilename.c_str()) != 0)
+        {
+            std::remove(tempFilename.c_str());
+            cout << "INFO: Could not write texture cache " << cacheFilename << endl;
+        }
+    }
+
+    blob.prepareMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    return true;
+}
+
+
+// Checks a mapped cache file against the image it claims to hold: the header is read only once the blob
+// is known to contain it, and every level must have the mip chain's dimensions and its exact byte size
+// in the cached format, inside the file. Source time and size are left to the caller.
+bool UIsTextureCacheValid(const TextureBlob& blob, const TextureCacheHeader& source, bool canCompress)
+{
+    if (blob.size < sizeof(TextureCacheHeader))
+        return false;
+
+    const TextureCacheHeader& cached = *reinterpret_cast<const TextureCacheHeader*>(blob.data);
+    bool isCompressed = cached.format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT || cached.format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+
+    bool isValid = memcmp(cached.magic, TEXTURE_CACHE_MAGIC, sizeof(cached.magic)) == 0
+        && cached.version == TEXTURE_CACHE_VERSION
+        && cached.pathHash == source.pathHash
+        && cached.keepAlpha == source.keepAlpha
+        && (isCompressed || cached.format == GL_RGBA8) && isCompressed == canCompress
+        && cached.width > 0 && cached.height > 0
+        && cached.levelCount > 0 && cached.levelCount <= 32;
+    if (!isValid)
+        return false;
+
+    size_t tableEnd = sizeof(TextureCacheHeader) + size_t(cached.levelCount) * sizeof(TextureCacheLevel);
+    if (blob.size < tableEnd)
+        return false;
+
+    size_t blockSize = cached.format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT ? 16 : 8;
+    const TextureCacheLevel* levels = reinterpret_cast<const TextureCacheLevel*>(blob.data + sizeof(TextureCacheHeader));
+
+    for (uint32_t i = 0; i < cached.levelCount; ++i)
+    {
+        const TextureCacheLevel& level = levels[i];
+        uint32_t width = std::max(1u, cached.width >> i);
+        uint32_t height = std::max(1u, cached.height >> i);
+
+        uint64_t expectedSize = isCompressed ? uint64_t((width + 3) / 4) * ((height + 3) / 4) * blockSize
+                                             : uint64_t(width) * height * 4;
+
+        if (level.width != width || level.height != height || level.size != expectedSize
+            || level.offset < tableEnd || level.offset > blob.size || level.size > blob.size - level.offset)
+            return false;
+    }
+    return true;
+}
+
+// Builds a complete cache file: the mip chain down to 1x1, box-filtered like glGenerateMipmap,
+// each level stored in the header's format
+bool UBakeTexture(const DecodedImage& image, const TextureCacheHeader& source, std::vector<unsigned char>& file)
+{
+    if (image.width <= 0 || image.height <= 0)
+        return false;
+
+    bool isCompressed = source.format != GL_RGBA8;
+    bool hasAlpha = source.format == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+    size_t blockSize = hasAlpha ? 16 : 8;
+
+    std::vector<TextureCacheLevel> levels;
+    std::vector<unsigned char> payload;
+    std::vector<unsigned char> pixels(image.pixels, image.pixels + size_t(image.width) * image.height * 4);
+    std::vector<unsigned char> nextPixels;
+    int width = image.width;
+    int height = image.height;
+
+    for (;;)
+    {
+        TextureCacheLevel level;
+        level.width = uint32_t(width);
+        level.height = uint32_t(height);
+        level.offset = payload.size();
+
+        if (isCompressed)
+        {
+            int blocksX = (width + 3) / 4;
+            int blocksY = (height + 3) / 4;
+            payload.resize(payload.size() + size_t(blocksX) * blocksY * blockSize);
+            unsigned char* blocks = &payload[size_t(level.offset)];
+
+            for (int by = 0; by < blocksY; ++by)
+                for (int bx = 0; bx < blocksX; ++bx)
+                    UCompressBlock(pixels.data(), width, width, height, bx * 4, by * 4, hasAlpha,
+                                   blocks + (size_t(by) * blocksX + bx) * blockSize);
+        }
+        else
+            payload.insert(payload.end(), pixels.begin(), pixels.end());
+
+        level.size = payload.size() - level.offset;
+        levels.push_back(level);
+
+        if (width == 1 && height == 1)
+            break;
+
+        int nextWidth = std::max(1, width / 2);
+        int nextHeight = std::max(1, height / 2);
+        nextPixels.resize(size_t(nextWidth) * nextHeight * 4);
+
+        for (int y = 0; y < nextHeight; ++y)
+        {
+            const unsigned char* row0 = &pixels[size_t(std::min(2 * y, height - 1)) * width * 4];
+            const unsigned char* row1 = &pixels[size_t(std::min(2 * y + 1, height - 1)) * width * 4];
+            for (int x = 0; x < nextWidth; ++x)
+            {
+                int x0 = std::min(2 * x, width - 1) * 4;
+                int x1 = std::min(2 * x + 1, width - 1) * 4;
+                for (int c = 0; c < 4; ++c)
+                    nextPixels[(size_t(y) * nextWidth + x) * 4 + c] =
+                        (unsigned char)((row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2) / 4);
+            }
+        }
+
+        pixels.swap(nextPixels);
+        width = nextWidth;
+        height = nextHeight;
+    }
+
+    TextureCacheHeader header = source;
+    header.width = uint32_t(image.width);
+    header.height = uint32_t(image.height);
+    header.levelCount = uint32_t(levels.size());
+
+    size_t payloadStart = sizeof(TextureCacheHeader) + levels.size() * sizeof(TextureCacheLevel);
+    for (size_t i = 0; i < levels.size(); ++i)
+        levels[i].offset += payloadStart;
+
+    file.resize(payloadStart + payload.size());
+    memcpy(&file[0], &header, sizeof(header));
+    memcpy(&file[sizeof(header)], levels.data(), levels.size() * sizeof(TextureCacheLevel));
+    memcpy(&file[payloadStart], payload.data(), payload.size());
+    return true;
+}
+
+
+// Encodes the 4x4 block at (x, y) as BC1 (8 bytes) or, with alpha, BC3 (16 bytes). The endpoints are the
+// corners of the block's bounding box, which is fast and close enough for these diffuse textures.
+// Texels past the image edge repeat the last row and column.
+void UCompressBlock(const unsigned char* rgba, int stride, int width, int height, int x, int y, bool hasAlpha, unsigned char* block)
+{
+    unsigned char texels[16][4];
+    for (int j = 0; j < 4; ++j)
+        for (int i = 0; i < 4; ++i)
+        {
+            int px = std::min(x + i, width - 1);
+            int py = std::min(y + j, height - 1);
+            memcpy(texels[j * 4 + i], rgba + (size_t(py) * stride + px) * 4, 4);
+        }
+
+    unsigned char* colorBlock = block;
+    if (hasAlpha)
+    {
+        // Two alpha endpoints and six values between them, 3-bit index per texel
+        int alphaMin = 255, alphaMax = 0;
+        for (int i = 0; i < 16; ++i)
+        {
+            alphaMin = std::min(alphaMin, int(texels[i][3]));
+            alphaMax = std::max(alphaMax, int(texels[i][3]));
+        }
+
+        int palette[8] = { alphaMax, alphaMin };
+        for (int i = 1; i < 7; ++i)
+            palette[i + 1] = ((7 - i) * alphaMax + i * alphaMin) / 7;
+
+        uint64_t indices = 0;
+        if (alphaMax > alphaMin)
+            for (int i = 0; i < 16; ++i)
+            {
+                int best = 0;
+                for (int k = 1; k < 8; ++k)
+                    if (std::abs(palette[k] - texels[i][3]) < std::abs(palette[best] - texels[i][3]))
+                        best = k;
+                indices |= uint64_t(best) << (3 * i);
+            }
+
+        block[0] = (unsigned char)alphaMax;
+        block[1] = (unsigned char)alphaMin;
+        for (int k = 0; k < 6; ++k)
+            block[2 + k] = (unsigned char)(indices >> (8 * k));
+        colorBlock = block + 8;
+    }
+
+    // Two RGB565 endpoints and two colours between them, 2-bit index per texel
+    int lo[3] = { 255, 255, 255 }, hi[3] = { 0, 0, 0 };
+    for (int i = 0; i < 16; ++i)
+        for (int c = 0; c < 3; ++c)
+        {
+            lo[c] = std::min(lo[c], int(texels[i][c]));
+            hi[c] = std::max(hi[c], int(texels[i][c]));
+        }
+
+    auto pack565 = [](const int* color)
+    {
+        return uint16_t(((color[0] * 31 + 127) / 255) << 11 | ((color[1] * 63 + 127) / 255) << 5 | (color[2] * 31 + 127) / 255);
+    };
+    uint16_t color0 = pack565(hi);
+    uint16_t color1 = pack565(lo);
+
+    int palette[4][3];
+    for (int k = 0; k < 2; ++k)
+    {
+        uint16_t packed = k == 0 ? color0 : color1;
+        int r = packed >> 11, g = (packed >> 5) & 63, b = packed & 31;
+        palette[k][0] = (r << 3) | (r >> 2);
+        palette[k][1] = (g << 2) | (g >> 4);
+        palette[k][2] = (b << 3) | (b >> 2);
+    }
+    for (int c = 0; c < 3; ++c)
+    {
+        palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+        palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+    }
+
+    // Equal endpoints would select BC1's three-colour mode; every texel then uses endpoint 0
+    uint32_t indices = 0;
+    if (color0 > color1)
+        for (int i = 0; i < 16; ++i)
+        {
+            int best = 0, bestDistance = 3 * 255 * 255 + 1;
+            for (int k = 0; k < 4; ++k)
+            {
+                int dr = palette[k][0] - texels[i][0], dg = palette[k][1] - texels[i][1], db = palette[k][2] - texels[i][2];
+                int distance = dr * dr + dg * dg + db * db;
+                if (distance < bestDistance)
+                {
+                    best = k;
+                    bestDistance = distance;
+                }
+            }
+            indices |= uint32_t(best) << (2 * i);
+        }
+
+    colorBlock[0] = (unsigned char)(color0 & 0xff);
+    colorBlock[1] = (unsigned char)(color0 >> 8);
+    colorBlock[2] = (unsigned char)(color1 & 0xff);
+    colorBlock[3] = (unsigned char)(color1 >> 8);
+    for (int k = 0; k < 4; ++k)
+        colorBlock[4 + k] = (unsigned char)(indices >> (8 * k));
+}
+
+
+// Maps a whole file read-only; the mapping outlives the file handle
+bool UMapFile(const std::string& filename, TextureBlob& blob)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0)
+    {
+        CloseHandle(file);
+        return false;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    void* view = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+    if (mapping)
+        CloseHandle(mapping);
+    CloseHandle(file);
+    if (!view)
+        return false;
+
+    blob.size = size_t(size.QuadPart);
+#else
+    int file = open(filename.c_str(), O_RDONLY);
+    if (file < 0)
+        return false;
+
+    struct stat info;
+    if (fstat(file, &info) != 0 || info.st_size == 0)
+    {
+        close(file);
+        return false;
+    }
+
+    void* view = mmap(NULL, size_t(info.st_size), PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if (view == MAP_FAILED)
+        return false;
+
+    blob.size = size_t(info.st_size);
+#endif
+    blob.data = static_cast<const unsigned char*>(view);
+    blob.isMapped = true;
+    return true;
+}
+
+
+void UReleaseTextureBlob(TextureBlob& blob)
+{
+    if (blob.isMapped)
+    {
+#ifdef _WIN32
+        UnmapViewOfFile(blob.data);
+#else
+        munmap(const_cast<unsigned char*>(blob.data), blob.size);
+#endif
+    }
+
+    std::vector<unsigned char>().swap(blob.owned);
+    blob.data = nullptr;
+    blob.size = 0;
+    blob.isMapped = false;
+}
+
+
+// Uploads every mip level of one layer of a texture array; the first layer uploaded (textureId still 0)
+// allocates immutable storage for all layers with its size, format and level count. Must run on the GL thread.
+bool UUploadTextureLayer(const TextureBlob& blob, GLuint& textureId, int layer, int layerCount)
+{
+    const TextureCacheHeader& header = *reinterpret_cast<const TextureCacheHeader*>(blob.data);
+    const TextureCacheLevel* levels = reinterpret_cast<const TextureCacheLevel*>(blob.data + sizeof(TextureCacheHeader));
+
+    if (textureId == 0)
+    {
+        glGenTextures(1, &textureId);
+        glBindTexture(GL_TEXTURE_2D_ARRAY, textureId);
+        glTexStorage3D(GL_TEXTURE_2D_ARRAY, GLsizei(header.levelCount), header.format, GLsizei(header.width), GLsizei(header.height), layerCount);
+
+        // set the texture wrapping parameters
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+
+        // set texture filtering parameters
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    }
+    else
+        glBindTexture(GL_TEXTURE_2D_ARRAY, textureId);
+
+    for (uint32_t i = 0; i < header.levelCount; ++i)
+    {
+        const TextureCacheLevel& level = levels[i];
+        const unsigned char* texels = blob.data + level.offset;
+
+        if (header.format == GL_RGBA8)
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, GLint(i), 0, 0, layer, GLsizei(level.width), GLsizei(level.height), 1,
+                            GL_RGBA, GL_UNSIGNED_BYTE, texels);
+        else
+            glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, GLint(i), 0, 0, layer, GLsizei(level.width), GLsizei(level.height), 1,
+                                      header.format, GLsizei(level.size), texels);
+    }
+
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0); // Unbind the texture
+    return true;
+}
+
+
+// Prepares the images (cache map or decode and bake) on a pool of worker threads and uploads each one
+// on this (GL) thread into its layer of one texture array as soon as it is ready
+bool ULoadTextureArray(const char* const* filenames, int count, GLuint& textureId)
+{
+    typedef std::chrono::steady_clock Clock;
+    Clock::time_point start = Clock::now();
+
+    std::vector<TextureBlob> blobs(count);
+    std::vector<bool> prepared(count, false);
+    std::deque<int> ready;      // Indices of finished textures, in completion order
+    std::mutex readyMutex;
+    std::condition_variable readyCondition;
+    std::atomic<int> nextTexture(0);
+
+    // Workers pull textures until none are left and hand each result over through the queue
+    auto worker = [&]()
+    {
+        for (int i = nextTexture++; i < count; i = nextTexture++)
+        {
+            bool success = UPrepareTexture(gOptions.assetDirectory + filenames[i], false, blobs[i]);
+
+            std::lock_guard<std::mutex> lock(readyMutex);
+            prepared[i] = success;
+            ready.push_back(i);
+            readyCondition.notify_one();
+        }
+    };
+
+    int nThreads = std::max(1, std::min(int(std::thread::hardware_concurrency()), count));
+    std::vector<std::thread> threads;
+    for (int i = 0; i < nThreads; ++i)
+        threads.push_back(std::thread(worker));
+
+    textureId = 0;
+    TextureCacheHeader arrayHeader = {};    // Copied from the first layer uploaded; every layer must match it
+    bool success = true;
+    int cacheHits = 0;
+    double prepareMs = 0.0, uploadMs = 0.0;
+    for (int received = 0; received < count; ++received)
+    {
+        int i;
+        bool isPrepared;
+        {
+            std::unique_lock<std::mutex> lock(readyMutex);
+            readyCondition.wait(lock, [&ready]() { return !ready.empty(); });
+            i = ready.front();
+            isPrepared = prepared[i];
+            ready.pop_front();
+        }
+
+        if (!isPrepared)
+        {
+            cout << "Failed to load texture " << gOptions.assetDirectory + filenames[i] << endl;
+            success = false;
+            continue;
+        }
+
+        const TextureCacheHeader& header = *reinterpret_cast<const TextureCacheHeader*>(blobs[i].data);
+        if (textureId == 0)
+            arrayHeader = header;
+
+        // Every layer shares the storage the first one allocated, so the first field that differs is reported
+        std::ostringstream mismatch;
+        if (header.width != arrayHeader.width || header.height != arrayHeader.height)
+            mismatch << "is " << header.width << "x" << header.height << " but the texture array is " << arrayHeader.width << "x" << arrayHeader.height;
+        else if (header.format != arrayHeader.format)
+            mismatch << "has format 0x" << std::hex << header.format << " but the texture array has 0x" << arrayHeader.format << std::dec;
+        else if (header.levelCount != arrayHeader.levelCount)
+            mismatch << "has " << header.levelCount << " mip levels but the texture array has " << arrayHeader.levelCount;
+
+        if (!mismatch.str().empty())
+        {
+            cout << "Texture " << filenames[i] << " " << mismatch.str() << "; all scene textures must share one size and format" << endl;
+            success = false;
+        }
+        else
+        {
+            Clock::time_point uploadStart = Clock::now();
+            success = UUploadTextureLayer(blobs[i], textureId, i, count) && success;
+            uploadMs += std::chrono::duration<double, std::milli>(Clock::now() - uploadStart).count();
+        }
+
+        prepareMs += blobs[i].prepareMs;
+        cacheHits += blobs[i].fromCache ? 1 : 0;
+        UReleaseTextureBlob(blobs[i]);
+    }
+
+    for (size_t i = 0; i < threads.size(); ++i)
+        threads[i].join();
+
+    // No partly filled array is kept: a failed load deletes it and leaves textureId 0
+    if (!success)
+    {
+        cout << "Failed to create the scene texture array" << endl;
+        glDeleteTextures(1, &textureId);
+        textureId = 0;
+        return false;
+    }
+
+    double totalMs = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    cout << "INFO: Loaded " << count << " textures (" << cacheHits << " from cache) into a " << arrayHeader.width << "x" << arrayHeader.height
+         << " texture array on " << nThreads << " threads in " << totalMs << " ms"
+         << " (prepare " << prepareMs << " ms summed over threads, upload " << uploadMs << " ms)" << endl;
+
+    return true;
+}
+
+
+// Prints the time spent since the previous phase ended
+void UReportStartupPhase(const char* phase)
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    cout << "STARTUP: " << phase << ": " << std::chrono::duration<double, std::milli>(now - gStartupPhaseStart).count() << " ms" << endl;
+    gStartupPhaseStart = now;
+}
+
+
+void UDestroyTexture(GLuint textureId)
+{
+    glDeleteTextures(1, &textureId);
+}
+
+
+// Implements the UCreateShaders function
+bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint& programId)
+{
+    GLuint vertexShaderId, fragmentShaderId;
+    USubmitShaderProgram(vtxShaderSource, fragShaderSource, programId, vertexShaderId, fragmentShaderId);
+    if (!UFinishShaderProgram(programId, vertexShaderId, fragmentShaderId))
+        return false;
+
+    glUseProgram(programId);    // Uses the shader program
+
+    return true;
+}
+
+
+// UCreateShaderProgram() for the fixed programs, going through the program binary cache like the scene variants
+bool UCreateCachedShaderProgram(const std::string& vtxShaderSource, const std::string& fragShaderSource, GLuint& programId)
+{
+    uint64_t key = 0;
+    std::string filename;
+    bool isCacheable = UProgramCacheKey(vtxShaderSource, fragShaderSource, key, filename);
+    if (isCacheable && ULoadProgramBinary(filename, key, programId))
+    {
+        glUseProgram(programId);
+        return true;
+    }
+
+    if (!UCreateShaderProgram(vtxShaderSource.c_str(), fragShaderSource.c_str(), programId))
+        return false;
+
+    if (isCacheable)
+        USaveProgramBinary(filename, key, programId);
+    return true;
+}
+
+
+// Compiles and links a program without asking for any status, so with KHR_parallel_shader_compile the driver
+// works on it in the background. UFinishShaderProgram checks the result.
+void USubmitShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint& programId, GLuint& vertexShaderId, GLuint& fragmentShaderId)
+{
+    // Create a Shader program object.
+    programId = glCreateProgram();
+
+    // Create the vertex and fragment shader objects
+    vertexShaderId = glCreateShader(GL_VERTEX_SHADER);
+    fragmentShaderId = glCreateShader(GL_FRAGMENT_SHADER);
+
+    // Retrive the shader source
+    glShaderSource(vertexShaderId, 1, &vtxShaderSource, NULL);
+    glShaderSource(fragmentShaderId, 1, &fragShaderSource, NULL);
+
+    glCompileShader(vertexShaderId); // compile the vertex shader
+    glCompileShader(fragmentShaderId); // compile the fragment shader
+
+    // Attached compiled shaders to the shader program
+    glAttachShader(programId, vertexShaderId);
+    glAttachShader(programId, fragmentShaderId);
+
+    // Lets the program binary cache read the linked program back
+    glProgramParameteri(programId, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+
+    glLinkProgram(programId);   // links the shader program
+}
+
+
+// Reports compile and link errors of a submitted program (blocking until the driver is done) and releases its shaders
+bool UFinishShaderProgram(GLuint programId, GLuint vertexShaderId, GLuint fragmentShaderId)
+{
+    // Compilation and linkage error reporting
+    int success = 0;
+    char infoLog[512];
+    bool linked = false;
 
-    glCompileShader(fragmentShaderId); // compile the fragment shader
     // check for shader compile errors
-    glGetShaderiv(fragmentShaderId, GL_COMPILE_STATUS, &success);
+    glGetShaderiv(vertexShaderId, GL_COMPILE_STATUS, &success);
+    if (!success)
+    {
+        glGetShaderInfoLog(vertexShaderId, sizeof(infoLog), NULL, infoLog);
+        std::cout << "ERROR::SHADER::VERTEX::COMPILATION_FAILED\n" << infoLog << std::endl;
+    }
+    else
+    {
+        glGetShaderiv(fragmentShaderId, GL_COMPILE_STATUS, &success);
+        if (!success)
+        {
+            glGetShaderInfoLog(fragmentShaderId, sizeof(infoLog), NULL, infoLog);
+            std::cout << "ERROR::SHADER::FRAGMENT::COMPILATION_FAILED\n" << infoLog << std::endl;
+        }
+        else
+        {
+            // check for linking errors
+            glGetProgramiv(programId, GL_LINK_STATUS, &success);
+            if (!success)
+            {
+                glGetProgramInfoLog(programId, sizeof(infoLog), NULL, infoLog);
+                std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
+            }
+            linked = success != 0;
+        }
+    }
+
+    // The linked program keeps the code; the shader objects are no longer needed
+    glDetachShader(programId, vertexShaderId);
+    glDetachShader(programId, fragmentShaderId);
+    glDeleteShader(vertexShaderId);
+    glDeleteShader(fragmentShaderId);
+
+    return linked;
+}
+
+
+// True once a submitted program can be queried without stalling. Without KHR_parallel_shader_compile there is
+// no way to ask, so the program counts as complete and the first status query waits for it.
+bool UIsProgramComplete(GLuint programId)
+{
+    if (!GLEW_KHR_parallel_shader_compile && !GLEW_ARB_parallel_shader_compile)
+        return true;
+
+    GLint complete = GL_FALSE;
+    glGetProgramiv(programId, GL_COMPLETION_STATUS_KHR, &complete);
+    return complete != GL_FALSE;
+}
+
+
+// Computes where a program's binary is cached; false when the binary cache is off or the driver has no binary formats
+bool UProgramCacheKey(const std::string& vtxShaderSource, const std::string& fragShaderSource, uint64_t& key, std::string& filename)
+{
+    GLint nBinaryFormats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &nBinaryFormats);
+    if (!gOptions.programCache || nBinaryFormats <= 0)
+        return false;
+
+    std::string identity = gDriverIdentity + '\0' + vtxShaderSource + '\0' + fragShaderSource;
+    key = UHashBytes(identity.data(), identity.size());
+
+    char keyText[17];
+    snprintf(keyText, sizeof(keyText), "%016llx", (unsigned long long)key);
+    filename = gOptions.programCachePrefix + keyText + ".progbin";
+    return true;
+}
+
+
+// Loads a stored binary into a new program; a missing, stale or rejected binary (e.g. after a driver update) returns false
+bool ULoadProgramBinary(const std::string& filename, uint64_t key, GLuint& programId)
+{
+    std::vector<unsigned char> bytes;
+    if (!UReadFile(filename, bytes) || bytes.size() < sizeof(ProgramCacheHeader))
+        return false;
+
+    ProgramCacheHeader header;
+    memcpy(&header, bytes.data(), sizeof(header));
+    if (memcmp(header.magic, PROGRAM_CACHE_MAGIC, sizeof(header.magic)) != 0 || header.key != key
+        || header.binarySize != bytes.size() - sizeof(header))
+        return false;
+
+    programId = glCreateProgram();
+    glProgramBinary(programId, header.binaryFormat, bytes.data() + sizeof(header), GLsizei(header.binarySize));
+
+    GLint success = 0;
+    glGetProgramiv(programId, GL_LINK_STATUS, &success);
     if (!success)
     {
-        glGetShaderInfoLog(fragmentShaderId, sizeof(infoLog), NULL, infoLog);
-        std::cout << "ERROR::SHADER::FRAGMENT::COMPILATION_FAILED\n" << infoLog << std::endl;
+        glDeleteProgram(programId);
+        programId = 0;
+        return false;
+    }
+    return true;
+}
+
+
+// Writes the linked program's binary; failures only cost a recompile next time
+void USaveProgramBinary(const std::string& filename, uint64_t key, GLuint programId)
+{
+    GLint length = 0;
+    glGetProgramiv(programId, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0)
+        return;
+
+    std::vector<unsigned char> binary(length);
+    ProgramCacheHeader header = {};
+    memcpy(header.magic, PROGRAM_CACHE_MAGIC, sizeof(header.magic));
+    header.key = key;
+    glGetProgramBinary(programId, length, &length, &header.binaryFormat, binary.data());
+    header.binarySize = uint64_t(length);
+
+    // Written under a temporary name so an interrupted run never leaves a truncated binary behind
+    std::string tempFilename = filename + ".tmp";
+    ofstream file(tempFilename, ios::binary);
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(binary.data()), length);
+    file.close();
+
+    std::remove(filename.c_str());
+    if (!file || std::rename(tempFilename.c_str(), filename.c_str()) != 0)
+    {
+        std::remove(tempFilename.c_str());
+        cout << "INFO: Could not write program cache " << filename << endl;
+    }
+}
+
+
+void UDestroyShaderProgram(GLuint programId)
+{
+    glDeleteProgram(programId);
+}
+
+
+// Looks up a uniform location and counts the lookup so stray per-frame queries show up in the statistics
+GLint UGetUniformLocation(GLuint programId, const char* name)
+{
+    ++gFrameStats.uniformLookups;
+    ++gTotalUniformLookups;
+
+    return glGetUniformLocation(programId, name);
+}
+
+
+// Fills the uniform location table of a freshly linked program (unused uniforms are stored as -1)
+void UCacheUniformLocations(GLuint programId, GLProgramUniforms& uniforms)
+{
+    uniforms.uvScale = UGetUniformLocation(programId, "uvScale");
+    uniforms.sceneTextures = UGetUniformLocation(programId, "uSceneTextures");
+    uniforms.shadowMaps = UGetUniformLocation(programId, "uShadowMaps");
+    uniforms.lightViewProjection = UGetUniformLocation(programId, "uLightViewProjection");
+    uniforms.shadowLight = UGetUniformLocation(programId, "uShadowLight");
+}
+
+
+// Typed setters for the currently bound program
+void USetUniform(GLint location, const glm::mat4& value)
+{
+    ++gFrameStats.uniformUpdates;
+    glUniformMatrix4fv(location, 1, GL_FALSE, glm::value_ptr(value));
+}
+
+
+void USetUniform(GLint location, const glm::vec4& value)
+{
+    ++gFrameStats.uniformUpdates;
+    glUniform4fv(location, 1, glm::value_ptr(value));
+}
+
+
+void USetUniform(GLint location, const glm::vec3& value)
+{
+    ++gFrameStats.uniformUpdates;
+    glUniform3fv(location, 1, glm::value_ptr(value));
+}
+
+
+void USetUniform(GLint location, const glm::vec2& value)
+{
+    ++gFrameStats.uniformUpdates;
+    glUniform2fv(location, 1, glm::value_ptr(value));
+}
+
+
+void USetUniform(GLint location, GLint value)
+{
+    ++gFrameStats.uniformUpdates;
+    glUniform1i(location, value);
+}
+
+
+// Prints the counters of the last frame every few seconds
+void UReportFrameStats()
+{
+    static double lastReportTime = 0.0;
+
+    double currentTime = glfwGetTime();
+    if (currentTime - lastReportTime < STATS_REPORT_INTERVAL)
+        return;
+    lastReportTime = currentTime;
+
+    cout << "STATS: uniform lookups last frame: " << gFrameStats.uniformLookups
+         << " (total since startup: " << gTotalUniformLookups << ")"
+         << ", uniform updates last frame: " << gFrameStats.uniformUpdates << endl;
+
+    std::vector<GLuint> litEntities;
+    UQueryBvhSphere(gBvh, gEntities, gLightPosition, LAMP_LIGHT_RANGE, litEntities);
+
+    cout << "STATS: entities culled last frame: " << gFrameStats.culledEntities << " of " << gEntities.positions.size()
+         << " (" << gFrameStats.bvhNodesVisited << " hierarchy nodes visited), entities within lamp range: " << litEntities.size() << endl;
+
+    if (gOptions.occlusionCulling)
+        cout << "STATS: entities occluded last frame: " << gFrameStats.occludedEntities
+             << ", occlusion queries issued: " << gFrameStats.occlusionQueries
+             << " (" << gOcclusionQueries.pending.size() << " results pending)" << endl;
+
+    cout << "STATS: point lights in view last frame: " << gFrameStats.visibleLights << " of " << gPointLights.size()
+         << ", cluster light references: " << gFrameStats.clusterLightIndices
+         << " (binned in " << gFrameStats.lightBinningMs << " ms)" << endl;
+
+    cout << "STATS: shadow map draw calls last frame: " << gFrameStats.shadowDrawCalls
+         << " (" << gFrameStats.shadowInstances << " instances)"
+         << ", static caches re-rendered: " << gFrameStats.shadowStaticRebuilds
+         << ", restored from cache: " << gFrameStats.shadowCacheHits << " (total since startup: " << gTotalShadowCacheHits << ")"
+         << " (casters batched in " << gFrameStats.shadowBuildMs << " ms)" << endl;
+
+    cout << "STATS: triangles last frame: " << gFrameStats.triangles << " (multi-level parts per LOD:";
+    for (int lod = 0; lod < MAX_LOD_LEVELS; ++lod)
+        cout << " " << gFrameStats.lodTriangles[lod];
+    cout << ")" << endl;
+
+    cout << "STATS: draw calls last frame: " << gFrameStats.drawCalls
+         << " (" << gFrameStats.instances << " instances)"
+         << ", program binds: " << gFrameStats.programBinds
+         << ", texture binds: " << gFrameStats.textureBinds
+         << ", vertex array binds: " << gFrameStats.vertexArrayBinds
+         << ", redundant state changes skipped: " << gFrameStats.redundantStateChanges << endl;
+}
+
+
+// State changes made by the renderer go through these wrappers: calls that would not change anything are skipped
+// and counted, the others show up in the frame statistics
+void UUseProgram(GLuint programId)
+{
+    if (gStateCache.programId == programId)
+    {
+        ++gFrameStats.redundantStateChanges;
+        return;
+    }
+
+    ++gFrameStats.programBinds;
+    gStateCache.programId = programId;
+    glUseProgram(programId);
+}
+
+
+void UBindTexture(GLenum unit, GLenum target, GLuint textureId)
+{
+    GLuint unitIndex = unit - GL_TEXTURE0;
+    if (unitIndex < MAX_CACHED_TEXTURE_UNITS && gStateCache.textures[unitIndex] == textureId)
+    {
+        ++gFrameStats.redundantStateChanges;
+        return;
+    }
+
+    ++gFrameStats.textureBinds;
+    if (gStateCache.activeUnit != unit)
+    {
+        gStateCache.activeUnit = unit;
+        glActiveTexture(unit);
+    }
+    if (unitIndex < MAX_CACHED_TEXTURE_UNITS)
+        gStateCache.textures[unitIndex] = textureId;
+    glBindTexture(target, textureId);
+}
+
+
+void UBindVertexArray(GLuint vao)
+{
+    if (gStateCache.vao == vao)
+    {
+        ++gFrameStats.redundantStateChanges;
+        return;
+    }
+
+    ++gFrameStats.vertexArrayBinds;
+    gStateCache.vao = vao;
+    glBindVertexArray(vao);
+}
+
+
+// Forgets the cached state so the next wrapper call of each kind reaches GL
+void UResetStateCache()
+{
+    const GLuint unknown = ~0u;
+
+    gStateCache.programId = unknown;
+    gStateCache.vao = unknown;
+    gStateCache.activeUnit = GL_NONE;
+    for (int i = 0; i < MAX_CACHED_TEXTURE_UNITS; ++i)
+        gStateCache.textures[i] = unknown;
+}
+
+
+// Rounds an offset up to the next multiple of alignment
+static GLintptr UAlignOffset(GLintptr offset, GLint alignment)
+{
+    return (offset + alignment - 1) / alignment * alignment;
+}
+
+
+// Creates the uniform buffer and binds each block range to its shared binding point
+void UCreateFrameUniformBuffer(GLFrameUniformBuffer& buffer)
+{
+    GLint alignment = 256;
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+
+    buffer.cameraOffset = 0;
+    buffer.lightOffset = UAlignOffset(buffer.cameraOffset + sizeof(CameraBlock), alignment);
+    buffer.staging.assign(buffer.lightOffset + sizeof(LightBlock), 0);
+
+    glGenBuffers(1, &buffer.ubo);
+    glBindBuffer(GL_UNIFORM_BUFFER, buffer.ubo);
+    glBufferData(GL_UNIFORM_BUFFER, buffer.staging.size(), NULL, GL_STREAM_DRAW);
+
+    // Binding points are set in the shaders, the ranges stay valid when the storage is orphaned
+    glBindBufferRange(GL_UNIFORM_BUFFER, CAMERA_BLOCK_BINDING, buffer.ubo, buffer.cameraOffset, sizeof(CameraBlock));
+    glBindBufferRange(GL_UNIFORM_BUFFER, LIGHT_BLOCK_BINDING, buffer.ubo, buffer.lightOffset, sizeof(LightBlock));
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+
+// Copies the frame's blocks into the staging area and uploads them with a single call
+void UUploadFrameUniforms(GLFrameUniformBuffer& buffer, const CameraBlock& camera, const LightBlock& lights)
+{
+    ++gFrameStats.uniformUpdates;
+
+    memcpy(&buffer.staging[buffer.cameraOffset], &camera, sizeof(CameraBlock));
+    memcpy(&buffer.staging[buffer.lightOffset], &lights, sizeof(LightBlock));
+
+    // Re-specifying the whole store orphans last frame's copy, so the driver never waits for draws still reading it
+    glBindBuffer(GL_UNIFORM_BUFFER, buffer.ubo);
+    glBufferData(GL_UNIFORM_BUFFER, buffer.staging.size(), buffer.staging.data(), GL_STREAM_DRAW);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+
+void UDestroyFrameUniformBuffer(GLFrameUniformBuffer& buffer)
+{
+    glDeleteBuffers(1, &buffer.ubo);
+}
+
+
+// Puts the lamp first, then count - 1 small colored lights hovering over the table; the fixed seed keeps
+// benchmark runs comparable
+void UCreateSceneLights(int count)
+{
+    std::mt19937 random(2);
+    std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+    PointLight lamp = { glm::vec4(gLightPosition, LAMP_LIGHT_RANGE), glm::vec4(gLightColor, 1.0f) };
+    gPointLights.assign(1, lamp);
+
+    // Dimmer as they get more numerous, so overlapping lights do not wash the table out
+    float intensity = std::min(1.0f, sqrt(8.0f / count));
+    for (int i = 1; i < count; ++i)
+    {
+        glm::vec3 position(-13.0f + 28.0f * unit(random), TABLE_TOP_Y + 0.5f + 2.0f * unit(random), -11.0f + 22.0f * unit(random));
+        glm::vec3 color(0.3f + 0.7f * unit(random), 0.3f + 0.7f * unit(random), 0.3f + 0.7f * unit(random));
+        PointLight light = { glm::vec4(position, 1.5f + 1.5f * unit(random)), glm::vec4(intensity * color, 1.0f) };
+        gPointLights.push_back(light);
+    }
+
+    if (count > 1)
+        cout << "INFO: " << count << " point lights, the lamp included" << endl;
+}
+
+
+// Creates the storage buffers the lit variants read their lights from and binds them to their binding points
+void UCreateClusterGrid(ClusterGrid& grid)
+{
+    grid.clusters.assign(CLUSTER_COUNT, ClusterRecord());
+    grid.workerIndices.resize(1);
+    grid.generation = 0;
+    grid.pendingWorkers = 0;
+    grid.isStopping = false;
+
+    glGenBuffers(1, &grid.lightBuffer);
+    glGenBuffers(1, &grid.clusterBuffer);
+    glGenBuffers(1, &grid.indexBuffer);
+
+    // Bound whole, so the bindings follow the stores as they are re-specified every frame
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, POINT_LIGHT_BUFFER_BINDING, grid.lightBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTER_BUFFER_BINDING, grid.clusterBuffer);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTER_LIGHT_INDEX_BUFFER_BINDING, grid.indexBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+
+// Bins every light into the clusters its range overlaps. The light's view space bounding box, clamped to the clip
+// planes, is projected corner by corner, which is conservative for both projections. With many lights the depth
+// slices are split among persistent worker threads that each build the runs of their own clusters. Lights whose range
+// reaches no entity, according to the hierarchy, light nothing and are left out.
+void UAssignLightsToClusters(const std::vector<PointLight>& lights, const CameraBlock& camera, const Bvh& bvh, const EntityStore& store, ClusterGrid& grid)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    grid.sliceScale = CLUSTER_SLICES / log(CAMERA_FAR / CAMERA_NEAR);
+    grid.sliceBias = -grid.sliceScale * log(CAMERA_NEAR);
+
+    grid.bounds.resize(lights.size());
+    for (size_t i = 0; i < lights.size(); ++i)
+    {
+        LightClusterBounds& bounds = grid.bounds[i];
+        glm::vec4 center = camera.view * glm::vec4(lights[i].position.x, lights[i].position.y, lights[i].position.z, 1.0f);
+        float range = lights[i].position.w;
+
+        // Distances along the view direction
+        float nearDepth = std::max(-center.z - range, CAMERA_NEAR);
+        float farDepth = std::min(-center.z + range, CAMERA_FAR);
+        bounds.isVisible = nearDepth <= farDepth;
+        if (!bounds.isVisible)
+            continue;
+
+        float ndcMin[2] = { 1.0e9f, 1.0e9f };
+        float ndcMax[2] = { -1.0e9f, -1.0e9f };
+        for (int corner = 0; corner < 8; ++corner)
+        {
+            glm::vec4 clip = camera.projection * glm::vec4(center.x + ((corner & 1) ? range : -range), center.y + ((corner & 2) ? range : -range),
+                                                           (corner & 4) ? -farDepth : -nearDepth, 1.0f);
+            for (int axis = 0; axis < 2; ++axis)
+            {
+                ndcMin[axis] = std::min(ndcMin[axis], clip[axis] / clip.w);
+                ndcMax[axis] = std::max(ndcMax[axis], clip[axis] / clip.w);
+            }
+        }
+
+        const int tiles[2] = { CLUSTER_TILES_X, CLUSTER_TILES_Y };
+        for (int axis = 0; axis < 2; ++axis)
+        {
+            bounds.isVisible = bounds.isVisible && ndcMax[axis] >= -1.0f && ndcMin[axis] <= 1.0f;
+            bounds.min[axis] = std::max(0, int(floor((ndcMin[axis] * 0.5f + 0.5f) * tiles[axis])));
+            bounds.max[axis] = std::min(tiles[axis] - 1, int(floor((ndcMax[axis] * 0.5f + 0.5f) * tiles[axis])));
+        }
+        bounds.min[2] = std::max(0, int(floor(log(nearDepth) * grid.sliceScale + grid.sliceBias)));
+        bounds.max[2] = std::min(CLUSTER_SLICES - 1, int(floor(log(farDepth) * grid.sliceScale + grid.sliceBias)));
+
+        if (!bounds.isVisible)
+            continue;
+
+        UQueryBvhSphere(bvh, store, glm::vec3(lights[i].position), range, grid.reachedEntities);
+        bounds.isVisible = !grid.reachedEntities.empty();
+        if (bounds.isVisible)
+            ++gFrameStats.visibleLights;
+    }
+
+    // The pool is sized once; the render thread takes the first share, so it starts one thread fewer
+    if (lights.size() >= CLUSTER_PARALLEL_LIGHTS && grid.workers.empty())
+    {
+        int nThreads = std::max(1, std::min(int(std::thread::hardware_concurrency()), CLUSTER_SLICES));
+        grid.workerIndices.resize(nThreads);
+        for (int w = 1; w < nThreads; ++w)
+            grid.workers.push_back(std::thread(URunClusterWorker, std::ref(grid), w));
+    }
+
+    int nWorkers = lights.size() >= CLUSTER_PARALLEL_LIGHTS ? int(grid.workers.size()) + 1 : 1;
+
+    // Worker w bins slices [w * CLUSTER_SLICES / nWorkers, (w + 1) * CLUSTER_SLICES / nWorkers)
+    if (nWorkers > 1)
+    {
+        {
+            std::lock_guard<std::mutex> lock(grid.workMutex);
+            grid.pendingWorkers = nWorkers - 1;
+            ++grid.generation;
+        }
+        grid.workCondition.notify_all();
+    }
+
+    UBinClusterSlices(grid.bounds, 0, CLUSTER_SLICES / nWorkers, grid.clusters.data(), grid.workerIndices[0]);
+
+    if (nWorkers > 1)
+    {
+        std::unique_lock<std::mutex> lock(grid.workMutex);
+        grid.doneCondition.wait(lock, [&grid] { return grid.pendingWorkers == 0; });
+    }
+
+    // Concatenate the runs in slice order, moving each worker's offsets past the runs before it
+    const int clustersPerSlice = CLUSTER_TILES_X * CLUSTER_TILES_Y;
+    grid.lightIndices.clear();
+    for (int w = 0; w < nWorkers; ++w)
+    {
+        GLuint base = GLuint(grid.lightIndices.size());
+        for (int c = w * CLUSTER_SLICES / nWorkers * clustersPerSlice; c < (w + 1) * CLUSTER_SLICES / nWorkers * clustersPerSlice; ++c)
+            grid.clusters[c].offset += base;
+        grid.lightIndices.insert(grid.lightIndices.end(), grid.workerIndices[w].begin(), grid.workerIndices[w].end());
+    }
+
+    gFrameStats.clusterLightIndices = GLuint(grid.lightIndices.size());
+    gFrameStats.lightBinningMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+
+// Body of binning worker w (1 and up): sleeps until a frame bumps the generation, bins its share of the slices
+// for the whole pool, then reports back. Returns when the grid is destroyed.
+void URunClusterWorker(ClusterGrid& grid, int worker)
+{
+    uint64_t generation = 0;
+    int nWorkers = int(grid.workerIndices.size());
+
+    for (;;)
+    {
+        {
+            std::unique_lock<std::mutex> lock(grid.workMutex);
+            grid.workCondition.wait(lock, [&grid, generation] { return grid.isStopping || grid.generation != generation; });
+            if (grid.isStopping)
+                return;
+            generation = grid.generation;
+        }
+
+        UBinClusterSlices(grid.bounds, worker * CLUSTER_SLICES / nWorkers, (worker + 1) * CLUSTER_SLICES / nWorkers,
+                          grid.clusters.data(), grid.workerIndices[worker]);
+
+        {
+            std::lock_guard<std::mutex> lock(grid.workMutex);
+            --grid.pendingWorkers;
+        }
+        grid.doneCondition.notify_one();
+    }
+}
+
+
+// Builds the runs of the clusters in depth slices [firstSlice, endSlice): counts each cluster's lights first, then
+// writes the light indices at offsets taken from a running sum. Runs list their lights in ascending order.
+void UBinClusterSlices(const std::vector<LightClusterBounds>& bounds, int firstSlice, int endSlice, ClusterRecord* clusters, std::vector<GLuint>& indices)
+{
+    const int clustersPerSlice = CLUSTER_TILES_X * CLUSTER_TILES_Y;
+    for (int c = firstSlice * clustersPerSlice; c < endSlice * clustersPerSlice; ++c)
+        clusters[c].count = 0;
+
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        for (size_t i = 0; i < bounds.size(); ++i)
+        {
+            const LightClusterBounds& light = bounds[i];
+            if (!light.isVisible)
+                continue;
+
+            for (int z = std::max(light.min[2], firstSlice); z <= std::min(light.max[2], endSlice - 1); ++z)
+                for (int y = light.min[1]; y <= light.max[1]; ++y)
+                    for (int x = light.min[0]; x <= light.max[0]; ++x)
+                    {
+                        ClusterRecord& cluster = clusters[x + CLUSTER_TILES_X * (y + CLUSTER_TILES_Y * z)];
+                        if (pass == 1)
+                            indices[cluster.offset + cluster.count] = GLuint(i);
+                        ++cluster.count;
+                    }
+        }
+
+        if (pass == 0)
+        {
+            GLuint offset = 0;
+            for (int c = firstSlice * clustersPerSlice; c < endSlice * clustersPerSlice; ++c)
+            {
+                clusters[c].offset = offset;
+                offset += clusters[c].count;
+                clusters[c].count = 0;
+            }
+            indices.resize(offset);
+        }
+    }
+}
+
+
+// Uploads the lights and the cluster lists; like the frame uniforms, every store is orphaned rather than overwritten
+void UUploadClusterGrid(const std::vector<PointLight>& lights, const ClusterGrid& grid)
+{
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, grid.lightBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, lights.size() * sizeof(PointLight), lights.data(), GL_STREAM_DRAW);
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, grid.clusterBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, grid.clusters.size() * sizeof(ClusterRecord), grid.clusters.data(), GL_STREAM_DRAW);
+
+    // An empty store cannot be bound, so the index list always keeps at least one entry
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, grid.indexBuffer);
+    if (grid.lightIndices.empty())
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GLuint), NULL, GL_STREAM_DRAW);
+    else
+        glBufferData(GL_SHADER_STORAGE_BUFFER, grid.lightIndices.size() * sizeof(GLuint), grid.lightIndices.data(), GL_STREAM_DRAW);
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+
+void UDestroyClusterGrid(ClusterGrid& grid)
+{
+    {
+        std::lock_guard<std::mutex> lock(grid.workMutex);
+        grid.isStopping = true;
+    }
+    grid.workCondition.notify_all();
+    for (size_t i = 0; i < grid.workers.size(); ++i)
+        grid.workers[i].join();
+    grid.workers.clear();
+
+    glDeleteBuffers(1, &grid.lightBuffer);
+    glDeleteBuffers(1, &grid.clusterBuffer);
+    glDeleteBuffers(1, &grid.indexBuffer);
+}
+
+
+// Creates the instance buffer and attaches it to the per-instance attributes of the mesh VAO
+void UCreateInstanceBuffer(GLInstanceBuffer& buffer, GLuint vao)
+{
+    buffer.capacity = 0;
+    buffer.instances.clear();
+
+    glGenBuffers(1, &buffer.vbo);
+    glBindVertexArray(vao);
+    glBindBuffer(GL_ARRAY_BUFFER, buffer.vbo);
+
+    GLsizei stride = sizeof(InstanceData);
+    for (GLuint column = 0; column < 4; ++column)
+    {
+        GLuint location = INSTANCE_MODEL_LOCATION + column;
+        glVertexAttribPointer(location, 4, GL_FLOAT, GL_FALSE, stride, (void*)(offsetof(InstanceData, model) + column * sizeof(glm::vec4)));
+        glVertexAttribDivisor(location, 1);
+        glEnableVertexAttribArray(location);
+    }
+
+    glVertexAttribPointer(INSTANCE_TINT_LOCATION, 4, GL_FLOAT, GL_FALSE, stride, (void*)offsetof(InstanceData, tint));
+    glVertexAttribDivisor(INSTANCE_TINT_LOCATION, 1);
+    glEnableVertexAttribArray(INSTANCE_TINT_LOCATION);
+
+    glVertexAttribIPointer(INSTANCE_LIGHTS_LOCATION, 1, GL_UNSIGNED_INT, stride, (void*)offsetof(InstanceData, lights));
+    glVertexAttribDivisor(INSTANCE_LIGHTS_LOCATION, 1);
+    glEnableVertexAttribArray(INSTANCE_LIGHTS_LOCATION);
+
+    glVertexAttribIPointer(INSTANCE_MATERIAL_LOCATION, 1, GL_INT, stride, (void*)offsetof(InstanceData, material));
+    glVertexAttribDivisor(INSTANCE_MATERIAL_LOCATION, 1);
+    glEnableVertexAttribArray(INSTANCE_MATERIAL_LOCATION);
+
+    for (GLuint column = 0; column < 3; ++column)
+    {
+        GLuint location = INSTANCE_NORMAL_MATRIX_LOCATION + column;
+        glVertexAttribPointer(location, 3, GL_FLOAT, GL_FALSE, stride, (void*)(offsetof(InstanceData, normalMatrix) + column * sizeof(glm::vec3)));
+        glVertexAttribDivisor(location, 1);
+        glEnableVertexAttribArray(location);
+    }
+
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+
+// Appends an instance for this frame and returns its index, used as the base instance of the draw
+GLuint UAddInstance(GLInstanceBuffer& buffer, const glm::mat4& model, const glm::mat3& normalMatrix, const glm::vec4& tint, GLuint lights, GLint material)
+{
+    InstanceData instance;
+    instance.model = model;
+    instance.tint = tint;
+    instance.lights = lights;
+    instance.material = material;
+    instance.normalMatrix = normalMatrix;
+    buffer.instances.push_back(instance);
+
+    return GLuint(buffer.instances.size() - 1);
+}
+
+
+// Uploads this frame's instances, orphaning the previous storage; grows the buffer geometrically when needed
+void UUploadInstances(GLInstanceBuffer& buffer)
+{
+    if (buffer.capacity < buffer.instances.size())
+        buffer.capacity = std::max(buffer.instances.size(), 2 * buffer.capacity);
+
+    glBindBuffer(GL_ARRAY_BUFFER, buffer.vbo);
+    glBufferData(GL_ARRAY_BUFFER, buffer.capacity * sizeof(InstanceData), NULL, GL_STREAM_DRAW);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, buffer.instances.size() * sizeof(InstanceData), buffer.instances.data());
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+
+void UDestroyInstanceBuffer(GLInstanceBuffer& buffer)
+{
+    glDeleteBuffers(1, &buffer.vbo);
+}
+
+
+// Reads the command line options; prints the usage and returns false on unknown or incomplete options
+bool UParseCommandLine(int argc, char* argv[], RunOptions& options)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+
+        if (arg == "--headless")
+            options.headless = true;
+        else if (arg == "--frames" && hasValue)
+            options.frameCount = atoi(argv[++i]);
+        else if (arg == "--width" && hasValue)
+            options.width = atoi(argv[++i]);
+        else if (arg == "--height" && hasValue)
+            options.height = atoi(argv[++i]);
+        else if (arg == "--delta-time" && hasValue)
+            options.fixedDeltaTime = float(atof(argv[++i]));
+        else if (arg == "--capture" && hasValue)
+            options.capturePrefix = argv[++i];
+        else if (arg == "--capture-every" && hasValue)
+            options.captureEvery = atoi(argv[++i]);
+        else if (arg == "--bench")
+            options.benchmark = true;
+        else if (arg == "--bench-fragment")
+            options.benchmark = options.fragmentBenchmark = true;
+        else if (arg == "--bench-lights")
+            options.benchmark = options.lightBenchmark = true;
+        else if (arg == "--lights" && hasValue)
+            options.lightCount = atoi(argv[++i]);
+        else if (arg == "--deferred")
+            options.deferred = true;
+        else if (arg == "--depth-prepass")
+            options.depthPrepass = true;
+        else if (arg == "--no-shadows")
+            options.shadows = false;
+        else if (arg == "--shadow-resolution" && hasValue)
+            options.shadowResolution = atoi(argv[++i]);
+        else if (arg == "--shadow-taps" && hasValue)
+            options.shadowTaps = atoi(argv[++i]);
+        else if (arg == "--warmup" && hasValue)
+            options.warmupFrames = atoi(argv[++i]);
+        else if (arg == "--bench-output" && hasValue)
+            options.benchOutput = argv[++i];
+        else if (arg == "--props" && hasValue)
+            options.propCount = atoi(argv[++i]);
+        else if (arg == "--no-cull")
+            options.frustumCulling = false;
+        else if (arg == "--no-bvh")
+            options.useBvh = false;
+        else if (arg == "--occlusion-culling")
+            options.occlusionCulling = true;
+        else if (arg == "--no-texture-cache")
+            options.textureCache = false;
+        else if (arg == "--no-program-cache")
+            options.programCache = false;
+        else if (arg == "--program-cache" && hasValue)
+            options.programCachePrefix = argv[++i];
+        else if (arg == "--bench-flip")
+            options.flipBenchmark = true;
+        else if (arg == "--flip-runs" && hasValue)
+            options.flipRepetitions = atoi(argv[++i]);
+        else if (arg == "--assets" && hasValue)
+        {
+            options.assetDirectory = argv[++i];
+            if (!options.assetDirectory.empty() && options.assetDirectory.back() != '/' && options.assetDirectory.back() != '\\')
+                options.assetDirectory += '/';
+        }
+        else
+        {
+            cout << "Unknown or incomplete option " << arg << endl
+                 << "Usage: " << argv[0] << " [--assets <dir>] [--headless [--frames <n>] [--width <w>] [--height <h>]"
+                 << " [--delta-time <seconds>] [--capture <prefix>] [--capture-every <n>]]"
+                 << " [--bench | --bench-fragment | --bench-lights [--warmup <n>] [--bench-output <file>]] [--props <n>] [--lights <n>]"
+                 << " [--deferred] [--depth-prepass] [--no-shadows | --shadow-resolution <n> --shadow-taps <n>] [--no-cull] [--no-bvh] [--occlusion-culling] [--no-texture-cache]"
+                 << " [--no-program-cache | --program-cache <prefix>]"
+                 << " [--bench-flip [--flip-runs <n>]]" << endl;
+            return false;
+        }
+    }
 
+    if (options.frameCount < 1 || options.width < 1 || options.height < 1 || options.propCount < 0 || options.flipRepetitions < 1)
+    {
+        cout << "Frame count, resolution and flip runs must be positive, prop count must not be negative" << endl;
         return false;
     }
 
-    // Attached compiled shaders to the shader program
-    glAttachShader(programId, vertexShaderId);
-    glAttachShader(programId, fragmentShaderId);
+    if (options.benchmark && (options.warmupFrames < 0 || options.warmupFrames >= options.frameCount))
+    {
+        cout << "The benchmark needs more frames than warm-up frames" << endl;
+        return false;
+    }
 
-    glLinkProgram(programId);   // links the shader program
-    // check for linking errors
-    glGetProgramiv(programId, GL_LINK_STATUS, &success);
-    if (!success)
+    if (options.lightCount < 1 || options.lightCount > MAX_POINT_LIGHTS)
     {
-        glGetProgramInfoLog(programId, sizeof(infoLog), NULL, infoLog);
-        std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
+        cout << "Light count must be between 1 and " << MAX_POINT_LIGHTS << endl;
+        return false;
+    }
 
+    if (options.shadowResolution < 1 || options.shadowTaps < 1 || options.shadowTaps > SHADOW_MAX_TAPS)
+    {
+        cout << "Shadow resolution must be positive, shadow taps between 1 and " << SHADOW_MAX_TAPS << endl;
         return false;
     }
 
-    glUseProgram(programId);    // Uses the shader program
+    return true;
+}
+
+
+// Renders the configured number of frames into an offscreen target with a fixed time step and writes the captures
+bool URunHeadless()
+{
+    GLRenderTarget target;
+    if (!UCreateRenderTarget(gOptions.width, gOptions.height, target))
+        return false;
+
+    glBindFramebuffer(GL_FRAMEBUFFER, target.fbo);
+    glViewport(0, 0, target.width, target.height);
+    gViewportWidth = target.width;
+    gViewportHeight = target.height;
+
+    int captureEvery = gOptions.captureEvery > 0 ? gOptions.captureEvery : gOptions.frameCount;
+    bool success = true;
+
+    for (int frame = 0; frame < gOptions.frameCount && success; ++frame)
+    {
+        gDeltaTime = gOptions.fixedDeltaTime;
+
+        URender();
+
+        if ((frame + 1) % captureEvery == 0)
+        {
+            char suffix[32];
+            snprintf(suffix, sizeof(suffix), "_%04d.ppm", frame);
+            success = UWriteFrameCapture(target, gOptions.capturePrefix + suffix);
+        }
+    }
+
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    UDestroyRenderTarget(target);
+
+    cout << "INFO: Rendered " << gOptions.frameCount << " headless frames at "
+         << gOptions.width << "x" << gOptions.height << endl;
+    return success;
+}
+
+
+// Creates a framebuffer with an RGBA8 color and a 24-bit depth renderbuffer
+bool UCreateRenderTarget(int width, int height, GLRenderTarget& target)
+{
+    target.width = width;
+    target.height = height;
+
+    glGenFramebuffers(1, &target.fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, target.fbo);
+
+    glGenRenderbuffers(1, &target.colorRbo);
+    glBindRenderbuffer(GL_RENDERBUFFER, target.colorRbo);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, target.colorRbo);
+
+    glGenRenderbuffers(1, &target.depthRbo);
+    glBindRenderbuffer(GL_RENDERBUFFER, target.depthRbo);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, target.depthRbo);
+
+    GLenum status = glCheckFramebufferStatus(GL_FRAMEBUFFER);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    if (status != GL_FRAMEBUFFER_COMPLETE)
+    {
+        cout << "ERROR::FRAMEBUFFER::INCOMPLETE (0x" << hex << status << dec << ")" << endl;
+        UDestroyRenderTarget(target);
+        return false;
+    }
 
     return true;
 }
 
 
-void UDestroyShaderProgram(GLuint programId)
+void UDestroyRenderTarget(GLRenderTarget& target)
 {
-    glDeleteProgram(programId);
-}
\ No newline at end of file
+    glDeleteFramebuffers(1, &target.fbo);
+    glDeleteRenderbuffers(1, &target.colorRbo);
+    glDeleteRenderbuffers(1, &target.depthRbo);
+}
+
+
+// Reads back the color attachment of the bound target and writes it as a binary PPM (top row first)
+bool UWriteFrameCapture(const GLRenderTarget& target, const std::string& filename)
+{
+    const int rowSize = target.width * 3;
+    std::vector<unsigned char> pixels(rowSize * target.height);
+
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadBuffer(GL_COLOR_ATTACHMENT0);
+    glReadPixels(0, 0, target.width, target.height, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+
+    std::ofstream file(filename.c_str(), std::ios::binary);
+    if (!file)
+    {
+        cout << "Failed to write capture " << filename << endl;
+        return false;
+    }
+
+    file << "P6\n" << target.width << " " << target.height << "\n255\n";
+    for (int row = target.height - 1; row >= 0; --row)
+        file.write(reinterpret_cast<const char*>(&pixels[row * rowSize]), rowSize);
+
+    return bool(file);
+}
+
+
+// Flies the scripted camera path for a fixed number of frames and reports CPU and GPU frame times as JSON;
+// the light benchmark reports one series per point light count instead
+bool URunBenchmark()
+{
+    std::ostringstream report;
+    if (gOptions.lightBenchmark)
+    {
+        if (!URunLightSweep(report))
+            return false;
+    }
+    else
+    {
+        std::vector<BenchSample> samples;
+        if (!URenderBenchmarkFrames(samples))
+            return false;
+        UWriteBenchReport(report, samples);
+    }
+
+    if (gOptions.benchOutput.empty())
+    {
+        cout << report.str();
+        return true;
+    }
+
+    std::ofstream file(gOptions.benchOutput.c_str());
+    if (!file)
+    {
+        cout << "Failed to write benchmark report " << gOptions.benchOutput << endl;
+        return false;
+    }
+    file << report.str();
+
+    cout << "INFO: Benchmark report written to " << gOptions.benchOutput << endl;
+    return bool(file);
+}
+
+
+// Renders the benchmark frames and returns the samples measured after the warm-up
+bool URenderBenchmarkFrames(std::vector<BenchSample>& samples)
+{
+    typedef std::chrono::steady_clock Clock;
+
+    GLRenderTarget target;
+    if (gOptions.headless)
+    {
+        if (!UCreateRenderTarget(gOptions.width, gOptions.height, target))
+            return false;
+
+        glBindFramebuffer(GL_FRAMEBUFFER, target.fbo);
+        glViewport(0, 0, target.width, target.height);
+        gViewportWidth = target.width;
+        gViewportHeight = target.height;
+    }
+    else
+    {
+        // Do not let the display refresh rate cap the measured frame times
+        glfwSwapInterval(0);
+        glfwGetFramebufferSize(gWindow, &gViewportWidth, &gViewportHeight);
+    }
+
+    UCreatePassTimers(gPassTimers);
+
+    samples.assign(gOptions.frameCount, BenchSample());
+    int frameCount = 0;
+
+    Clock::time_point frameStart = Clock::now();
+    for (; frameCount < gOptions.frameCount; ++frameCount)
+    {
+        if (!gOptions.headless && glfwWindowShouldClose(gWindow))
+            break;
+
+        BenchSample& sample = samples[frameCount];
+
+        // Collect the GPU times of the frame that last used this ring entry
+        gPassTimers.slot = frameCount % GPU_TIMER_FRAMES;
+        if (frameCount >= GPU_TIMER_FRAMES)
+        {
+            BenchSample& previous = samples[frameCount - GPU_TIMER_FRAMES];
+            UReadPassTimers(gPassTimers, gPassTimers.slot, previous.gpuMs);
+            previous.shadedSamples = UReadSampleCounter(gPassTimers, gPassTimers.slot);
+        }
+
+        // Time steps are fixed so every run renders the same frames
+        gDeltaTime = gOptions.fixedDeltaTime;
+
+        Clock::time_point inputStart = Clock::now();
+        UProcessInput(gWindow);
+        UUpdateBenchCamera(frameCount, gOptions.frameCount);
+
+        Clock::time_point renderStart = Clock::now();
+        URender();
+        Clock::time_point renderEnd = Clock::now();
+
+        if (!gOptions.headless)
+            glfwPollEvents();
+
+        Clock::time_point frameEnd = Clock::now();
+
+        sample.cpuInputMs = std::chrono::duration<double, std::milli>(renderStart - inputStart).count();
+        sample.cpuRenderMs = std::chrono::duration<double, std::milli>(renderEnd - renderStart).count();
+        sample.frameMs = std::chrono::duration<double, std::milli>(frameEnd - frameStart).count();
+        sample.stats = gFrameStats;
+        frameStart = frameEnd;
+    }
+
+    // Wait for the frames still in flight
+    glFinish();
+    for (int frame = std::max(0, frameCount - GPU_TIMER_FRAMES); frame < frameCount; ++frame)
+    {
+        UReadPassTimers(gPassTimers, frame % GPU_TIMER_FRAMES, samples[frame].gpuMs);
+        samples[frame].shadedSamples = UReadSampleCounter(gPassTimers, frame % GPU_TIMER_FRAMES);
+    }
+
+    UDestroyPassTimers(gPassTimers);
+
+    if (gOptions.headless)
+    {
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        UDestroyRenderTarget(target);
+    }
+
+    if (frameCount <= gOptions.warmupFrames)
+    {
+        cout << "Benchmark interrupted before any frame was measured" << endl;
+        return false;
+    }
+
+    samples.resize(frameCount);
+    samples.erase(samples.begin(), samples.begin() + gOptions.warmupFrames);
+    return true;
+}
+
+
+// Places the camera on an orbit around the table whose radius changes so the level of detail switches along the way;
+// the fragment and light benchmarks park it close to the table instead
+void UUpdateBenchCamera(int frame, int frameCount)
+{
+    const glm::vec3 target(0.0f, -5.0f, 0.0f);
+
+    if (gOptions.fragmentBenchmark || gOptions.lightBenchmark)
+    {
+        // Looking down at the objects on the table from close by, every pixel is shaded and the view never changes,
+        // so frame time follows the cost of the fragment shader (most visibly on a software rasterizer such as llvmpipe)
+        gCamera.Position = target + glm::vec3(0.0f, 3.0f, 5.0f);
+    }
+    else
+    {
+        float angle = 2.0f * PI * frame / frameCount;
+        float radius = 18.0f + 10.0f * cos(2.0f * angle);
+
+        gCamera.Position = target + glm::vec3(radius * sin(angle), 4.0f, radius * cos(angle));
+    }
+
+    // Point the camera at the table through its yaw and pitch so its basis vectors stay consistent
+    glm::vec3 direction = glm::normalize(target - gCamera.Position);
+    gCamera.Yaw = glm::degrees(atan2(direction.z, direction.x));
+    gCamera.Pitch = glm::degrees(asin(direction.y));
+    gCamera.ProcessMouseMovement(0.0f, 0.0f);
+}
+
+
+void UCreatePassTimers(GLPassTimers& timers)
+{
+    timers = GLPassTimers();
+    timers.enabled = true;
+    glGenQueries(GPU_TIMER_FRAMES * RENDER_PASS_COUNT, &timers.queries[0][0]);
+    glGenQueries(GPU_TIMER_FRAMES, timers.sampleQueries);
+}
+
+
+void UDestroyPassTimers(GLPassTimers& timers)
+{
+    glDeleteQueries(GPU_TIMER_FRAMES * RENDER_PASS_COUNT, &timers.queries[0][0]);
+    glDeleteQueries(GPU_TIMER_FRAMES, timers.sampleQueries);
+    timers.enabled = false;
+}
+
+
+// Starts timing a pass on the GPU; a no-op unless the benchmark is running
+void UBeginPassTimer(RenderPass pass)
+{
+    if (!gPassTimers.enabled)
+        return;
+
+    gPassTimers.issued[gPassTimers.slot][pass] = true;
+    glBeginQuery(GL_TIME_ELAPSED, gPassTimers.queries[gPassTimers.slot][pass]);
+}
+
+
+void UEndPassTimer()
+{
+    if (gPassTimers.enabled)
+        glEndQuery(GL_TIME_ELAPSED);
+}
+
+
+// Reads the pass times recorded in a ring entry, in milliseconds; waits for the GPU if they are not available yet
+void UReadPassTimers(GLPassTimers& timers, int slot, double* passMs)
+{
+    for (int pass = 0; pass < RENDER_PASS_COUNT; ++pass)
+    {
+        passMs[pass] = 0.0;
+        if (!timers.issued[slot][pass])
+            continue;
+
+        GLuint64 nanoseconds = 0;
+        glGetQueryObjectui64v(timers.queries[slot][pass], GL_QUERY_RESULT, &nanoseconds);
+        passMs[pass] = nanoseconds / 1.0e6;
+        timers.issued[slot][pass] = false;
+    }
+}
+
+
+// Counts the samples that pass the depth test until UEndSampleCounter(); a no-op unless the benchmark is running
+void UBeginSampleCounter()
+{
+    if (!gPassTimers.enabled)
+        return;
+
+    gPassTimers.samplesIssued[gPassTimers.slot] = true;
+    glBeginQuery(GL_SAMPLES_PASSED, gPassTimers.sampleQueries[gPassTimers.slot]);
+}
+
+
+void UEndSampleCounter()
+{
+    if (gPassTimers.enabled)
+        glEndQuery(GL_SAMPLES_PASSED);
+}
+
+
+// Reads the sample count recorded in a ring entry; waits for the GPU if it is not available yet
+double UReadSampleCounter(GLPassTimers& timers, int slot)
+{
+    if (!timers.samplesIssued[slot])
+        return 0.0;
+
+    GLuint64 samples = 0;
+    glGetQueryObjectui64v(timers.sampleQueries[slot], GL_QUERY_RESULT, &samples);
+    timers.samplesIssued[slot] = false;
+    return double(samples);
+}
+
+
+// Writes mean and nearest-rank percentiles of a series as a JSON object
+static void UWriteBenchSeries(std::ostream& out, std::vector<double> values)
+{
+    std::sort(values.begin(), values.end());
+
+    double sum = 0.0;
+    for (size_t i = 0; i < values.size(); ++i)
+        sum += values[i];
+
+    const double percentiles[] = { 50.0, 95.0, 99.0 };
+    out << "{ \"mean\": " << sum / values.size();
+    for (int i = 0; i < 3; ++i)
+    {
+        size_t rank = size_t(std::ceil(percentiles[i] / 100.0 * values.size()));
+        out << ", \"p" << int(percentiles[i]) << "\": " << values[std::max<size_t>(rank, 1) - 1];
+    }
+    out << ", \"min\": " << values.front() << ", \"max\": " << values.back() << " }";
+}
+
+
+// Writes the benchmark report: timing distributions in milliseconds and mean per-frame counters
+void UWriteBenchReport(std::ostream& out, const std::vector<BenchSample>& samples)
+{
+    size_t n = samples.size();
+    std::vector<double> frameMs(n), cpuInputMs(n), cpuRenderMs(n), cpuLightBinningMs(n), cpuShadowBuildMs(n), gpuMs(n, 0.0);
+    std::vector<double> passMs[RENDER_PASS_COUNT];
+    double drawCalls = 0.0, instances = 0.0, programBinds = 0.0, textureBinds = 0.0, vertexArrayBinds = 0.0;
+    double redundantStateChanges = 0.0;
+    double uniformUpdates = 0.0, triangles = 0.0, culledEntities = 0.0, bvhNodesVisited = 0.0;
+    double visibleLights = 0.0, clusterLightIndices = 0.0, shadedSamples = 0.0;
+    double shadowDrawCalls = 0.0, shadowInstances = 0.0, shadowStaticRebuilds = 0.0, shadowCacheHits = 0.0;
+    double occludedEntities = 0.0, occlusionQueries = 0.0;
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        const BenchSample& sample = samples[i];
+        frameMs[i] = sample.frameMs;
+        cpuInputMs[i] = sample.cpuInputMs;
+        cpuRenderMs[i] = sample.cpuRenderMs;
+        cpuLightBinningMs[i] = sample.stats.lightBinningMs;
+        cpuShadowBuildMs[i] = sample.stats.shadowBuildMs;
+        for (int pass = 0; pass < RENDER_PASS_COUNT; ++pass)
+        {
+            passMs[pass].push_back(sample.gpuMs[pass]);
+            gpuMs[i] += sample.gpuMs[pass];
+        }
+
+        drawCalls += sample.stats.drawCalls;
+        instances += sample.stats.instances;
+        programBinds += sample.stats.programBinds;
+        textureBinds += sample.stats.textureBinds;
+        vertexArrayBinds += sample.stats.vertexArrayBinds;
+        redundantStateChanges += sample.stats.redundantStateChanges;
+        uniformUpdates += sample.stats.uniformUpdates;
+        triangles += sample.stats.triangles;
+        culledEntities += sample.stats.culledEntities;
+        bvhNodesVisited += sample.stats.bvhNodesVisited;
+        visibleLights += sample.stats.visibleLights;
+        clusterLightIndices += sample.stats.clusterLightIndices;
+        shadedSamples += sample.shadedSamples;
+        shadowDrawCalls += sample.stats.shadowDrawCalls;
+        shadowInstances += sample.stats.shadowInstances;
+        shadowStaticRebuilds += sample.stats.shadowStaticRebuilds;
+        shadowCacheHits += sample.stats.shadowCacheHits;
+        occludedEntities += sample.stats.occludedEntities;
+        occlusionQueries += sample.stats.occlusionQueries;
+    }
+
+    out << "{" << endl
+        << "  \"frames\": " << n << "," << endl
+        << "  \"warmupFrames\": " << gOptions.warmupFrames << "," << endl
+        << "  \"width\": " << gViewportWidth << "," << endl
+        << "  \"height\": " << gViewportHeight << "," << endl
+        << "  \"headless\": " << (gOptions.headless ? "true" : "false") << "," << endl
+        << "  \"pointLights\": " << gPointLights.size() << "," << endl
+        << "  \"renderer\": \"" << (gDeferredShading ? "deferred" : "forward") << "\"," << endl
+        << "  \"depthPrepass\": " << (gOptions.depthPrepass ? "true" : "false") << "," << endl
+        << "  \"shadows\": " << (gOptions.shadows ? "true" : "false") << "," << endl
+        << "  \"shadowResolution\": " << gOptions.shadowResolution << "," << endl
+        << "  \"shadowTaps\": " << gOptions.shadowTaps << "," << endl
+        << "  \"occlusionCulling\": " << (gOptions.occlusionCulling ? "true" : "false") << "," << endl;
+
+    out << "  \"frameMs\": ";
+    UWriteBenchSeries(out, frameMs);
+    out << "," << endl << "  \"cpuInputMs\": ";
+    UWriteBenchSeries(out, cpuInputMs);
+    out << "," << endl << "  \"cpuRenderMs\": ";
+    UWriteBenchSeries(out, cpuRenderMs);
+    out << "," << endl << "  \"cpuLightBinningMs\": ";
+    UWriteBenchSeries(out, cpuLightBinningMs);
+    out << "," << endl << "  \"cpuShadowBuildMs\": ";
+    UWriteBenchSeries(out, cpuShadowBuildMs);
+    out << "," << endl << "  \"gpuMs\": ";
+    UWriteBenchSeries(out, gpuMs);
+    out << "," << endl << "  \"gpuPassMs\": {" << endl;
+    for (int pass = 0; pass < RENDER_PASS_COUNT; ++pass)
+    {
+        out << "    \"" << RENDER_PASS_NAMES[pass] << "\": ";
+        UWriteBenchSeries(out, passMs[pass]);
+        out << (pass + 1 < RENDER_PASS_COUNT ? "," : "") << endl;
+    }
+    out << "  }," << endl;
+
+    out << "  \"perFrame\": {" << endl
+        << "    \"drawCalls\": " << drawCalls / n << "," << endl
+        << "    \"instances\": " << instances / n << "," << endl
+        << "    \"programBinds\": " << programBinds / n << "," << endl
+        << "    \"textureBinds\": " << textureBinds / n << "," << endl
+        << "    \"vertexArrayBinds\": " << vertexArrayBinds / n << "," << endl
+        << "    \"stateChanges\": " << (programBinds + textureBinds + vertexArrayBinds) / n << "," << endl
+        << "    \"redundantStateChanges\": " << redundantStateChanges / n << "," << endl
+        << "    \"uniformUpdates\": " << uniformUpdates / n << "," << endl
+        << "    \"culledEntities\": " << culledEntities / n << "," << endl
+        << "    \"bvhNodesVisited\": " << bvhNodesVisited / n << "," << endl
+        << "    \"occludedEntities\": " << occludedEntities / n << "," << endl
+        << "    \"occlusionQueries\": " << occlusionQueries / n << "," << endl
+        << "    \"visibleLights\": " << visibleLights / n << "," << endl
+        << "    \"clusterLightIndices\": " << clusterLightIndices / n << "," << endl
+        << "    \"shadedSamples\": " << shadedSamples / n << "," << endl
+        << "    \"shadedSamplesPerPixel\": " << shadedSamples / n / (double(gViewportWidth) * gViewportHeight) << "," << endl
+        << "    \"shadowDrawCalls\": " << shadowDrawCalls / n << "," << endl
+        << "    \"shadowInstances\": " << shadowInstances / n << "," << endl
+        << "    \"shadowStaticRebuilds\": " << shadowStaticRebuilds / n << "," << endl
+        << "    \"shadowCacheHits\": " << shadowCacheHits / n << "," << endl
+        << "    \"triangles\": " << triangles / n << endl
+        << "  }" << endl
+        << "}" << endl;
+}
+
+
+// Runs the close-up benchmark with 2, 4, ... MAX_POINT_LIGHTS point lights and writes one full report per count
+bool URunLightSweep(std::ostream& out)
+{
+    // Every count starts from the same lamp position so the runs render the same frames
+    glm::vec3 lampPosition = gLightPosition;
+
+    out << "{" << endl << "\"lightSweep\": [" << endl;
+    for (int count = 2; count <= MAX_POINT_LIGHTS; count *= 2)
+    {
+        gLightPosition = lampPosition;
+        UCreateSceneLights(count);
+
+        std::vector<BenchSample> samples;
+        if (!URenderBenchmarkFrames(samples))
+            return false;
+
+        UWriteBenchReport(out, samples);
+        if (count * 2 <= MAX_POINT_LIGHTS)
+            out << "," << endl;
+
+        cout << "INFO: Benchmarked " << count << " point lights" << endl;
+    }
+    out << "]" << endl << "}" << endl;
+
+    gLightPosition = lampPosition;
+    UCreateSceneLights(gOptions.lightCount);
+    return true;
+}